@@ -0,0 +1,84 @@
+/* Generated by generate_default_prefix.c; do not edit. */
+
+#define DEFAULT_STREAM_PREFIX_SEED 12345ULL
+
+const uint32_t default_stream_prefix[MT_LEN] = {
+	0x2e264d0e, 0xc2e4d000, 0x5103807d, 0xf5d2cd00, 0x54523bb0, 0xfbb85800, 0xc13a81a3, 0xfeee8500,
+	0x112f6c6a, 0x012af000, 0xc51ced99, 0xe38a7d00, 0x1cd6a0e4, 0x1a470800, 0x01b4d477, 0x2ee02500,
+	0xd12e1db6, 0xc5731000, 0x1a1dbb85, 0x018dad00, 0x816348c8, 0xc79ef800, 0xb3dbb61b, 0x3ee94500,
+	0x55486a42, 0x5e103000, 0x83faac51, 0x5433dd00, 0x5c5acd8c, 0xa414a800, 0xa2e8edbf, 0x6592e500,
+	0xa5b203fe, 0xd2815000, 0x2be1732d, 0x3b7c0d00, 0x863bf060, 0x6fa79800, 0x1d44a3d3, 0x1e9b0500,
+	0xfc85e31a, 0xb30b7000, 0x9ceadf09, 0x934cbd00, 0x65a98134, 0x3d074800, 0x40a192c7, 0x0207a500,
+	0x08336f06, 0x15ba9000, 0x82c0c795, 0x6409ed00, 0xd1c3af58, 0xf2f63800, 0x9dee00ab, 0x94f8c500,
+	0x43bf79d2, 0xaf20b000, 0x2f8b14a1, 0x5e321d00, 0x28b3457c, 0xdb32e800, 0x4b060d6f, 0xc9d26500,
+	0xeffca6ae, 0xf3bfd000, 0xb435fe5d, 0x8e424d00, 0x2c81f910, 0x6bd9d800, 0xfa21df43, 0xc0e58500,
+	0xff33f58a, 0x30c3f000, 0x72c0def9, 0x148afd00, 0x1bc51584, 0x990b8800, 0xa3dd8857, 0xf5972500,
+	0xa29ad216, 0x53be1000, 0xf5693125, 0x30192d00, 0x87ce9fe8, 0x9e827800, 0xda54df7b, 0x91584500,
+	0x32559722, 0xab493000, 0x57b16f71, 0x609e5d00, 0x1214b22c, 0xa4b52800, 0x6b60a01f, 0xc1cde500,
+	0x2dda9ade, 0xadda5000, 0xfe228ecd, 0xfc338d00, 0x54b25c80, 0x65471800, 0x627e3cb3, 0xcda00500,
+	0x3a90867a, 0xdca07000, 0x341621a9, 0x3b2d3d00, 0xd9069b94, 0x2a73c800, 0x8bbf15e7, 0x400ea500,
+	0x320dbaa6, 0x699f9000, 0xfb85aaf5, 0xe79d6d00, 0xf13de038, 0xf04db800, 0x361483cb, 0x3c29c500,
+	0x2ab658f2, 0xd869b000, 0x8cda6401, 0x716e9d00, 0x4e16df5c, 0x391b6800, 0xf00ff28f, 0x31bd6500,
+	0xe206424e, 0x1752d000, 0x83d0b33d, 0x45c1cd00, 0xc4bb0670, 0x5f395800, 0xe03de663, 0xada48500,
+	0x4afd972a, 0xd1b8f000, 0x68304bd9, 0xe48b7d00, 0x73195f24, 0xc0600800, 0x10320d37, 0x925e2500,
+	0x37e61776, 0xa5711000, 0xa15f7645, 0xcbb4ad00, 0xe2f96e88, 0xbdd5f800, 0xa96f255b, 0x22c74500,
+	0x60d89882, 0x1f623000, 0x6454ed91, 0x4aaadd00, 0x46a993cc, 0x40a5a800, 0x4a630b7f, 0x4204e500,
+	0xb7baf7be, 0x77ff5000, 0xf3f501ed, 0xc77b0d00, 0x4a55ff20, 0x0e449800, 0xc238f913, 0x63490500,
+	0x3d11465a, 0xc2d97000, 0x71c9c049, 0x72fdbd00, 0xf02428f4, 0x15b04800, 0x4c5ba887, 0xb115a500,
+	0x4cc755c6, 0x76789000, 0xf374b1d5, 0x3d80ed00, 0x337dcc98, 0x9e793800, 0xd1a14eeb, 0x015ec500,
+	0xe3d25b12, 0x8eb2b000, 0xb0f68b61, 0xd6651d00, 0xf623d63c, 0xe293e800, 0xff90e82f, 0x9a046500,
+	0xfc58796e, 0x3689d000, 0x9495c59d, 0x7db14d00, 0x4e2d4450, 0xf97ad800, 0x3db74983, 0x47ef8500,
+	0xb7da69ca, 0x0a31f000, 0xff8798b9, 0xffebfd00, 0x70eb2644, 0xbb448800, 0x6ef24e97, 0x84252500,
+	0x1a23c156, 0x29301000, 0xeda06c65, 0x30602d00, 0x84a39a28, 0xf9e97800, 0xfe74403b, 0xbe6a4500,
+	0x87d1b9e2, 0xf55b3000, 0x6b09ea31, 0x05a55d00, 0xe8393cec, 0x61862800, 0x2636b95f, 0x61ffe500,
+	0xf1416c1e, 0x5f845000, 0x7dacfb0d, 0x4783660e, 0x0e836f79, 0x0f91187d, 0x247a77a8, 0x0505a8b0,
+	0x18a20967, 0xad1481a3, 0x7ddc8196, 0x5363776a, 0xe00f6d55, 0xa5c02599, 0x31b69784, 0x48fd73e4,
+	0xc4f2cec3, 0x704b9477, 0xa1758a72, 0x9659d6b6, 0x09bc86b1, 0x41a08385, 0x87c242e0, 0xd04c5bc8,
+	0x7017f95f, 0xbf0bb61b, 0xfb6039ce, 0x7a60d142, 0xd576328d, 0xd10ac451, 0xb030fcfc, 0x283b1e8c,
+	0x0092133b, 0xfaa02dbf, 0xb66024aa, 0xe6cd68fe, 0x7821e9e9, 0x792bab2d, 0xd2fe55d8, 0xc1ff6360,
+	0xb5ca5597, 0x748ea3d3, 0xa181f206, 0xd539b81a, 0x49ae23c5, 0xd053d709, 0x06ced634, 0x197e5234,
+	0xf78c8573, 0x7fcdd2c7, 0xdd7d12e2, 0x7e736406, 0xf0e75721, 0xfe7fbf95, 0xbcf13910, 0xb2dfbc58,
+	0x2a7e8dcf, 0xddee00ab, 0x1673927e, 0x4e3582d2, 0x535a7f3d, 0x6871bca1, 0x8099576c, 0x6322967c,
+	0x7f89d3ab, 0x770bcd6f, 0x5ccd74da, 0xfdc10dae, 0x380c5219, 0xb02ae65d, 0x29bf6848, 0x35b86a10,
+	0xcd8a6007, 0xa5f7df43, 0x586b5eb6, 0x9f2b6e8a, 0x84e70875, 0x653996f9, 0x8d02e0a4, 0x2556c684,
+	0x2838cde3, 0xa58cc857, 0x05c96b12, 0xf1669916, 0xf95a5951, 0xd1848925, 0x9481a780, 0xefef8ce8,
+	0x0a42807f, 0x8764df7b, 0x313166ee, 0x52bcac22, 0x12f37dad, 0x3ec98771, 0x9b94599c, 0x41f5612c,
+	0x6e7fe3db, 0x62ba601f, 0x1ab6b54a, 0x5c2571de, 0x2f746c89, 0xf28dd6cd, 0x47952ef8, 0x0164cf80,
+	0xb82e2cb7, 0x5d0c3cb3, 0x49ddab26, 0x63105d7a, 0x0f6e9ee5, 0x36aba9a9, 0xc66642d4, 0xd0794894,
+	0xa28fa413, 0xfe7155e7, 0xa60c1382, 0x3ec131a6, 0xf85c8bc1, 0xc1e252f5, 0x58210230, 0x8163f338,
+	0x474d74ef, 0x479483cb, 0x9899bb1e, 0x47d523f2, 0x4eef2bdd, 0x8f514c01, 0x8973900c, 0x33670c5c,
+	0xc21b024b, 0xfcc0328f, 0xfe38e5fa, 0xfce0694e, 0xafb27539, 0xdd4b2b3d, 0xe6cb1d68, 0x89009570,
+	0xd3570727, 0xd183e663, 0x48905756, 0x60e88c2a, 0x49aa6315, 0x4d1583d9, 0x35018d44, 0x3ea28c24,
+	0x34548c83, 0x65314d37, 0x379f8832, 0x5b36dc76, 0x45d62c71, 0x9a114e45, 0x1bd048a0, 0xe90a7d88,
+	0x55b3d71f, 0xeb7f255b, 0xb2686f8e, 0x37c12382, 0x9588884d, 0x1e058591, 0xa6e97abc, 0x3ec840cc,
+	0xbaf9b2fb, 0x026fcb7f, 0xb56dda6a, 0x82aa9cbe, 0xdd8a2fa9, 0xf7f6d9ed, 0x7cb3c398, 0x5b5d6c20,
+	0xe6956357, 0x95e2f913, 0xbbfb83c6, 0x78e41d5a, 0x28945985, 0x1e9bc849, 0x8a9f0ff4, 0x8b43fbf4,
+	0xfba70333, 0x2f4be887, 0x754f50a2, 0x6cee5ec6, 0xa8a6bee1, 0x8eb4c9d5, 0x9dccc6d0, 0x387ddf98,
+	0x6cd93b8f, 0x9da14eeb, 0xbf9d803e, 0x81f9a012, 0x21b696fd, 0xb91d2361, 0x35fd6d2c, 0x82f2053c,
+	0x4168b16b, 0xc921282f, 0x7e622a9a, 0xccc6d26e, 0x8764d9d9, 0xcb9ddd9d, 0xee8f9608, 0x61f0d750,
+	0x45d4ffc7, 0x77514983, 0x9dabac76, 0xb69bf2ca, 0xa1dffe35, 0xd6e5d0b9, 0x304a5e64, 0x3248f544,
+	0x3f620ba3, 0x79e70e97, 0x2dcee8d2, 0x68d68a56, 0xb6c67f11, 0xc27ed465, 0xc8232d40, 0xb9068928,
+	0x24057e3f, 0xba04403b, 0x3b2114ae, 0xf56b82e2, 0x58b8536d, 0x2d700231, 0x94f9575c, 0xcad8efec,
+	0xfc3a019b, 0x2de8795f, 0xac442b0a, 0xdcf1871e, 0xb3913249, 0x1464a30d, 0xa3b9ffb6, 0x74d9fc79,
+	0x8fa57a0a, 0x787877a8, 0xcbdc9556, 0x48bbd267, 0x6407a506, 0x4eaa0996, 0x9906b2fe, 0xf380be55,
+	0x71bc4e4a, 0x5184d784, 0xfccf07a6, 0xd5a745c3, 0x842575f6, 0xb6bd7272, 0x1b5ef046, 0x7dbe95b1,
+	0xd178992a, 0xdf4242e0, 0x3de9b616, 0x7cf3825f, 0x73dec786, 0xe77c11ce, 0xe2ed658e, 0xe7c7e18d,
+	0x6ce6cc5a, 0x82833cfc, 0xc39ea036, 0x28f5383b, 0x160c8146, 0xc004bcaa, 0x07c46ed6, 0x38be7ae9,
+	0xc1aae5ca, 0x86b055d8, 0x3f50c376, 0xf3544e97, 0x84040906, 0xe42f3a06, 0x1a542e1e, 0x57e5f0c5,
+	0x0fda954a, 0x43499634, 0xbde0fec6, 0xb0e54e73, 0x850f90f6, 0x8ee22ae2, 0xbce59f66, 0x8ed04421,
+	0x5ced814a, 0x91a13910, 0x33f16416, 0x3eb436cf, 0x7026eea6, 0x5881fa7e, 0xf3b2afae, 0x473bac3d,
+	0xa92b441a, 0x8ec9976c, 0xa9738b56, 0x0368b8ab, 0xec75e806, 0x3231acda, 0x12baa9f6, 0x2ac0c119,
+	0x26de4f4a, 0x5d556848, 0x901bfe96, 0xd5643b07, 0x00c72006, 0x684056b6, 0x079df63e, 0x9610db75,
+	0xdb525c0a, 0x8b36a0a4, 0xaeedf5e6, 0x296ac6e3, 0x69eebcf6, 0x5c481312, 0x21ebf886, 0x953e4a51,
+	0x177c586a, 0xf481a780, 0x21aa3816, 0x44ce7b7f, 0x4d9dc3c6, 0x4a2dceee, 0x90d69bce, 0x2ae2aead,
+	0xe38a705a, 0xa241999c, 0x98ca8c76, 0x494048db, 0xc5a1ef86, 0x4f07ad4a, 0xc6f98316, 0x6e75ff89,
+	0x6904434a, 0x31632ef8, 0x8a57b8b6, 0xe304b7b7, 0xf7d8b946, 0x52d6e326, 0xd13e945e, 0x2edd4de5,
+	0xd00468ca, 0x9f3f02d4, 0x7ba10306, 0xa9a1ef13, 0x677a2336, 0xd183ab82, 0xe11da7a6, 0xb6f598c1,
+	0x49eac70a, 0x5d910230, 0x24546c56, 0x19064fef, 0xb2d39ae6, 0xcc23531e, 0xd5b653ee, 0x430ef8dd,
+	0x10c44b5a, 0xc111500c, 0xca2ba196, 0xc1bae94b, 0x40b09a86, 0xfa99bdfa, 0x2f1be636, 0xb4ece639,
+	0x37c4bb0a, 0xed591d68, 0x753eded6, 0xd225dc27, 0x32009c06, 0x4effdf56, 0xd22c277e, 0x7335b015,
+	0xcb46ea4a, 0x5b17cd44, 0xee06be26, 0x654a0783, 0xffea0a76, 0x24767032, 0xe62920c6, 0x70f03f71,
+	0x4e6e262a, 0x705048a0, 0x2a982616, 0x1d96ac1f, 0x0f4fc206, 0xd585478e, 0x8b50d90e, 0x90795b4d,
+	0x829aa25a, 0xa3febabc, 0xe03d1cb6, 0xb4d199fb, 0xfb4459c6, 0x9880426a, 0x7dbc2156, 0xaf89bca9,
+	0x6702654a, 0x676dc398, 0xc1af63f6, 0xb9727857, 0x040f5986, 0xb18c4bc6, 0xd1b1a09e, 0x7f877f02,
+};
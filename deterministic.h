@@ -0,0 +1,92 @@
+#ifndef DETERMINISTIC_H
+#define DETERMINISTIC_H
+
+/*
+ * In-process API exported by deterministic_random_preload.so.
+ *
+ * A stream is a seeded generator identified by a 64-bit key. Every stream is
+ * derived from the process's root seed, so the same key yields the same
+ * bytes on every run. Positions count 32-bit words drawn; det_fill rounds up
+ * to whole words.
+ *
+ * Streams are not locked. Give each thread its own stream (det_stream_split
+ * is cheap) rather than sharing one.
+ *
+ * Programs should not link against the shim. Resolve these symbols with
+ * dlsym(RTLD_DEFAULT, ...) and fall back to the system RNG when they are
+ * missing; deterministic.hpp does exactly that.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DET_API_VERSION 1
+
+typedef struct det_stream det_stream_t;
+
+unsigned det_api_version(void);
+
+/*
+ * The stream behind getrandom, getentropy and /dev/{,u}random.
+ * It is owned by the shim; do not destroy it.
+ */
+det_stream_t* det_stream_default(void);
+
+det_stream_t* det_stream_create(uint64_t key);
+
+/*
+ * Create an independent child stream. The n-th split of a given stream
+ * always yields the same child, and the parent's position is unaffected.
+ */
+det_stream_t* det_stream_split(det_stream_t* parent);
+
+void det_stream_destroy(det_stream_t* stream);
+
+void det_fill(det_stream_t* stream, void* buffer, size_t size);
+
+void det_seek(det_stream_t* stream, uint64_t position);
+
+uint64_t det_tell(const det_stream_t* stream);
+
+/*
+ * Virtual clock. CLOCK_REALTIME starts at DETERMINISTIC_CLOCK_START (seconds
+ * since the epoch, default 2022-01-01) and every other clock at zero. Each
+ * read returns the current time and then advances every clock by
+ * DETERMINISTIC_CLOCK_STEP nanoseconds (default 1000), so consecutive reads
+ * are strictly increasing. With DETERMINISTIC_VIRTUAL_CLOCK=1, clock_gettime,
+ * gettimeofday and time read this clock too, and sleeps and timers run on it.
+ */
+int det_clock_gettime(clockid_t clock, struct timespec* time);
+
+/*
+ * Replace the six X's before the last suffix_length characters of pattern
+ * with this process's next temporary name, as mkstemp and friends do. Names
+ * hash DETERMINISTIC_NAMESPACE, the seed, the process's place in the process
+ * tree and a counter, so they repeat across runs of a job but not between
+ * concurrent jobs. Nothing is created. Returns 0, or -1 with errno EINVAL if
+ * the X's are missing.
+ */
+int det_tempname(char* pattern, int suffix_length);
+
+/*
+ * Zygote point for seed sweeps; call it once the expensive setup (imports,
+ * loading data) is done. Unless DETERMINISTIC_ZYGOTE_SEEDS is set, it
+ * returns -1 immediately. Otherwise this process becomes the zygote: it
+ * forks one child per seed, never returns, and exits nonzero if any child
+ * failed. In each child, det_zygote returns the seed's index, and every
+ * stream (including ones created before the call) now derives from that
+ * seed. State already drawn from a stream before the call, such as a seeded
+ * PRNG inside the program, is not refreshed; re-seed it from the shim.
+ */
+int det_zygote(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
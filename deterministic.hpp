@@ -0,0 +1,172 @@
+#ifndef DETERMINISTIC_HPP
+#define DETERMINISTIC_HPP
+
+/*
+ * Header-only C++ wrapper around deterministic.h.
+ *
+ * det::stream satisfies UniformRandomBitGenerator, so it plugs into <random>:
+ *
+ *     det::stream rng(42);
+ *     std::uniform_int_distribution<int> dist(0, 99);
+ *     int x = dist(rng);
+ *
+ * The shim's symbols are looked up with dlsym, so nothing needs to be linked.
+ * When the shim is not preloaded, streams draw from getrandom instead.
+ * Draws are buffered, so the hot path is an array read.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <system_error>
+#include <utility>
+
+#include <dlfcn.h>
+#include <sys/random.h>
+
+#include "deterministic.h"
+
+namespace det {
+
+namespace detail {
+
+struct api {
+	det_stream_t* (*stream_create)(std::uint64_t);
+	det_stream_t* (*stream_split)(det_stream_t*);
+	void (*stream_destroy)(det_stream_t*);
+	void (*fill)(det_stream_t*, void*, std::size_t);
+	void (*seek)(det_stream_t*, std::uint64_t);
+
+	bool loaded() const { return fill != nullptr; }
+
+	static const api& get() {
+		static const api instance = resolve();
+		return instance;
+	}
+
+private:
+	template <typename F>
+	static void lookup(F& function, const char* name) {
+		function = reinterpret_cast<F>(dlsym(RTLD_DEFAULT, name));
+	}
+
+	static api resolve() {
+		api result{};
+		auto version = reinterpret_cast<unsigned (*)()>(dlsym(RTLD_DEFAULT, "det_api_version"));
+		if (version == nullptr || version() != DET_API_VERSION) {
+			return result;
+		}
+		lookup(result.stream_create, "det_stream_create");
+		lookup(result.stream_split, "det_stream_split");
+		lookup(result.stream_destroy, "det_stream_destroy");
+		lookup(result.seek, "det_seek");
+		lookup(result.fill, "det_fill");
+		return result;
+	}
+};
+
+// Throws std::system_error if getrandom fails, as std::random_device does.
+inline void system_fill(void* buffer, std::size_t size) {
+	auto* bytes = static_cast<unsigned char*>(buffer);
+	while (size > 0) {
+		ssize_t got = getrandom(bytes, size, 0);
+		if (got > 0) {
+			bytes += got;
+			size -= static_cast<std::size_t>(got);
+		} else if (got < 0 && errno != EINTR) {
+			throw std::system_error(errno, std::generic_category(), "getrandom");
+		}
+	}
+}
+
+}  // namespace detail
+
+class stream {
+public:
+	using result_type = std::uint64_t;
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	explicit stream(std::uint64_t key)
+		: handle_(detail::api::get().loaded() ? detail::api::get().stream_create(key) : nullptr) {}
+
+	stream(const stream&) = delete;
+	stream& operator=(const stream&) = delete;
+
+	stream(stream&& other) noexcept { *this = std::move(other); }
+
+	stream& operator=(stream&& other) noexcept {
+		std::swap(handle_, other.handle_);
+		std::swap(next_, other.next_);
+		std::swap(buffer_, other.buffer_);
+		return *this;
+	}
+
+	~stream() {
+		if (handle_ != nullptr) {
+			detail::api::get().stream_destroy(handle_);
+		}
+	}
+
+	/*
+	 * True when draws come from the shim rather than the system RNG.
+	 */
+	bool deterministic() const { return handle_ != nullptr; }
+
+	result_type operator()() {
+		if (next_ == buffer_size) {
+			refill();
+		}
+		return buffer_[next_++];
+	}
+
+	/*
+	 * Bulk draw; bypasses the buffer.
+	 */
+	void fill(void* buffer, std::size_t size) {
+		if (handle_ != nullptr) {
+			detail::api::get().fill(handle_, buffer, size);
+		} else {
+			detail::system_fill(buffer, size);
+		}
+	}
+
+	stream split() {
+		stream child;
+		if (handle_ != nullptr) {
+			child.handle_ = detail::api::get().stream_split(handle_);
+		}
+		return child;
+	}
+
+	/*
+	 * Jump to the n-th value this wrapper would return after construction.
+	 * Has no effect on the system RNG fallback.
+	 */
+	void seek(std::uint64_t n) {
+		if (handle_ != nullptr) {
+			detail::api::get().seek(handle_, n * (sizeof(result_type) / sizeof(std::uint32_t)));
+			next_ = buffer_size;
+		}
+	}
+
+private:
+	static constexpr std::size_t buffer_size = 64;
+
+	stream() = default;
+
+	void refill() {
+		fill(buffer_, sizeof(buffer_));
+		next_ = 0;
+	}
+
+	det_stream_t* handle_ = nullptr;
+	std::size_t next_ = buffer_size;
+	result_type buffer_[buffer_size];
+};
+
+}  // namespace det
+
+#endif
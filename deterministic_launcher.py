@@ -0,0 +1,353 @@
+#!/usr/bin/env python3
+"""Run programs under deterministic_random_preload.so.
+
+    deterministic_launcher.py sweep --seeds 1,2,3 --output out/ -- python script.py
+
+sweep: run the program once as a zygote. When it reaches the zygote point
+(det_zygote, or patch_nondeterminism.zygote() in Python), it forks one child
+per seed, at most --jobs at a time. The children re-seed their streams and
+continue from there, so start-up and imports are paid once per sweep.
+
+    deterministic_launcher.py fuzz --seeds 0..100 --clock-steps 1,1000,1000000 \
+        --reap-orders native,fifo,lifo,seeded --failures failures.jsonl -- ./flaky_test
+    deterministic_launcher.py replay --failures failures.jsonl --index 0 --minimal
+
+fuzz: run the test under every combination of seed, virtual clock step and
+child reaping order, in parallel. Each failure is re-run to check that it
+reproduces, then shrunk to a minimal set of perturbations by greedily
+resetting each perturbation to its default, and recorded as one JSON line.
+replay: re-run a recorded failure (or its shrunk configuration) exactly.
+
+    det-batch jobs.txt --ledger ledger.tsv [--audit yesterday.tsv]
+
+batch: run every job in a job list under the shim, as many at a time as
+there are usable CPUs. Job i gets the seed mix_seed(--seed, i) and its id as
+DETERMINISTIC_NAMESPACE. Its stdout is digested as it streams, and any
+declared output files are digested when it exits. One ledger row (job,
+seed, exit code, digests, wall time) is appended per job as it finishes.
+"""
+
+from __future__ import annotations
+
+import argparse
+import concurrent.futures
+import contextlib
+import dataclasses
+import hashlib
+import itertools
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from pathlib import Path
+from typing import Callable
+
+
+default_preload = Path(__file__).resolve().parent / "deterministic_random_preload.so"
+
+
+def shim_env(preload: Path, extra: dict[str, str]) -> dict[str, str]:
+    env = dict(os.environ)
+    env["LD_PRELOAD"] = ":".join(filter(None, [env.get("LD_PRELOAD"), str(preload)]))
+    env.update(extra)
+    return env
+
+
+# The shim's defaults; a perturbation is any departure from these.
+unperturbed = {"seed": 12345, "clock_step": 1000, "reap_order": "native"}
+
+
+def perturbation_env(config: dict[str, object]) -> dict[str, str]:
+    return {
+        "DETERMINISTIC_SEED": str(config["seed"]),
+        "DETERMINISTIC_CLOCK_STEP": str(config["clock_step"]),
+        "DETERMINISTIC_REAP_ORDER": str(config["reap_order"]),
+    }
+
+
+def run_config(command: list[str], preload: Path, config: dict[str, object], timeout: float | None) -> int | None:
+    """Returns the exit code, or None on timeout."""
+    try:
+        return subprocess.run(
+            command,
+            env=shim_env(preload, perturbation_env(config)),
+            stdin=subprocess.DEVNULL,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            timeout=timeout,
+        ).returncode
+    except subprocess.TimeoutExpired:
+        return None
+
+
+def shrink(fails: Callable[[dict[str, object]], bool], config: dict[str, object]) -> dict[str, object]:
+    current = dict(config)
+    changed = True
+    while changed:
+        changed = False
+        for key, default in unperturbed.items():
+            if current[key] != default:
+                candidate = {**current, key: default}
+                if fails(candidate):
+                    current = candidate
+                    changed = True
+    return current
+
+
+def parse_seeds(seeds: str | None, seed_file: Path | None) -> list[int]:
+    if seed_file is not None:
+        return [int(line) for line in seed_file.read_text().split()]
+    if seeds is not None:
+        if ".." in seeds:
+            start, stop = seeds.split("..")
+            return list(range(int(start), int(stop)))
+        return [int(seed) for seed in seeds.split(",")]
+    raise SystemExit("one of --seeds or --seed-file is required")
+
+
+def sweep(args: argparse.Namespace) -> int:
+    seeds = parse_seeds(args.seeds, args.seed_file)
+    args.output.mkdir(parents=True, exist_ok=True)
+    summary = args.output / "summary.tsv"
+    summary.unlink(missing_ok=True)
+    with tempfile.NamedTemporaryFile("w", suffix=".seeds") as seed_list:
+        seed_list.write("".join(f"{seed}\n" for seed in seeds))
+        seed_list.flush()
+        env = shim_env(args.preload, {
+            "DETERMINISTIC_ZYGOTE_SEEDS": seed_list.name,
+            "DETERMINISTIC_ZYGOTE_JOBS": str(args.jobs),
+            "DETERMINISTIC_ZYGOTE_OUTPUT": str(args.output),
+        })
+        returncode = subprocess.run(args.command, env=env).returncode
+    if not summary.exists():
+        print(f"{args.command[0]} exited ({returncode}) without reaching the zygote point", file=sys.stderr)
+        return returncode or 1
+    failures = 0
+    for line in summary.read_text().splitlines():
+        index, seed, status = line.split("\t")
+        if int(status) != 0:
+            failures += 1
+            print(f"seed {seed} failed (wait status {status}); see {args.output / index}.stderr", file=sys.stderr)
+    print(f"{len(seeds) - failures}/{len(seeds)} seeds succeeded", file=sys.stderr)
+    return 0 if failures == 0 else 1
+
+
+def fuzz(args: argparse.Namespace) -> int:
+    configs = [
+        {"seed": seed, "clock_step": clock_step, "reap_order": reap_order}
+        for seed, clock_step, reap_order in itertools.product(
+            parse_seeds(args.seeds, args.seed_file),
+            [int(step) for step in args.clock_steps.split(",")],
+            args.reap_orders.split(","),
+        )
+    ]
+    outcomes: dict[str, int | None] = {}
+
+    def outcome(config: dict[str, object]) -> int | None:
+        key = json.dumps(config, sort_keys=True)
+        if key not in outcomes:
+            outcomes[key] = run_config(args.command, args.preload, config, args.timeout)
+        return outcomes[key]
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        results = list(pool.map(lambda config: run_config(args.command, args.preload, config, args.timeout), configs))
+    for config, returncode in zip(configs, results):
+        outcomes[json.dumps(config, sort_keys=True)] = returncode
+
+    failures = [(config, returncode) for config, returncode in zip(configs, results) if returncode != 0]
+    with args.failures.open("w") as failure_log:
+        for config, returncode in failures:
+            reproducible = run_config(args.command, args.preload, config, args.timeout) == returncode
+            minimal = shrink(lambda candidate: outcome(candidate) != 0, config) if reproducible else config
+            record = {
+                "command": args.command,
+                "config": config,
+                "returncode": returncode,
+                "reproducible": reproducible,
+                "minimal": minimal,
+            }
+            failure_log.write(json.dumps(record) + "\n")
+    minimal_configs = {json.dumps(json.loads(line)["minimal"], sort_keys=True) for line in args.failures.read_text().splitlines()}
+    print(f"{len(failures)}/{len(configs)} configurations failed", file=sys.stderr)
+    for config in sorted(minimal_configs):
+        print(f"minimal failing configuration: {config}", file=sys.stderr)
+    return 0 if not failures else 1
+
+
+def replay(args: argparse.Namespace) -> int:
+    records = args.failures.read_text().splitlines()
+    if args.index >= len(records):
+        raise SystemExit(f"{args.failures} has {len(records)} recorded failures")
+    record = json.loads(records[args.index])
+    config = record["minimal" if args.minimal else "config"]
+    command = args.command or record["command"]
+    print(f"replaying {config}", file=sys.stderr)
+    return subprocess.run(command, env=shim_env(args.preload, perturbation_env(config))).returncode
+
+
+def mix_seed(seed: int, salt: int) -> int:
+    """The shim's mix_seed (SplitMix64's finalizer)."""
+    mask = (1 << 64) - 1
+    z = (seed + 0x9e3779b97f4a7c15 * (salt + 1)) & mask
+    z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & mask
+    z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & mask
+    return z ^ (z >> 31)
+
+
+@dataclasses.dataclass
+class Job:
+    index: int
+    id: str
+    command: list[str]
+    outputs: list[str]
+
+
+def parse_jobs(path: Path) -> list[Job]:
+    jobs = []
+    for line in path.read_text().splitlines():
+        if not line.strip() or line.lstrip().startswith("#"):
+            continue
+        index = len(jobs)
+        if line.lstrip().startswith("{"):
+            spec = json.loads(line)
+            command = spec["command"] if isinstance(spec["command"], list) else ["/bin/sh", "-c", spec["command"]]
+            jobs.append(Job(index, str(spec.get("id", index)), command, spec.get("outputs", [])))
+        else:
+            jobs.append(Job(index, str(index), ["/bin/sh", "-c", line], []))
+    return jobs
+
+
+ledger_columns = ["job", "seed", "returncode", "stdout_sha256", "outputs_sha256", "wall_seconds"]
+
+
+def run_job(job: Job, seed: int, preload: Path, logs: Path | None) -> dict[str, str]:
+    env = shim_env(preload, {"DETERMINISTIC_SEED": str(seed), "DETERMINISTIC_NAMESPACE": job.id})
+    stdout_digest = hashlib.sha256()
+    start = time.monotonic()
+    with contextlib.ExitStack() as stack:
+        log = stack.enter_context((logs / f"{job.id}.stdout").open("wb")) if logs else None
+        stderr = stack.enter_context((logs / f"{job.id}.stderr").open("wb")) if logs else subprocess.DEVNULL
+        process = subprocess.Popen(job.command, env=env, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=stderr)
+        # Digest while the job runs, so stdout is never held in memory.
+        while chunk := process.stdout.read(1 << 16):
+            stdout_digest.update(chunk)
+            if log:
+                log.write(chunk)
+        returncode = process.wait()
+    wall = time.monotonic() - start
+    outputs_digest = hashlib.sha256()
+    missing = False
+    for output in job.outputs:
+        outputs_digest.update(output.encode() + b"\0")
+        try:
+            with open(output, "rb") as file:
+                while chunk := file.read(1 << 20):
+                    outputs_digest.update(chunk)
+        except FileNotFoundError:
+            # Typically a failed job; its row still belongs in the ledger.
+            missing = True
+    return {
+        "job": job.id,
+        "seed": str(seed),
+        "returncode": str(returncode),
+        "stdout_sha256": stdout_digest.hexdigest(),
+        "outputs_sha256": "missing" if missing else outputs_digest.hexdigest() if job.outputs else "-",
+        "wall_seconds": f"{wall:.3f}",
+    }
+
+
+def read_ledger(path: Path) -> dict[str, dict[str, str]]:
+    rows = [line.split("\t") for line in path.read_text().splitlines()]
+    return {row[0]: dict(zip(rows[0], row)) for row in rows[1:]}
+
+
+def batch(args: argparse.Namespace) -> int:
+    jobs = parse_jobs(args.jobs)
+    if args.logs:
+        args.logs.mkdir(parents=True, exist_ok=True)
+    new_ledger = not args.ledger.exists() or args.ledger.stat().st_size == 0
+    ledger_lock = threading.Lock()
+    failures = 0
+    with args.ledger.open("a") as ledger:
+        if new_ledger:
+            ledger.write("\t".join(ledger_columns) + "\n")
+        # Workers pull the next job as soon as they are free, so long jobs do not hold up short ones.
+        with concurrent.futures.ThreadPoolExecutor(max_workers=args.workers) as pool:
+            futures = [
+                pool.submit(run_job, job, mix_seed(args.seed, job.index), args.preload, args.logs)
+                for job in jobs
+            ]
+            for future in concurrent.futures.as_completed(futures):
+                row = future.result()
+                failures += row["returncode"] != "0"
+                with ledger_lock:
+                    ledger.write("\t".join(row[column] for column in ledger_columns) + "\n")
+                    ledger.flush()
+    print(f"{len(jobs) - failures}/{len(jobs)} jobs succeeded", file=sys.stderr)
+    if args.audit:
+        previous = read_ledger(args.audit)
+        current = read_ledger(args.ledger)
+        mismatches = [
+            job.id for job in jobs
+            if job.id in previous and any(
+                previous[job.id][column] != current[job.id][column]
+                for column in ["seed", "stdout_sha256", "outputs_sha256"]
+            )
+        ]
+        for job_id in mismatches:
+            print(f"job {job_id} is not reproducible: digests differ from {args.audit}", file=sys.stderr)
+        if mismatches:
+            return 2
+    return 0 if failures == 0 else 1
+
+
+def main(argv: list[str]) -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    common = argparse.ArgumentParser(add_help=False)
+    common.add_argument("--preload", type=Path, default=default_preload, help="path to deterministic_random_preload.so")
+    subparsers = parser.add_subparsers(dest="mode", required=True)
+
+    sweep_parser = subparsers.add_parser("sweep", parents=[common], help="fork-server seed sweep")
+    sweep_parser.add_argument("--seeds", help="comma-separated seeds, or a range start..stop")
+    sweep_parser.add_argument("--seed-file", type=Path, help="file with one seed per line")
+    sweep_parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="children running at once")
+    sweep_parser.add_argument("--output", type=Path, required=True, help="directory for per-seed stdout/stderr and summary.tsv")
+    sweep_parser.add_argument("command", nargs="+")
+    sweep_parser.set_defaults(run=sweep)
+
+    fuzz_parser = subparsers.add_parser("fuzz", parents=[common], help="hunt for failing seeds and schedules")
+    fuzz_parser.add_argument("--seeds", default="0..16", help="comma-separated seeds, or a range start..stop")
+    fuzz_parser.add_argument("--seed-file", type=Path, help="file with one seed per line")
+    fuzz_parser.add_argument("--clock-steps", default=str(unperturbed["clock_step"]), help="comma-separated virtual clock steps (ns)")
+    fuzz_parser.add_argument("--reap-orders", default=str(unperturbed["reap_order"]), help="comma-separated subset of native,fifo,lifo,seeded")
+    fuzz_parser.add_argument("--jobs", type=int, default=os.cpu_count() or 1, help="runs at once")
+    fuzz_parser.add_argument("--timeout", type=float, help="seconds before a run counts as a failure")
+    fuzz_parser.add_argument("--failures", type=Path, required=True, help="JSON-lines file to record failures in")
+    fuzz_parser.add_argument("command", nargs="+")
+    fuzz_parser.set_defaults(run=fuzz)
+
+    replay_parser = subparsers.add_parser("replay", parents=[common], help="re-run a failure recorded by fuzz")
+    replay_parser.add_argument("--failures", type=Path, required=True)
+    replay_parser.add_argument("--index", type=int, default=0, help="which recorded failure")
+    replay_parser.add_argument("--minimal", action="store_true", help="use the shrunk configuration")
+    replay_parser.add_argument("command", nargs="*", help="override the recorded command")
+    replay_parser.set_defaults(run=replay)
+
+    batch_parser = subparsers.add_parser("batch", parents=[common], help="run a job list (also installed as det-batch)")
+    batch_parser.add_argument("jobs", type=Path, help="job list: one shell command per line, or JSON objects {id, command, outputs}")
+    batch_parser.add_argument("--seed", type=int, default=unperturbed["seed"], help="base seed that job seeds are derived from")
+    batch_parser.add_argument("--workers", type=int, default=len(os.sched_getaffinity(0)), help="jobs at once (default: usable CPUs)")
+    batch_parser.add_argument("--ledger", type=Path, required=True, help="TSV ledger to append results to")
+    batch_parser.add_argument("--logs", type=Path, help="directory to keep each job's stdout and stderr in")
+    batch_parser.add_argument("--audit", type=Path, help="earlier ledger; report jobs whose digests differ from it")
+    batch_parser.set_defaults(run=batch)
+
+    args = parser.parse_args(argv)
+    return args.run(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
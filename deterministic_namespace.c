@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+/*
+gcc -O2 -Wall -Werror -o deterministic_namespace deterministic_namespace.c
+./deterministic_namespace --seed 42 -- head -c 16 /dev/urandom | xxd
+
+Runs a command in new user and mount namespaces (no root needed) where
+/dev/random and /dev/urandom are a FIFO fed from a seeded Mersenne Twister.
+This is report.md's bind-mount idea without the chroot: it covers programs
+the preload cannot see, such as static binaries, as long as they read the
+device files rather than calling getrandom(2).
+
+The bytes are the shim's default stream for the same seed (DETERMINISTIC_SEED
+or --seed, default 12345). Every reader shares the one FIFO, so concurrent
+readers split the stream between them in whatever order they read.
+
+The launcher runs the command as its child and is itself the generator,
+so the command has no children it did not start. It keeps the FIFO open
+read-write, so opens never block and it never sees EPIPE. It feeds the
+FIFO with vmsplice from two page aligned buffers, each the size of the
+pipe. Once one buffer has been spliced in full, the other is out of the
+pipe and safe to refill, so data moves at pipe bandwidth with no copy
+into the kernel. When the command exits, the launcher exits with its
+status; SIGINT, SIGTERM, SIGHUP and SIGQUIT are passed on to it.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define INTERNAL
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#include "mersenne_twister.h"
+
+#define DEFAULT_SEED 12345
+#define DEFAULT_BATCH (1 << 20)
+
+void INTERNAL die(const char* what) {
+	perror(what);
+	exit(125);
+}
+
+void INTERNAL write_file(const char* path, const char* contents) {
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents)) {
+		die(path);
+	}
+	close(fd);
+}
+
+/*
+ * Enter a new user namespace, with our uid and gid mapped to themselves,
+ * and a private mount namespace. We hold every capability in it until the
+ * command is exec'd, which is all the mounts need.
+ */
+void INTERNAL enter_namespaces() {
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0) {
+		die("unshare (are unprivileged user namespaces enabled?)");
+	}
+	char map[64];
+	// Must be denied before an unprivileged process may write gid_map.
+	write_file("/proc/self/setgroups", "deny");
+	snprintf(map, sizeof(map), "%u %u 1", (unsigned)uid, (unsigned)uid);
+	write_file("/proc/self/uid_map", map);
+	snprintf(map, sizeof(map), "%u %u 1", (unsigned)gid, (unsigned)gid);
+	write_file("/proc/self/gid_map", map);
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+		die("mount --make-rprivate /");
+	}
+}
+
+pid_t command;
+volatile sig_atomic_t command_exited;
+
+void INTERNAL on_child(int signal) {
+	(void)signal;
+	command_exited = 1;
+}
+
+void INTERNAL forward_signal(int signal) {
+	kill(command, signal);
+}
+
+/*
+ * Returns false once the command has exited. SIGCHLD is blocked except
+ * inside ppoll, so an exit cannot slip in between the check and the wait.
+ */
+bool INTERNAL vmsplice_all(int fd, char* buffer, size_t size, const sigset_t* waiting) {
+	while (size > 0) {
+		if (command_exited) {
+			return false;
+		}
+		struct pollfd writable = {fd, POLLOUT, 0};
+		if (ppoll(&writable, 1, NULL, waiting) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			die("ppoll");
+		}
+		struct iovec vector = {buffer, size};
+		ssize_t written = vmsplice(fd, &vector, 1, SPLICE_F_NONBLOCK);
+		if (written < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			die("vmsplice");
+		}
+		buffer += written;
+		size -= written;
+	}
+	return true;
+}
+
+/*
+ * Feeds the FIFO until the command exits.
+ */
+void INTERNAL generate(int fd, uint64_t seed, size_t batch, const sigset_t* waiting) {
+	// The pipe must not hold more than one buffer; see the comment at the top.
+	int pipe_size = fcntl(fd, F_SETPIPE_SZ, (int)batch);
+	if (pipe_size > 0) {
+		batch = pipe_size;
+	} else if ((pipe_size = fcntl(fd, F_GETPIPE_SZ)) > 0) {
+		batch = pipe_size;
+	}
+	char* buffers[2];
+	for (size_t i = 0; i < 2; ++i) {
+		if (posix_memalign((void**)&buffers[i], sysconf(_SC_PAGESIZE), batch) != 0) {
+			die("posix_memalign");
+		}
+	}
+	mt_state state;
+	// The same seeding as the shim's default stream.
+	mt_init(&state, seed ^ (seed >> 32));
+	for (size_t turn = 0;; turn ^= 1) {
+		mt_fill(&state, (uint32_t*)buffers[turn], batch / sizeof(uint32_t));
+		if (!vmsplice_all(fd, buffers[turn], batch, waiting)) {
+			return;
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* seed_text = getenv("DETERMINISTIC_SEED");
+	uint64_t seed = seed_text != NULL && *seed_text != '\0' ? strtoull(seed_text, NULL, 0) : DEFAULT_SEED;
+	size_t batch = DEFAULT_BATCH;
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-'; ++first) {
+		if (strcmp(argv[first], "--seed") == 0 && first + 1 < argc) {
+			seed = strtoull(argv[++first], NULL, 0);
+		} else if (strcmp(argv[first], "--batch") == 0 && first + 1 < argc) {
+			batch = strtoull(argv[++first], NULL, 0);
+		} else if (strcmp(argv[first], "--") == 0) {
+			++first;
+			break;
+		} else {
+			break;
+		}
+	}
+	if (first >= argc) {
+		fprintf(stderr, "usage: %s [--seed N] [--batch BYTES] [--] command [args...]\n", argv[0]);
+		return 125;
+	}
+
+	char directory[] = "/tmp/deterministic_namespace.XXXXXX";
+	if (mkdtemp(directory) == NULL) {
+		die("mkdtemp");
+	}
+	char fifo[sizeof(directory) + 8];
+	snprintf(fifo, sizeof(fifo), "%s/random", directory);
+	if (mkfifo(fifo, 0666) != 0) {
+		die("mkfifo");
+	}
+
+	enter_namespaces();
+	if (mount(fifo, "/dev/urandom", NULL, MS_BIND, NULL) != 0) {
+		die("bind mount over /dev/urandom");
+	}
+	if (mount(fifo, "/dev/random", NULL, MS_BIND, NULL) != 0) {
+		die("bind mount over /dev/random");
+	}
+	int fd = open(fifo, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		die(fifo);
+	}
+	// The mounts keep the FIFO alive.
+	unlink(fifo);
+	rmdir(directory);
+
+	static const int forwarded[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+	sigset_t blocked;
+	sigset_t waiting;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	for (size_t i = 0; i < sizeof(forwarded) / sizeof(*forwarded); ++i) {
+		sigaddset(&blocked, forwarded[i]);
+	}
+	// Held until the command's pid is known and the handlers are in place.
+	sigprocmask(SIG_BLOCK, &blocked, &waiting);
+	command = fork();
+	if (command < 0) {
+		die("fork");
+	}
+	if (command == 0) {
+		close(fd);
+		sigprocmask(SIG_SETMASK, &waiting, NULL);
+		execvp(argv[first], &argv[first]);
+		perror(argv[first]);
+		_exit(127);
+	}
+	struct sigaction action = {0};
+	action.sa_handler = forward_signal;
+	for (size_t i = 0; i < sizeof(forwarded) / sizeof(*forwarded); ++i) {
+		sigaction(forwarded[i], &action, NULL);
+	}
+	action.sa_handler = on_child;
+	action.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &action, NULL);
+	// Forwarded signals are taken any time; SIGCHLD only inside ppoll.
+	sigdelset(&blocked, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &blocked, NULL);
+	sigdelset(&waiting, SIGCHLD);
+	generate(fd, seed, batch, &waiting);
+
+	int status;
+	while (waitpid(command, &status, 0) < 0) {
+		if (errno != EINTR) {
+			die("waitpid");
+		}
+	}
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		sigprocmask(SIG_SETMASK, &waiting, NULL);
+		raise(WTERMSIG(status));
+		return 128 + WTERMSIG(status);
+	}
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+
+/*
+gcc -O2 -Wall -Werror -fPIC -shared $(python3-config --includes) -I$(python3 -c 'import numpy; print(numpy.get_include())') -o deterministic_numpy$(python3-config --extension-suffix) deterministic_numpy.c
+
+LD_PRELOAD=./deterministic_random_preload.so python -c 'import numpy, deterministic_numpy; print(numpy.random.Generator(deterministic_numpy.ShimBitGenerator()).random(3))'
+LD_PRELOAD=./deterministic_random_preload.so python -c 'import numpy, deterministic_numpy; deterministic_numpy.install(); print(numpy.random.random(3))'
+ */
+
+#include <Python.h>
+#include <structmember.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <sys/random.h>
+
+#include <numpy/random/bitgen.h>
+
+#include "deterministic.h"
+
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+/*
+ * Number of 64-bit words fetched from the stream per refill.
+ */
+#define BUFFER_LEN 256
+
+typedef struct {
+	det_stream_t* (*stream_default)(void);
+	det_stream_t* (*stream_create)(uint64_t);
+	det_stream_t* (*stream_split)(det_stream_t*);
+	void (*stream_destroy)(det_stream_t*);
+	void (*fill)(det_stream_t*, void*, size_t);
+	void (*seek)(det_stream_t*, uint64_t);
+	uint64_t (*tell)(const det_stream_t*);
+} shim_api_t;
+
+static shim_api_t shim;
+
+typedef struct {
+	det_stream_t* stream;
+	uint64_t buffer[BUFFER_LEN];
+	size_t next;
+	bool has_uint32;
+	uint32_t uinteger;
+} shim_state_t;
+
+typedef struct {
+	PyObject_HEAD
+	shim_state_t state;
+	bitgen_t bitgen;
+	PyObject* capsule;
+	PyObject* lock;
+} ShimBitGenerator;
+
+static void load_shim(void) {
+	unsigned (*version)(void) = dlsym(RTLD_DEFAULT, "det_api_version");
+	if (version == NULL || version() != DET_API_VERSION) {
+		return;
+	}
+	shim.stream_default = dlsym(RTLD_DEFAULT, "det_stream_default");
+	shim.stream_create = dlsym(RTLD_DEFAULT, "det_stream_create");
+	shim.stream_split = dlsym(RTLD_DEFAULT, "det_stream_split");
+	shim.stream_destroy = dlsym(RTLD_DEFAULT, "det_stream_destroy");
+	shim.seek = dlsym(RTLD_DEFAULT, "det_seek");
+	shim.tell = dlsym(RTLD_DEFAULT, "det_tell");
+	shim.fill = dlsym(RTLD_DEFAULT, "det_fill");
+}
+
+/*
+ * Aborts if getrandom fails: numpy calls next_uint64 with no way to report
+ * an error, and handing back unfilled values would be worse.
+ */
+static void system_fill(void* buffer, size_t size) {
+	char* bytes = buffer;
+	while (size > 0) {
+		ssize_t got = getrandom(bytes, size, 0);
+		if (got > 0) {
+			bytes += got;
+			size -= got;
+		} else if (got < 0 && errno != EINTR) {
+			perror("deterministic_numpy: getrandom");
+			abort();
+		}
+	}
+}
+
+static void state_fill(shim_state_t* state, void* buffer, size_t size) {
+	if (state->stream != NULL) {
+		shim.fill(state->stream, buffer, size);
+	} else {
+		system_fill(buffer, size);
+	}
+}
+
+static uint64_t next_uint64(void* st) {
+	shim_state_t* state = st;
+	if (UNLIKELY(state->next == BUFFER_LEN)) {
+		state_fill(state, state->buffer, sizeof(state->buffer));
+		state->next = 0;
+	}
+	return state->buffer[state->next++];
+}
+
+static uint32_t next_uint32(void* st) {
+	shim_state_t* state = st;
+	if (state->has_uint32) {
+		state->has_uint32 = false;
+		return state->uinteger;
+	}
+	uint64_t next = next_uint64(st);
+	state->has_uint32 = true;
+	state->uinteger = (uint32_t)(next >> 32);
+	return (uint32_t)next;
+}
+
+static double next_double(void* st) {
+	return (next_uint64(st) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Position of the next unbuffered value, in stream words.
+ */
+static uint64_t state_position(const shim_state_t* state) {
+	uint64_t buffered = BUFFER_LEN - state->next;
+	return shim.tell(state->stream) - buffered * (sizeof(uint64_t) / sizeof(uint32_t));
+}
+
+static int ShimBitGenerator_init(ShimBitGenerator* self, PyObject* args, PyObject* kwargs) {
+	static char* kwlist[] = {"key", NULL};
+	PyObject* key = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &key)) {
+		return -1;
+	}
+	if (self->state.stream != NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "ShimBitGenerator is already initialized");
+		return -1;
+	}
+	if (shim.fill != NULL) {
+		if (key == Py_None) {
+			self->state.stream = shim.stream_split(shim.stream_default());
+		} else {
+			unsigned long long value = PyLong_AsUnsignedLongLong(key);
+			if (value == (unsigned long long)-1 && PyErr_Occurred()) {
+				return -1;
+			}
+			self->state.stream = shim.stream_create(value);
+		}
+		if (self->state.stream == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+	}
+	self->state.next = BUFFER_LEN;
+	self->state.has_uint32 = false;
+
+	self->bitgen.state = &self->state;
+	self->bitgen.next_uint64 = next_uint64;
+	self->bitgen.next_uint32 = next_uint32;
+	self->bitgen.next_double = next_double;
+	self->bitgen.next_raw = next_uint64;
+
+	self->capsule = PyCapsule_New(&self->bitgen, "BitGenerator", NULL);
+	if (self->capsule == NULL) {
+		return -1;
+	}
+	PyObject* threading = PyImport_ImportModule("threading");
+	if (threading == NULL) {
+		return -1;
+	}
+	self->lock = PyObject_CallMethod(threading, "Lock", NULL);
+	Py_DECREF(threading);
+	return self->lock == NULL ? -1 : 0;
+}
+
+static void ShimBitGenerator_dealloc(ShimBitGenerator* self) {
+	if (self->state.stream != NULL) {
+		shim.stream_destroy(self->state.stream);
+	}
+	Py_XDECREF(self->capsule);
+	Py_XDECREF(self->lock);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * The state is guarded by self->lock, as numpy's own bit generators do in
+ * random_raw, since it is used with the GIL released.
+ */
+static int lock_state(ShimBitGenerator* self) {
+	PyObject* acquired = PyObject_CallMethod(self->lock, "acquire", NULL);
+	Py_XDECREF(acquired);
+	return acquired == NULL ? -1 : 0;
+}
+
+static void unlock_state(ShimBitGenerator* self) {
+	PyObject* released = PyObject_CallMethod(self->lock, "release", NULL);
+	Py_XDECREF(released);
+}
+
+/*
+ * random_raw(size=None, output=True)
+ * Draws whole arrays with one det_fill, skipping the per-value buffer.
+ */
+static PyObject* ShimBitGenerator_random_raw(ShimBitGenerator* self, PyObject* args, PyObject* kwargs) {
+	static char* kwlist[] = {"size", "output", NULL};
+	PyObject* size = Py_None;
+	int output = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Op", kwlist, &size, &output)) {
+		return NULL;
+	}
+	if (size == Py_None) {
+		if (lock_state(self) < 0) {
+			return NULL;
+		}
+		uint64_t value = next_uint64(&self->state);
+		unlock_state(self);
+		return output ? PyLong_FromUnsignedLongLong(value) : Py_NewRef(Py_None);
+	}
+	PyObject* numpy = PyImport_ImportModule("numpy");
+	if (numpy == NULL) {
+		return NULL;
+	}
+	PyObject* array = PyObject_CallMethod(numpy, "empty", "Os", size, "uint64");
+	Py_DECREF(numpy);
+	if (array == NULL) {
+		return NULL;
+	}
+	Py_buffer view;
+	if (PyObject_GetBuffer(array, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+		Py_DECREF(array);
+		return NULL;
+	}
+	if (lock_state(self) < 0) {
+		PyBuffer_Release(&view);
+		Py_DECREF(array);
+		return NULL;
+	}
+	uint64_t* values = view.buf;
+	size_t count = view.len / sizeof(uint64_t);
+	size_t buffered = BUFFER_LEN - self->state.next;
+	if (buffered > count) {
+		buffered = count;
+	}
+	memcpy(values, &self->state.buffer[self->state.next], buffered * sizeof(uint64_t));
+	self->state.next += buffered;
+	Py_BEGIN_ALLOW_THREADS
+	state_fill(&self->state, values + buffered, (count - buffered) * sizeof(uint64_t));
+	Py_END_ALLOW_THREADS
+	unlock_state(self);
+	PyBuffer_Release(&view);
+	if (!output) {
+		Py_DECREF(array);
+		Py_RETURN_NONE;
+	}
+	return array;
+}
+
+static PyObject* ShimBitGenerator_get_state(ShimBitGenerator* self, void* closure) {
+	if (self->state.stream == NULL) {
+		return Py_BuildValue("{s:s,s:O}", "bit_generator", "ShimBitGenerator", "state", Py_None);
+	}
+	return Py_BuildValue(
+		"{s:s,s:{s:K}}",
+		"bit_generator", "ShimBitGenerator",
+		"state",
+		"position", (unsigned long long)state_position(&self->state)
+	);
+}
+
+static int ShimBitGenerator_set_state(ShimBitGenerator* self, PyObject* value, void* closure) {
+	if (self->state.stream == NULL) {
+		PyErr_SetString(PyExc_ValueError, "the system RNG fallback has no state to set");
+		return -1;
+	}
+	PyObject* inner = value == NULL ? NULL : PyDict_GetItemString(value, "state");
+	PyObject* position = inner == NULL ? NULL : PyDict_GetItemString(inner, "position");
+	if (position == NULL) {
+		PyErr_SetString(PyExc_ValueError, "state must be a dict with state['position']");
+		return -1;
+	}
+	unsigned long long words = PyLong_AsUnsignedLongLong(position);
+	if (words == (unsigned long long)-1 && PyErr_Occurred()) {
+		return -1;
+	}
+	shim.seek(self->state.stream, words);
+	self->state.next = BUFFER_LEN;
+	self->state.has_uint32 = false;
+	return 0;
+}
+
+static PyObject* ShimBitGenerator_get_deterministic(ShimBitGenerator* self, void* closure) {
+	return PyBool_FromLong(self->state.stream != NULL);
+}
+
+static PyMemberDef ShimBitGenerator_members[] = {
+	{"capsule", T_OBJECT, offsetof(ShimBitGenerator, capsule), READONLY, "bitgen_t capsule consumed by numpy.random.Generator"},
+	{"lock", T_OBJECT, offsetof(ShimBitGenerator, lock), READONLY, "Lock shared with numpy.random.Generator"},
+	{NULL},
+};
+
+static PyGetSetDef ShimBitGenerator_getset[] = {
+	{"state", (getter)ShimBitGenerator_get_state, (setter)ShimBitGenerator_set_state, "Stream position", NULL},
+	{"deterministic", (getter)ShimBitGenerator_get_deterministic, NULL, "True when draws come from the shim", NULL},
+	{NULL},
+};
+
+static PyMethodDef ShimBitGenerator_methods[] = {
+	{"random_raw", (PyCFunction)(void(*)(void))ShimBitGenerator_random_raw, METH_VARARGS | METH_KEYWORDS, "Return raw 64-bit draws"},
+	{NULL},
+};
+
+static PyTypeObject ShimBitGeneratorType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "deterministic_numpy.ShimBitGenerator",
+	.tp_doc = "numpy BitGenerator that draws from a stream of deterministic_random_preload.so.\n\n"
+		"ShimBitGenerator() splits a fresh stream off the default stream; ShimBitGenerator(key) opens the stream with that key.\n"
+		"Without the shim preloaded, it draws from the system RNG.",
+	.tp_basicsize = sizeof(ShimBitGenerator),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)ShimBitGenerator_init,
+	.tp_dealloc = (destructor)ShimBitGenerator_dealloc,
+	.tp_members = ShimBitGenerator_members,
+	.tp_getset = ShimBitGenerator_getset,
+	.tp_methods = ShimBitGenerator_methods,
+};
+
+/*
+ * install()
+ * Point numpy's legacy global functions (numpy.random.random, ...) at a shim stream.
+ */
+static PyObject* install(PyObject* module, PyObject* unused) {
+	PyObject* bitgen = PyObject_CallNoArgs((PyObject*)&ShimBitGeneratorType);
+	if (bitgen == NULL) {
+		return NULL;
+	}
+	PyObject* random = PyImport_ImportModule("numpy.random");
+	if (random == NULL) {
+		Py_DECREF(bitgen);
+		return NULL;
+	}
+	PyObject* result = PyObject_CallMethod(random, "set_bit_generator", "O", bitgen);
+	Py_DECREF(random);
+	Py_XDECREF(result);
+	if (result == NULL) {
+		Py_DECREF(bitgen);
+		return NULL;
+	}
+	return bitgen;
+}
+
+static PyMethodDef module_methods[] = {
+	{"install", install, METH_NOARGS, "Back numpy.random's global generator with a shim stream; returns the bit generator"},
+	{NULL},
+};
+
+static struct PyModuleDef module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "deterministic_numpy",
+	.m_doc = "numpy bit generators backed by deterministic_random_preload.so",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_deterministic_numpy(void) {
+	load_shim();
+	if (PyType_Ready(&ShimBitGeneratorType) < 0) {
+		return NULL;
+	}
+	PyObject* m = PyModule_Create(&module);
+	if (m == NULL) {
+		return NULL;
+	}
+	Py_INCREF(&ShimBitGeneratorType);
+	if (PyModule_AddObject(m, "ShimBitGenerator", (PyObject*)&ShimBitGeneratorType) < 0) {
+		Py_DECREF(&ShimBitGeneratorType);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
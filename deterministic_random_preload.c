@@ -3,6 +3,7 @@
 /*
 gcc -g -Og -Wall -Werror -fPIC -shared -o deterministic_random_preload.so deterministic_random_preload.c
 gcc    -O2 -Wall -Werror -fPIC -shared -o deterministic_random_preload.so deterministic_random_preload.c
+gcc    -O2 -Wall -Werror -fPIC -shared -DLAZY_IO_HOOKS=true -o deterministic_random_preload.so deterministic_random_preload.c
 LD_PRELOAD=./deterministic_random_preload.so python -c 'import random; print(random.randint(0, 99))'
 gdb --command=cpython/Misc/gdbinit --args env LD_PRELOAD=./deterministic_random_preload.so cpython/python -c 'import random; print(random.randint(0, 99))'
 
@@ -20,13 +21,46 @@ env \
 #include <dlfcn.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <link.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <sys/epoll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#if __GLIBC_PREREQ(2, 35)
+#include <sys/rseq.h>
+#endif
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/time.h>
+#include <sys/times.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <linux/mempolicy.h>
 
 #define INTERNAL
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
 
 #include "mersenne_twister.h"
+#include "deterministic.h"
+#include "default_stream_prefix.h"
 
 #define ENABLE true
 #define PRINT_INTERCEPTION false
@@ -37,153 +71,4290 @@ env \
 // The compiler will produce the same code.
 
 /*
- * The greatest possible number of open("/dev/random")s that may occur.
+ * With -DLAZY_IO_HOOKS=true, read, readv and close are not exported, so
+ * processes that never open an entropy path keep libc's I/O untouched. The
+ * first entropy open patches those GOT entries in every loaded object to
+ * point at our tracking wrappers instead. DETERMINISTIC_READ_CHUNKS and
+ * DETERMINISTIC_WATCH_WINDOW also need read, so setting either patches the
+ * GOTs at start-up. This one has to be an #if, since it decides which
+ * symbols exist.
  */
-#define MAX_RANDOM_FDS 8
+#ifndef LAZY_IO_HOOKS
+#define LAZY_IO_HOOKS false
+#endif
+
+/*
+ * Entropy fds are tracked in chunks of FD_CHUNK, allocated on first use, so
+ * lookups need no lock and no resizing.
+ */
+#define FD_CHUNK 1024
+#define FD_CHUNKS 1024
+
+#define DEFAULT_SEED 12345
+
+_Static_assert(DEFAULT_STREAM_PREFIX_SEED == DEFAULT_SEED, "regenerate default_stream_prefix.h with generate_default_prefix.c");
+
+/*
+ * Matches the FAKETIME that deterministic-run.conf passes to libfaketime.
+ */
+#define DEFAULT_CLOCK_START 1640995200
+#define DEFAULT_CLOCK_STEP 1000
+#define NS_PER_S 1000000000
+
+/*
+ * CLONE_VM children (vfork, posix_spawn, clone) that may be running shim code
+ * at once. Each gets a private stream while it shares our memory.
+ */
+#define MAX_VM_CHILDREN 16
+
+/*
+ * Which child wait(), or waitpid(-1, ...), reaps when several have exited.
+ * Set with DETERMINISTIC_REAP_ORDER=native|fifo|lifo|seeded. All but native
+ * pick one tracked child (oldest, newest, or seeded choice) and wait for that
+ * one specifically, so the order no longer depends on which exits first.
+ */
+typedef enum {
+	REAP_NATIVE,
+	REAP_FIFO,
+	REAP_LIFO,
+	REAP_SEEDED,
+} reap_order_t;
+
+struct det_stream {
+	mt_state state;
+	uint64_t key;
+	uint64_t position;
+	uint64_t splits;
+	uint32_t epoch;
+};
+
+/*
+ * A child that shares our address space until it execs or exits. It draws
+ * from its own stream, seeded from the spawn ordinal on first use, and keeps
+ * its own clock, so nothing it does shifts the parent's state.
+ */
+typedef struct {
+	pid_t pid;
+	bool ready;
+	uint64_t clock_ns;
+	det_stream_t stream;
+} vm_child_t;
+
+/*
+ * A timer that runs on the virtual clock (DETERMINISTIC_VIRTUAL_CLOCK). Slot
+ * 0 is ITIMER_REAL, shared by alarm and setitimer; the rest back
+ * timer_create. Deadlines are in virtual nanoseconds since the start.
+ */
+#define MAX_VIRTUAL_TIMERS 64
+
+/*
+ * What a SIGEV_THREAD timer's sigev_notify_attributes ask of its threads,
+ * copied at timer_create, since the caller may destroy the original then.
+ */
+typedef struct {
+	bool set;
+	size_t stack_size;
+	size_t guard_size;
+	int scope;
+	int inherit;
+	int policy;
+	struct sched_param parameters;
+	bool pinned;
+	cpu_set_t cpus;
+} thread_attributes_t;
+
+typedef struct {
+	bool allocated;
+	bool armed;
+	bool realtime;
+	uint64_t deadline;
+	uint64_t interval;
+	uint64_t overruns;
+	struct sigevent event;
+	thread_attributes_t attributes;
+} virtual_timer_t;
+
+/*
+ * DETERMINISTIC_EPOLL_ORDER=registration hands epoll_wait's ready events
+ * back sorted by when each fd was registered, rather than in the kernel's
+ * order. =settled first gathers readiness until a non-blocking poll finds
+ * nothing new. Each registration's epoll_data is kept here, and the kernel
+ * holds its slot and generation instead.
+ */
+typedef enum {
+	EPOLL_NATIVE,
+	EPOLL_REGISTRATION,
+	EPOLL_SETTLED,
+} epoll_order_t;
+
+#define EPOLL_SETTLE_ROUNDS 8
+
+typedef struct {
+	bool used;
+	int epfd;
+	int fd;
+	uint32_t generation;
+	/*
+	 * Slot plus one of the fd's next registration, or of the next free slot.
+	 */
+	uint32_t next;
+	uint64_t ordinal;
+	epoll_data_t data;
+} epoll_registration_t;
+
+typedef enum {
+	WATCH_NONE,
+	WATCH_INOTIFY,
+	WATCH_FANOTIFY,
+} watch_kind_t;
+
+/*
+ * The path an inotify watch was added with, to sort its events by.
+ */
+typedef struct {
+	int fd;
+	int wd;
+	char* path;
+} watched_path_t;
+
+/*
+ * DETERMINISTIC_POLICY names a file of "glob action" lines, deciding per
+ * calling library what getrandom, getentropy and /dev/{,u}random reads do:
+ *
+ *     # Keep real entropy for TLS.
+ *     libssl.so*      real
+ *     libcrypto.so*   real
+ *     _pcg64.*        stream
+ *     *               deterministic
+ *
+ * A glob containing '/' matches the library's path, otherwise its file name;
+ * the main program is matched by the path of /proc/self/exe. The first match
+ * wins, and unmatched libraries are deterministic. "stream" gives the library
+ * its own stream, keyed by its file name, so its draws do not shift anyone
+ * else's.
+ */
+typedef enum {
+	POLICY_DETERMINISTIC,
+	POLICY_REAL,
+	POLICY_STREAM,
+} policy_action_t;
+
+typedef struct {
+	char* pattern;
+	policy_action_t action;
+} policy_rule_t;
+
+typedef struct named_stream {
+	struct named_stream* next;
+	uint64_t key;
+	det_stream_t stream;
+} named_stream_t;
+
+/*
+ * Executable segments of every loaded object, sorted by start address.
+ */
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;
+	policy_action_t action;
+	det_stream_t* stream;
+} text_range_t;
+
+typedef struct range_table {
+	text_range_t* ranges;
+	size_t used_ranges;
+	size_t capacity;
+	/*
+	 * dl_iterate_phdr's load and unload counts when the table was built.
+	 */
+	unsigned long long adds;
+	unsigned long long subs;
+	struct range_table* next_retired;
+} range_table_t;
+
+/*
+ * DETERMINISTIC_ENTROPY_PATHS names a file of rules for which paths are
+ * served from a stream when opened. Each line is a path, or a prefix ending
+ * in '*', followed by options:
+ *
+ *     /dev/hwrng          stream=hwrng limit=64
+ *     /opt/vendor/seed*   stream=vendor
+ *     /dev/random         read_error=EAGAIN
+ *     /dev/arandom        open_error=ENOENT
+ *     /dev/urandom        real
+ *
+ * stream=NAME draws from the stream keyed by NAME (default: the default
+ * stream); limit=N makes reads return at most N bytes; open_error and
+ * read_error fail those calls with the given errno; real leaves the path
+ * alone. /dev/random and /dev/urandom are served unless a rule says
+ * otherwise. Served paths need not exist. Exact paths beat prefixes, longer
+ * prefixes beat shorter ones, and later lines beat earlier ones.
+ *
+ * The rules compile into a byte trie, so matching costs one step per byte of
+ * the path however many rules there are.
+ */
+typedef struct {
+	det_stream_t* stream;
+	size_t read_limit;
+	int open_error;
+	int read_error;
+	bool real;
+} entropy_rule_t;
+
+typedef struct {
+	int32_t exact_rule;
+	int32_t prefix_rule;
+	uint32_t first_edge;
+	uint32_t edge_count;
+} path_node_t;
+
+typedef struct {
+	uint8_t byte;
+	uint32_t target;
+} path_edge_t;
+
+/*
+ * Divergence watchdog. With DETERMINISTIC_DIGEST_RECORD=path, every
+ * intercepted result (entropy draws, virtual clock reads, reaped statuses)
+ * is folded into a rolling digest, and every DETERMINISTIC_DIGEST_INTERVAL
+ * events (default 4096) a checkpoint line is written to path.LINEAGE (see
+ * lineage_init), so each process image is checked against its counterpart.
+ * A later run with DETERMINISTIC_DIGEST_CHECK=path compares its own digest
+ * at each checkpoint and aborts with a report at the first mismatch, rather
+ * than running a doomed reproduction to the end.
+ */
+typedef enum {
+	DIGEST_OFF,
+	DIGEST_RECORD,
+	DIGEST_CHECK,
+} digest_mode_t;
+
+#define DEFAULT_DIGEST_INTERVAL 4096
+#define DIGEST_CALL_LENGTH 96
+
+typedef struct {
+	uint64_t event;
+	uint64_t digest;
+	char call[DIGEST_CALL_LENGTH];
+} digest_checkpoint_t;
 
 typedef struct {
 	bool initialized;
-	int random_fds[MAX_RANDOM_FDS];
-	size_t used_random_fds;
-	mt_state random_state;
+	entropy_rule_t* entropy_rules;
+	size_t used_entropy_rules;
+	path_node_t* path_nodes;
+	path_edge_t* path_edges;
+	/*
+	 * Rule index plus one for each open entropy fd, zero for other fds.
+	 */
+	uint16_t* entropy_fds[FD_CHUNKS];
+	uint64_t seed;
+	/*
+	 * Bumped whenever the root seed changes. Streams re-seed lazily when
+	 * their epoch is stale, so reseeding costs O(1) however many streams exist.
+	 */
+	uint32_t epoch;
+	det_stream_t random_state;
+	uint64_t clock_start;
+	uint64_t clock_step;
+	uint64_t clock_ns;
+	bool virtual_clock;
+	virtual_timer_t timers[MAX_VIRTUAL_TIMERS];
+	/*
+	 * The earliest armed deadline, or UINT64_MAX, so clock reads check for
+	 * due timers with one load.
+	 */
+	uint64_t next_deadline;
+	pthread_mutex_t timers_lock;
+	epoll_order_t epoll_order;
+	epoll_registration_t* epoll_registrations;
+	uint32_t used_epoll_registrations;
+	uint32_t epoll_registrations_capacity;
+	uint32_t free_epoll_registration;
+	/*
+	 * Slot plus one of each fd's first registration.
+	 */
+	uint32_t* epoll_fds[FD_CHUNKS];
+	uint64_t epoll_ordinals;
+	pthread_mutex_t epoll_lock;
+	/*
+	 * DETERMINISTIC_READ_CHUNKS: 0 to read pipes and stream sockets natively,
+	 * SIZE_MAX to fill each read, else the record size; see read_in_chunks.
+	 */
+	size_t read_chunk;
+	/*
+	 * DETERMINISTIC_WATCH_WINDOW in milliseconds, or -1 to read inotify and
+	 * fanotify fds natively; see read_watch_fd.
+	 */
+	int watch_window;
+	uint8_t* watch_fds[FD_CHUNKS];
+	watched_path_t* watched_paths;
+	size_t used_watched_paths;
+	size_t watched_paths_capacity;
+	pthread_mutex_t watch_lock;
+	uint64_t threads;
+	/*
+	 * DETERMINISTIC_VIRTUAL_CPUS, or 0 to report the real CPU.
+	 */
+	unsigned virtual_cpus;
+	bool disable_rseq;
+	reap_order_t reap_order;
+	uint64_t reaps;
+	/*
+	 * Live children from fork(), oldest first.
+	 */
+	pthread_mutex_t children_lock;
+	pid_t* children;
+	size_t used_children;
+	size_t children_capacity;
+	/*
+	 * The pid these globals belong to; a shim call from any other pid while
+	 * vm_pending is nonzero comes from a CLONE_VM child.
+	 */
+	pid_t pid;
+	uint32_t vm_pending;
+	uint64_t vm_spawns;
+	vm_child_t vm_children[MAX_VM_CHILDREN];
+	policy_rule_t* policy_rules;
+	size_t used_policy_rules;
+	/*
+	 * Replaced wholesale when a caller misses or a library is unloaded, if
+	 * the set of loaded objects has changed since it was built. Replaced
+	 * tables wait in retired_ranges until no reader is searching any table.
+	 */
+	range_table_t* ranges;
+	range_table_t* retired_ranges;
+	unsigned range_readers;
+	pthread_mutex_t ranges_lock;
+	named_stream_t* named_streams;
+	/*
+	 * LAZY_IO_HOOKS: whether the GOTs have been patched, and dl_iterate_phdr's
+	 * load count when they last were.
+	 */
+	bool io_hooks_active;
+	unsigned long long patched_loads;
+	pthread_mutex_t got_lock;
+	digest_mode_t digest_mode;
+	const char* digest_path;
+	char lineage[256];
+	bool lineage_known;
+	uint64_t forks;
+	uint64_t digest;
+	uint64_t digest_events;
+	uint64_t digest_interval;
+	FILE* digest_file;
+	digest_checkpoint_t* reference;
+	size_t used_reference;
+	size_t next_reference;
+	pthread_mutex_t digest_lock;
+	/*
+	 * The variables that carry the shim into exec'd programs, as they were
+	 * at start-up, in case the program scrubs its environment.
+	 */
+	char** carried;
+	size_t used_carried;
+	/*
+	 * Temporary names made by this process image.
+	 */
+	uint64_t tempnames;
 	int (*real_open)(const char*, int, mode_t);
-	size_t (*real_read)(int, void*, size_t);
+	int (*real_openat)(int, const char*, int, mode_t);
+	ssize_t (*real_read)(int, void*, size_t);
+	ssize_t (*real_readv)(int, const struct iovec*, int);
+	ssize_t (*real_recvfrom)(int, void*, size_t, int, struct sockaddr*, socklen_t*);
 	int (*real_close)(int);
 	size_t (*real_getrandom)(void*, size_t, unsigned int);
 	int (*real_getentropy)(void*, size_t);
+	pid_t (*real_fork)(void);
+	pid_t (*real_wait4)(pid_t, int*, int, struct rusage*);
+	int (*real_clone)(int (*)(void*), void*, int, void*, ...);
+	int (*real_posix_spawn)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char* const[], char* const[]);
+	int (*real_posix_spawnp)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*, char* const[], char* const[]);
+	int (*real_dlclose)(void*);
+	int (*real_execve)(const char*, char* const[], char* const[]);
+	int (*real_execvpe)(const char*, char* const[], char* const[]);
+	int (*real_fexecve)(int, char* const[], char* const[]);
+	int (*real_clock_gettime)(clockid_t, struct timespec*);
+	int (*real_gettimeofday)(struct timeval*, void*);
+	time_t (*real_time)(time_t*);
+	int (*real_nanosleep)(const struct timespec*, struct timespec*);
+	int (*real_clock_nanosleep)(clockid_t, int, const struct timespec*, struct timespec*);
+	unsigned int (*real_sleep)(unsigned int);
+	int (*real_usleep)(useconds_t);
+	unsigned int (*real_alarm)(unsigned int);
+	int (*real_setitimer)(__itimer_which_t, const struct itimerval*, struct itimerval*);
+	int (*real_getitimer)(__itimer_which_t, struct itimerval*);
+	int (*real_timer_create)(clockid_t, struct sigevent*, timer_t*);
+	int (*real_timer_settime)(timer_t, int, const struct itimerspec*, struct itimerspec*);
+	int (*real_timer_gettime)(timer_t, struct itimerspec*);
+	int (*real_timer_getoverrun)(timer_t);
+	int (*real_timer_delete)(timer_t);
+	int (*real_pause)(void);
+	int (*real_pthread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+	int (*real_sched_getcpu)(void);
+	int (*real_getcpu)(unsigned int*, unsigned int*);
+	int (*real_epoll_ctl)(int, int, int, struct epoll_event*);
+	int (*real_epoll_wait)(int, struct epoll_event*, int, int);
+	int (*real_epoll_pwait)(int, struct epoll_event*, int, int, const sigset_t*);
+#if __GLIBC_PREREQ(2, 35)
+	int (*real_epoll_pwait2)(int, struct epoll_event*, int, const struct timespec*, const sigset_t*);
+#endif
 } process_state_t;
 
-process_state_t process_state;
+process_state_t process_state = {
+	.children_lock = PTHREAD_MUTEX_INITIALIZER,
+	.ranges_lock = PTHREAD_MUTEX_INITIALIZER,
+	.got_lock = PTHREAD_MUTEX_INITIALIZER,
+	.digest_lock = PTHREAD_MUTEX_INITIALIZER,
+	.timers_lock = PTHREAD_MUTEX_INITIALIZER,
+	.epoll_lock = PTHREAD_MUTEX_INITIALIZER,
+	.watch_lock = PTHREAD_MUTEX_INITIALIZER,
+	.next_deadline = UINT64_MAX,
+};
 
-void INTERNAL ensure_initialized() {
-	if (!LIKELY(process_state.initialized)) {
-		if (PRINT_INTERCEPTION) {
-			printf("Intercepting: initializaiton\n");
-		}
-		process_state.initialized = true;
-		process_state.real_open = dlsym(RTLD_NEXT, "open");
-		process_state.real_read = dlsym(RTLD_NEXT, "read");
-		process_state.real_close = dlsym(RTLD_NEXT, "close");
-		process_state.real_getrandom = dlsym(RTLD_NEXT, "getrandom");
-		process_state.real_getentropy = dlsym(RTLD_NEXT, "getentropy");
-		process_state.used_random_fds = 0;
-		mt_init(&process_state.random_state, 12345);
+/*
+ * Spawn ordinal of the CLONE_VM child this thread is creating. A vfork child
+ * shares the thread's TLS, so it can read it.
+ */
+__thread uint64_t vm_spawn_ordinal;
+
+/*
+ * The lineage ordinal of that child; shared with fork's numbering.
+ */
+__thread uint64_t vm_spawn_lineage;
+
+/*
+ * This thread's creation ordinal within the process; see pthread_create.
+ */
+__thread uint64_t thread_ordinal;
+
+uint64_t INTERNAL env_u64(const char* name, uint64_t fallback) {
+	const char* value = getenv(name);
+	if (value == NULL || *value == '\0') {
+		return fallback;
 	}
+	return strtoull(value, NULL, 0);
 }
 
-bool INTERNAL full_random_fd() { return process_state.used_random_fds + 1 > MAX_RANDOM_FDS; }
-void INTERNAL set_random_fd(int fd) {
-	process_state.random_fds[process_state.used_random_fds] = fd;
-	process_state.used_random_fds++;
+/*
+ * SplitMix64's finalizer; used to derive seeds and keys that are unrelated to their inputs.
+ */
+uint64_t INTERNAL mix_seed(uint64_t seed, uint64_t salt) {
+	uint64_t z = seed + 0x9e3779b97f4a7c15 * (salt + 1);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
 }
-mt_state* INTERNAL get_random_fd(int fd) {
-	if (fd == 0) {
-		return NULL;
+
+/*
+ * Key 0 is the default stream, which is seeded with the root seed itself.
+ */
+void INTERNAL stream_reset(det_stream_t* stream) {
+	uint64_t seed = stream->key == 0 ? process_state.seed : mix_seed(process_state.seed, stream->key);
+	uint64_t folded = seed ^ (seed >> 32);
+	if (folded == (DEFAULT_STREAM_PREFIX_SEED ^ (DEFAULT_STREAM_PREFIX_SEED >> 32))) {
+		// The default seed's first block is precomputed; skip mt_init and the twist.
+		mt_init_twisted(&stream->state, default_stream_prefix);
+	} else {
+		mt_init(&stream->state, folded);
+	}
+	stream->position = 0;
+	stream->epoch = process_state.epoch;
+}
+
+void INTERNAL stream_sync(det_stream_t* stream) {
+	if (UNLIKELY(stream->epoch != process_state.epoch)) {
+		stream_reset(stream);
+	}
+}
+
+/*
+ * Under MPI and similar launchers every rank inherits the same
+ * DETERMINISTIC_SEED. Give each rank its own root, derived from the seed,
+ * the world size and the rank, so ranks draw independent numbers and a run
+ * is reproducible for a given rank count. DETERMINISTIC_RANK_VAR and
+ * DETERMINISTIC_SIZE_VAR name variables to use instead of the launchers'.
+ */
+const char* rank_vars[] = {"OMPI_COMM_WORLD_RANK", "PMI_RANK", "PMIX_RANK", "SLURM_PROCID"};
+const char* size_vars[] = {"OMPI_COMM_WORLD_SIZE", "PMI_SIZE", "PMIX_SIZE", "SLURM_NTASKS"};
+
+const char* INTERNAL first_env(const char* configured, const char** names, size_t count) {
+	const char* value;
+	if (configured != NULL && *configured != '\0') {
+		return getenv(configured);
 	}
-	for (size_t i = 0; i < process_state.used_random_fds; ++i) {
-		if (UNLIKELY(process_state.random_fds[i] == fd)) {
-			return &process_state.random_state;
+	for (size_t i = 0; i < count; ++i) {
+		if ((value = getenv(names[i])) != NULL && *value != '\0') {
+			return value;
 		}
 	}
 	return NULL;
 }
 
-void INTERNAL fill_with_random(mt_state* state, uint32_t* buffer, size_t size) {
-	for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
-		buffer[i] = mt_random(state);
-		if (PRINT_INTERCEPTION) {
-			printf("%08x", buffer[i]);
+uint64_t INTERNAL rank_seed(uint64_t seed) {
+	const char* rank = first_env(getenv("DETERMINISTIC_RANK_VAR"), rank_vars, sizeof(rank_vars) / sizeof(rank_vars[0]));
+	if (rank == NULL) {
+		return seed;
+	}
+	const char* size = first_env(getenv("DETERMINISTIC_SIZE_VAR"), size_vars, sizeof(size_vars) / sizeof(size_vars[0]));
+	return mix_seed(mix_seed(seed, size ? strtoull(size, NULL, 10) : 0), strtoull(rank, NULL, 10));
+}
+
+void INTERNAL reseed(uint64_t seed) {
+	process_state.seed = seed;
+	process_state.epoch++;
+}
+
+void INTERNAL stream_init(det_stream_t* stream, uint64_t key) {
+	stream->key = key;
+	stream->splits = 0;
+	stream_reset(stream);
+}
+
+reap_order_t INTERNAL parse_reap_order(const char* value) {
+	if (value == NULL) {
+		return REAP_NATIVE;
+	} else if (strcmp(value, "fifo") == 0) {
+		return REAP_FIFO;
+	} else if (strcmp(value, "lifo") == 0) {
+		return REAP_LIFO;
+	} else if (strcmp(value, "seeded") == 0) {
+		return REAP_SEEDED;
+	} else {
+		return REAP_NATIVE;
+	}
+}
+
+epoll_order_t INTERNAL parse_epoll_order(const char* value) {
+	if (value == NULL || *value == '\0' || strcmp(value, "native") == 0) {
+		return EPOLL_NATIVE;
+	}
+	if (strcmp(value, "registration") == 0) {
+		return EPOLL_REGISTRATION;
+	}
+	if (strcmp(value, "settled") == 0) {
+		return EPOLL_SETTLED;
+	}
+	fprintf(stderr, "deterministic: unknown DETERMINISTIC_EPOLL_ORDER %s; using native\n", value);
+	return EPOLL_NATIVE;
+}
+
+size_t INTERNAL parse_read_chunk(const char* value) {
+	if (value == NULL || *value == '\0' || strcmp(value, "native") == 0) {
+		return 0;
+	}
+	if (strcmp(value, "full") == 0) {
+		return SIZE_MAX;
+	}
+	char* end;
+	unsigned long long record = strtoull(value, &end, 0);
+	if (*end != '\0' || record == 0) {
+		fprintf(stderr, "deterministic: unknown DETERMINISTIC_READ_CHUNKS %s; using native\n", value);
+		return 0;
+	}
+	return record;
+}
+
+void INTERNAL load_policy(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), file)) {
+		char pattern[1024];
+		char action[32];
+		if (line[0] == '#' || sscanf(line, "%1023s %31s", pattern, action) != 2) {
+			continue;
+		}
+		policy_action_t parsed;
+		if (strcmp(action, "real") == 0) {
+			parsed = POLICY_REAL;
+		} else if (strcmp(action, "deterministic") == 0) {
+			parsed = POLICY_DETERMINISTIC;
+		} else if (strcmp(action, "stream") == 0) {
+			parsed = POLICY_STREAM;
+		} else {
+			fprintf(stderr, "%s: unknown action %s for %s\n", path, action, pattern);
+			continue;
+		}
+		policy_rule_t* rules = realloc(process_state.policy_rules, (process_state.used_policy_rules + 1) * sizeof(policy_rule_t));
+		if (rules == NULL) {
+			break;
 		}
+		process_state.policy_rules = rules;
+		rules[process_state.used_policy_rules++] = (policy_rule_t){strdup(pattern), parsed};
 	}
-	if (PRINT_INTERCEPTION) {
-		printf("\n");
+	fclose(file);
+}
+
+uint64_t INTERNAL hash_name(const char* name) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *name; ++name) {
+		hash = (hash ^ (uint8_t)*name) * 0x100000001b3ULL;
 	}
+	return hash;
 }
 
-bool INTERNAL remove_random_fd_if_exists(int fd) {
-	for (size_t i = 0; i < process_state.used_random_fds; ++i) {
-		if (UNLIKELY(process_state.random_fds[i] == fd)) {
-			process_state.random_fds[fd] = 0;
-			return true;
+/*
+ * Streams named by a policy, keyed by a hash of the name so they are the
+ * same on every run. Called during initialization or with ranges_lock held.
+ */
+det_stream_t* INTERNAL named_stream(const char* name) {
+	uint64_t key = hash_name(name);
+	for (named_stream_t* entry = process_state.named_streams; entry; entry = entry->next) {
+		if (entry->key == key) {
+			return &entry->stream;
 		}
 	}
-	return false;
+	named_stream_t* entry = malloc(sizeof(named_stream_t));
+	if (entry == NULL) {
+		return &process_state.random_state;
+	}
+	entry->key = key;
+	stream_init(&entry->stream, key);
+	entry->next = process_state.named_streams;
+	process_state.named_streams = entry;
+	return &entry->stream;
 }
 
-int open(const char* pathname, int flags, mode_t mode) {
-	ensure_initialized();
-	if (PRINT_CALL) {
-		printf("Called open(%s, %d, %d)\n", pathname, flags, mode);
+int INTERNAL parse_errno(const char* name) {
+	static const struct {
+		const char* name;
+		int value;
+	} names[] = {
+		{"EIO", EIO}, {"EAGAIN", EAGAIN}, {"EINTR", EINTR}, {"ENOENT", ENOENT}, {"EACCES", EACCES},
+		{"EPERM", EPERM}, {"ENODEV", ENODEV}, {"ENXIO", ENXIO}, {"EBUSY", EBUSY}, {"ENOSYS", ENOSYS},
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcmp(name, names[i].name) == 0) {
+			return names[i].value;
+		}
 	}
-	if (ENABLE && LIKELY(pathname != NULL) && UNLIKELY(strcmp(pathname, "/dev/random") || strcmp(pathname, "/dev/urandom"))) {
-		if (LIKELY(!full_random_fd())) {
-			int fd = process_state.real_open(pathname, flags, mode);
-			if (PRINT_INTERCEPTION) {
-				printf("Intercepting open(%s, %d, %d) = %d\n", pathname, flags, mode, fd);
-			}
-			set_random_fd(fd);
-			return fd;
+	return atoi(name);
+}
+
+typedef struct {
+	const char* pattern;
+	size_t length;
+	bool prefix;
+	int32_t rule;
+} path_pattern_t;
+
+int INTERNAL compare_patterns(const void* left, const void* right) {
+	const path_pattern_t* a = left;
+	const path_pattern_t* b = right;
+	int order = strcmp(a->pattern, b->pattern);
+	return order ? order : (a->rule > b->rule) - (a->rule < b->rule);
+}
+
+/*
+ * Builds the subtrie for patterns[low, high), which share their first depth
+ * bytes, at node. Each node's edges are contiguous and sorted by byte.
+ */
+void INTERNAL build_path_trie(path_pattern_t* patterns, size_t low, size_t high, size_t depth, uint32_t node, uint32_t* used_nodes, uint32_t* used_edges) {
+	path_node_t* nodes = process_state.path_nodes;
+	while (low < high && patterns[low].length == depth) {
+		// Sorted by rule within equal patterns, so later lines win.
+		if (patterns[low].prefix) {
+			nodes[node].prefix_rule = patterns[low].rule;
 		} else {
-			return -EMFILE;
+			nodes[node].exact_rule = patterns[low].rule;
 		}
-	} else {
-		return process_state.real_open(pathname, flags, mode);
+		low++;
+	}
+	nodes[node].first_edge = *used_edges;
+	nodes[node].edge_count = 0;
+	for (size_t i = low; i < high; ++i) {
+		if (i == low || patterns[i].pattern[depth] != patterns[i - 1].pattern[depth]) {
+			nodes[node].edge_count++;
+		}
+	}
+	*used_edges += nodes[node].edge_count;
+	size_t edge = nodes[node].first_edge;
+	for (size_t group = low; group < high;) {
+		size_t end = group;
+		while (end < high && patterns[end].pattern[depth] == patterns[group].pattern[depth]) {
+			end++;
+		}
+		uint32_t child = (*used_nodes)++;
+		nodes[child] = (path_node_t){.exact_rule = -1, .prefix_rule = -1};
+		process_state.path_edges[edge++] = (path_edge_t){(uint8_t)patterns[group].pattern[depth], child};
+		build_path_trie(patterns, group, end, depth + 1, child, used_nodes, used_edges);
+		group = end;
 	}
 }
 
-int close(int fd) {
-	ensure_initialized();
-	if (PRINT_CALL) {
-		printf("Called close(%d)\n", fd);
+/*
+ * Returns false if out of memory, leaving lines as it was.
+ */
+bool INTERNAL add_entropy_line(char*** lines, size_t* used_lines, const char* line) {
+	char** grown = realloc(*lines, (*used_lines + 1) * sizeof(char*));
+	if (grown == NULL) {
+		return false;
 	}
-	if (ENABLE && remove_random_fd_if_exists(fd) && PRINT_INTERCEPTION) {
-		printf("Intercepting close(%d)\n", fd);
+	*lines = grown;
+	char* copy = strdup(line);
+	if (copy == NULL) {
+		return false;
 	}
-	return process_state.real_close(fd);
+	grown[(*used_lines)++] = copy;
+	return true;
 }
 
-ssize_t read(int fd, void *buffer, size_t size) {
-	ensure_initialized();
-	if (PRINT_CALL) {
-		printf("Called read(%d, %p, %ld)\n", fd, buffer, size);
+void INTERNAL load_entropy_paths(const char* path) {
+	char** lines = NULL;
+	size_t used_lines = 0;
+	// The defaults come first so the file can override them.
+	const char* defaults[] = {"/dev/random", "/dev/urandom"};
+	for (size_t i = 0; i < 2; ++i) {
+		if (!add_entropy_line(&lines, &used_lines, defaults[i])) {
+			break;
+		}
 	}
-	mt_state* state;
-	if (ENABLE && UNLIKELY(NULL != (state = get_random_fd(fd)))) {
-		if (PRINT_INTERCEPTION) {
-			printf("Intercepting read(%d, %p, %ld)\n", fd, buffer, size);
+	FILE* file = path != NULL && *path != '\0' ? fopen(path, "r") : NULL;
+	if (path != NULL && *path != '\0' && file == NULL) {
+		perror(path);
+	}
+	char line[1024];
+	while (file != NULL && fgets(line, sizeof(line), file)) {
+		if (line[0] == '/' && !add_entropy_line(&lines, &used_lines, line)) {
+			break;
 		}
-		fill_with_random(&process_state.random_state, buffer, size);
-		return size;
-	} else {
-		return process_state.real_read(fd, buffer, size);
 	}
+	if (file != NULL) {
+		fclose(file);
+	}
+
+	// A trie has at most one node per pattern byte, plus the root.
+	size_t total_length = 0;
+	for (size_t i = 0; i < used_lines; ++i) {
+		total_length += strlen(lines[i]);
+	}
+	entropy_rule_t* rules = calloc(used_lines, sizeof(entropy_rule_t));
+	path_pattern_t* patterns = calloc(used_lines, sizeof(path_pattern_t));
+	path_node_t* nodes = calloc(total_length + 1, sizeof(path_node_t));
+	path_edge_t* edges = calloc(total_length + 1, sizeof(path_edge_t));
+	size_t used_rules = used_lines;
+	if (used_rules == 0 || rules == NULL || patterns == NULL || nodes == NULL || edges == NULL) {
+		// No rules: without a trie, match_entropy_path matches nothing.
+		free(rules);
+		free(patterns);
+		free(nodes);
+		free(edges);
+		rules = NULL;
+		used_rules = 0;
+	}
+	process_state.entropy_rules = rules;
+	for (size_t i = 0; i < used_rules; ++i) {
+		entropy_rule_t* rule = &process_state.entropy_rules[i];
+		rule->stream = &process_state.random_state;
+		char* saved;
+		char* pattern = strtok_r(lines[i], " \t\n", &saved);
+		for (char* option = strtok_r(NULL, " \t\n", &saved); option; option = strtok_r(NULL, " \t\n", &saved)) {
+			if (strncmp(option, "stream=", 7) == 0) {
+				rule->stream = strcmp(option + 7, "default") == 0 ? &process_state.random_state : named_stream(option + 7);
+			} else if (strncmp(option, "limit=", 6) == 0) {
+				rule->read_limit = strtoull(option + 6, NULL, 0);
+			} else if (strncmp(option, "open_error=", 11) == 0) {
+				rule->open_error = parse_errno(option + 11);
+			} else if (strncmp(option, "read_error=", 11) == 0) {
+				rule->read_error = parse_errno(option + 11);
+			} else if (strcmp(option, "real") == 0) {
+				rule->real = true;
+			} else {
+				fprintf(stderr, "%s: unknown option %s for %s\n", path, option, pattern);
+			}
+		}
+		size_t length = strlen(pattern);
+		bool prefix = length > 0 && pattern[length - 1] == '*';
+		patterns[i] = (path_pattern_t){pattern, length - prefix, prefix, i};
+		if (prefix) {
+			pattern[length - 1] = '\0';
+		}
+	}
+	if (used_rules > 0) {
+		qsort(patterns, used_rules, sizeof(path_pattern_t), compare_patterns);
+		process_state.path_edges = edges;
+		process_state.path_nodes = nodes;
+		nodes[0] = (path_node_t){.exact_rule = -1, .prefix_rule = -1};
+		uint32_t used_nodes = 1;
+		uint32_t used_edges = 0;
+		build_path_trie(patterns, 0, used_rules, 0, 0, &used_nodes, &used_edges);
+		process_state.used_entropy_rules = used_rules;
+		free(patterns);
+	}
+	for (size_t i = 0; i < used_lines; ++i) {
+		free(lines[i]);
+	}
+	free(lines);
 }
 
-ssize_t getrandom(void *buffer, size_t size, unsigned int flags) {
-	ensure_initialized();
-	if (ENABLE) {
-		if (PRINT_INTERCEPTION) {
-			printf("Intercepting getrandom(%p, %ld, %d)\n", buffer, size, flags);
+/*
+ * Returns the rule for path, or NULL if it is not an entropy source.
+ */
+const entropy_rule_t* INTERNAL match_entropy_path(const char* path) {
+	const path_node_t* nodes = process_state.path_nodes;
+	const path_edge_t* edges = process_state.path_edges;
+	if (UNLIKELY(nodes == NULL)) {
+		// Still initializing.
+		return NULL;
+	}
+	int32_t rule = -1;
+	uint32_t node = 0;
+	for (const uint8_t* cursor = (const uint8_t*)path;; ++cursor) {
+		if (nodes[node].prefix_rule >= 0) {
+			rule = nodes[node].prefix_rule;
 		}
-		fill_with_random(&process_state.random_state, buffer, size);
-		return size;
-	} else {
-		return process_state.real_getrandom(buffer, size, flags);
+		if (*cursor == '\0') {
+			if (nodes[node].exact_rule >= 0) {
+				rule = nodes[node].exact_rule;
+			}
+			break;
+		}
+		uint32_t low = nodes[node].first_edge;
+		uint32_t high = low + nodes[node].edge_count;
+		while (low < high) {
+			uint32_t middle = low + (high - low) / 2;
+			if (edges[middle].byte < *cursor) {
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+		if (low == nodes[node].first_edge + nodes[node].edge_count || edges[low].byte != *cursor) {
+			break;
+		}
+		node = edges[low].target;
 	}
+	return rule >= 0 && !process_state.entropy_rules[rule].real ? &process_state.entropy_rules[rule] : NULL;
 }
 
-int getentropy(void *buffer, size_t size) {
-	ensure_initialized();
-	if (PRINT_CALL) {
-		printf("Called getentropy(%p, %ld)\n", buffer, size);
+/*
+ * Opens this lineage's record, or loads its reference checkpoints.
+ */
+void INTERNAL digest_open() {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s.%s", process_state.digest_path, process_state.lineage);
+	process_state.digest = 0;
+	process_state.digest_events = 0;
+	process_state.next_reference = 0;
+	if (process_state.digest_mode == DIGEST_RECORD) {
+		process_state.digest_file = fopen(path, "we");
+		if (process_state.digest_file == NULL) {
+			perror(path);
+			process_state.digest_mode = DIGEST_OFF;
+		}
+		return;
 	}
-	if (ENABLE) {
-		if (PRINT_INTERCEPTION) {
-			printf("Intercepting getentropy(%p, %ld)\n", buffer, size);
+	FILE* file = fopen(path, "re");
+	if (file == NULL) {
+		fprintf(stderr, "deterministic watchdog: no reference %s; running unwatched\n", path);
+		process_state.digest_mode = DIGEST_OFF;
+		return;
+	}
+	free(process_state.reference);
+	process_state.reference = NULL;
+	process_state.used_reference = 0;
+	size_t capacity = 0;
+	char line[DIGEST_CALL_LENGTH + 64];
+	while (fgets(line, sizeof(line), file)) {
+		digest_checkpoint_t checkpoint = {0};
+		unsigned long long event;
+		unsigned long long digest;
+		if (sscanf(line, "%llu %llx %95[^\n]", &event, &digest, checkpoint.call) < 2) {
+			continue;
 		}
-		fill_with_random(&process_state.random_state, buffer, size);
-		return size;
+		checkpoint.event = event;
+		checkpoint.digest = digest;
+		if (process_state.used_reference == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			digest_checkpoint_t* reference = realloc(process_state.reference, capacity * sizeof(digest_checkpoint_t));
+			if (reference == NULL) {
+				break;
+			}
+			process_state.reference = reference;
+		}
+		process_state.reference[process_state.used_reference++] = checkpoint;
+	}
+	fclose(file);
+}
+
+/*
+ * The lineage names a process image the same way on every run, where pids
+ * do not: 0 for the first process, gaining ".n" for its n-th fork, vfork,
+ * clone, posix_spawn or exec. A fork child or exec'd image is handed its
+ * lineage along with its pid; a spawned program, whose pid is unknown until
+ * it runs, along with its parent's pid. A lineage inherited through a
+ * process the shim never saw is not ours, so it is replaced by "~pid".
+ */
+void INTERNAL lineage_init() {
+	const char* lineage = getenv("DETERMINISTIC_LINEAGE");
+	process_state.lineage_known = true;
+	if (lineage == NULL) {
+		strcpy(process_state.lineage, "0");
+	} else if ((pid_t)env_u64("DETERMINISTIC_LINEAGE_PID", 0) == process_state.pid || (pid_t)env_u64("DETERMINISTIC_LINEAGE_PARENT", 0) == syscall(SYS_getppid)) {
+		snprintf(process_state.lineage, sizeof(process_state.lineage), "%s", lineage);
 	} else {
-		return process_state.real_getentropy(buffer, size);
+		snprintf(process_state.lineage, sizeof(process_state.lineage), "~%d", (int)process_state.pid);
+		process_state.lineage_known = false;
+	}
+}
+
+/*
+ * In a fork child, move to lineage PARENT.n.
+ */
+void INTERNAL lineage_fork_child(uint64_t ordinal) {
+	process_state.tempnames = 0;
+	if (!process_state.lineage_known) {
+		return;
+	}
+	size_t length = strlen(process_state.lineage);
+	snprintf(process_state.lineage + length, sizeof(process_state.lineage) - length, ".%llu", (unsigned long long)ordinal);
+	char pid[32];
+	snprintf(pid, sizeof(pid), "%d", (int)process_state.pid);
+	setenv("DETERMINISTIC_LINEAGE", process_state.lineage, 1);
+	setenv("DETERMINISTIC_LINEAGE_PID", pid, 1);
+}
+
+void INTERNAL digest_init() {
+	const char* record = getenv("DETERMINISTIC_DIGEST_RECORD");
+	const char* check = getenv("DETERMINISTIC_DIGEST_CHECK");
+	if (record != NULL && *record != '\0') {
+		process_state.digest_mode = DIGEST_RECORD;
+		process_state.digest_path = record;
+	} else if (check != NULL && *check != '\0') {
+		process_state.digest_mode = DIGEST_CHECK;
+		process_state.digest_path = check;
+	} else {
+		return;
+	}
+	process_state.digest_interval = env_u64("DETERMINISTIC_DIGEST_INTERVAL", DEFAULT_DIGEST_INTERVAL);
+	if (process_state.digest_interval == 0) {
+		process_state.digest_interval = DEFAULT_DIGEST_INTERVAL;
+	}
+	if (!process_state.lineage_known) {
+		process_state.digest_mode = DIGEST_OFF;
+		return;
+	}
+	digest_open();
+}
+
+void INTERNAL digest_report(const char* call, const digest_checkpoint_t* expected) {
+	fprintf(stderr, "deterministic watchdog: %s (lineage %s) diverged from %s.%s\n", program_invocation_name, process_state.lineage, process_state.digest_path, process_state.lineage);
+	if (expected == NULL) {
+		fprintf(stderr, "  the reference ended before event %llu (%s)\n", (unsigned long long)process_state.digest_events, call);
+		return;
+	}
+	fprintf(stderr, "  at event %llu: %s gave digest %016llx; the reference had %016llx after %s\n", (unsigned long long)expected->event, call, (unsigned long long)process_state.digest, (unsigned long long)expected->digest, expected->call);
+	fprintf(stderr, "  the first divergent call is one of events %llu..%llu\n", (unsigned long long)(expected->event > process_state.digest_interval ? expected->event - process_state.digest_interval + 1 : 1), (unsigned long long)expected->event);
+}
+
+/*
+ * Called with digest_lock held, at every checkpoint and at exit.
+ */
+void INTERNAL digest_checkpoint(const char* call) {
+	if (process_state.digest_mode == DIGEST_RECORD) {
+		fprintf(process_state.digest_file, "%llu %016llx %s\n", (unsigned long long)process_state.digest_events, (unsigned long long)process_state.digest, call);
+		// Flushed every time, so a crash keeps what was recorded and fork copies no buffer.
+		fflush(process_state.digest_file);
+	} else {
+		const digest_checkpoint_t* expected = process_state.next_reference < process_state.used_reference ? &process_state.reference[process_state.next_reference++] : NULL;
+		if (expected == NULL || expected->event != process_state.digest_events || expected->digest != process_state.digest || strcmp(expected->call, call) != 0) {
+			digest_report(call, expected);
+			abort();
+		}
+	}
+}
+
+vm_child_t* INTERNAL current_vm_child();
+
+/*
+ * Folds one intercepted result into the digest.
+ */
+void INTERNAL digest_event(const char* call, uint64_t argument, uint64_t result) {
+	if (LIKELY(process_state.digest_mode == DIGEST_OFF) || current_vm_child() != NULL) {
+		return;
+	}
+	pthread_mutex_lock(&process_state.digest_lock);
+	process_state.digest = mix_seed(mix_seed(process_state.digest ^ hash_name(call), argument), result);
+	process_state.digest_events++;
+	if (UNLIKELY(process_state.digest_events % process_state.digest_interval == 0)) {
+		char description[DIGEST_CALL_LENGTH];
+		snprintf(description, sizeof(description), "%s(%llu)=%llu", call, (unsigned long long)argument, (unsigned long long)result);
+		digest_checkpoint(description);
+	}
+	pthread_mutex_unlock(&process_state.digest_lock);
+}
+
+__attribute__((destructor)) void INTERNAL digest_finish() {
+	if (process_state.digest_mode == DIGEST_OFF) {
+		return;
+	}
+	pthread_mutex_lock(&process_state.digest_lock);
+	// The final line also catches runs that end early or run long.
+	digest_checkpoint("exit");
+	if (process_state.digest_file != NULL) {
+		fclose(process_state.digest_file);
+		process_state.digest_file = NULL;
+	}
+	process_state.digest_mode = DIGEST_OFF;
+	pthread_mutex_unlock(&process_state.digest_lock);
+}
+
+/*
+ * In a fork child, after it has moved to its own lineage.
+ */
+void INTERNAL digest_fork_child() {
+	if (process_state.digest_mode == DIGEST_OFF) {
+		return;
+	}
+	process_state.digest_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	if (process_state.digest_file != NULL) {
+		fclose(process_state.digest_file);
+		process_state.digest_file = NULL;
+	}
+	digest_open();
+}
+
+bool INTERNAL same_name(const char* entry, const char* other) {
+	size_t length = strcspn(entry, "=");
+	return strncmp(entry, other, length) == 0 && other[length] == '=';
+}
+
+bool INTERNAL is_carried(const char* entry) {
+	return strncmp(entry, "DETERMINISTIC_", strlen("DETERMINISTIC_")) == 0 || same_name("LD_PRELOAD=", entry) || same_name("FAKETIME=", entry);
+}
+
+/*
+ * At load time, since a program may clear its environment before its first
+ * call into the shim.
+ */
+__attribute__((constructor)) void INTERNAL save_carried_environment() {
+	size_t count = 0;
+	for (char** entry = environ; *entry != NULL; ++entry) {
+		count += is_carried(*entry);
+	}
+	process_state.carried = calloc(count, sizeof(char*));
+	for (char** entry = environ; *entry != NULL && process_state.carried != NULL; ++entry) {
+		if (is_carried(*entry)) {
+			process_state.carried[process_state.used_carried++] = strdup(*entry);
+		}
+	}
+}
+
+/*
+ * For settings that must not reach exec'd programs any more.
+ */
+void INTERNAL forget_carried(const char* name) {
+	for (size_t i = 0; i < process_state.used_carried; ++i) {
+		if (strncmp(process_state.carried[i], name, strlen(name)) == 0 && process_state.carried[i][strlen(name)] == '=') {
+			process_state.carried[i] = process_state.carried[--process_state.used_carried];
+			--i;
+		}
+	}
+}
+
+void INTERNAL patch_io_hooks();
+
+void INTERNAL ensure_initialized() {
+	if (!LIKELY(process_state.initialized)) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting: initializaiton\n");
+		}
+		process_state.initialized = true;
+		process_state.real_open = dlsym(RTLD_NEXT, "open");
+		process_state.real_openat = dlsym(RTLD_NEXT, "openat");
+		process_state.real_read = dlsym(RTLD_NEXT, "read");
+		process_state.real_readv = dlsym(RTLD_NEXT, "readv");
+		process_state.real_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+		process_state.real_close = dlsym(RTLD_NEXT, "close");
+		process_state.real_getrandom = dlsym(RTLD_NEXT, "getrandom");
+		process_state.real_getentropy = dlsym(RTLD_NEXT, "getentropy");
+		process_state.real_fork = dlsym(RTLD_NEXT, "fork");
+		process_state.real_wait4 = dlsym(RTLD_NEXT, "wait4");
+		process_state.real_clone = dlsym(RTLD_NEXT, "clone");
+		process_state.real_posix_spawn = dlsym(RTLD_NEXT, "posix_spawn");
+		process_state.real_posix_spawnp = dlsym(RTLD_NEXT, "posix_spawnp");
+		process_state.real_dlclose = dlsym(RTLD_NEXT, "dlclose");
+		process_state.real_execve = dlsym(RTLD_NEXT, "execve");
+		process_state.real_execvpe = dlsym(RTLD_NEXT, "execvpe");
+		process_state.real_fexecve = dlsym(RTLD_NEXT, "fexecve");
+		process_state.real_clock_gettime = dlsym(RTLD_NEXT, "clock_gettime");
+		process_state.real_gettimeofday = dlsym(RTLD_NEXT, "gettimeofday");
+		process_state.real_time = dlsym(RTLD_NEXT, "time");
+		process_state.real_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+		process_state.real_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+		process_state.real_sleep = dlsym(RTLD_NEXT, "sleep");
+		process_state.real_usleep = dlsym(RTLD_NEXT, "usleep");
+		process_state.real_alarm = dlsym(RTLD_NEXT, "alarm");
+		process_state.real_setitimer = dlsym(RTLD_NEXT, "setitimer");
+		process_state.real_getitimer = dlsym(RTLD_NEXT, "getitimer");
+		process_state.real_timer_create = dlsym(RTLD_NEXT, "timer_create");
+		process_state.real_timer_settime = dlsym(RTLD_NEXT, "timer_settime");
+		process_state.real_timer_gettime = dlsym(RTLD_NEXT, "timer_gettime");
+		process_state.real_timer_getoverrun = dlsym(RTLD_NEXT, "timer_getoverrun");
+		process_state.real_timer_delete = dlsym(RTLD_NEXT, "timer_delete");
+		process_state.real_pause = dlsym(RTLD_NEXT, "pause");
+		process_state.real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+		process_state.real_sched_getcpu = dlsym(RTLD_NEXT, "sched_getcpu");
+		process_state.real_getcpu = dlsym(RTLD_NEXT, "getcpu");
+		process_state.real_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+		process_state.real_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+		process_state.real_epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+#if __GLIBC_PREREQ(2, 35)
+		process_state.real_epoll_pwait2 = dlsym(RTLD_NEXT, "epoll_pwait2");
+#endif
+		process_state.pid = syscall(SYS_getpid);
+		process_state.seed = rank_seed(env_u64("DETERMINISTIC_SEED", DEFAULT_SEED));
+		process_state.clock_start = env_u64("DETERMINISTIC_CLOCK_START", DEFAULT_CLOCK_START);
+		process_state.clock_step = env_u64("DETERMINISTIC_CLOCK_STEP", DEFAULT_CLOCK_STEP);
+		process_state.clock_ns = 0;
+		process_state.virtual_clock = env_u64("DETERMINISTIC_VIRTUAL_CLOCK", 0) != 0;
+		process_state.reap_order = parse_reap_order(getenv("DETERMINISTIC_REAP_ORDER"));
+		process_state.epoll_order = parse_epoll_order(getenv("DETERMINISTIC_EPOLL_ORDER"));
+		process_state.read_chunk = parse_read_chunk(getenv("DETERMINISTIC_READ_CHUNKS"));
+		process_state.virtual_cpus = env_u64("DETERMINISTIC_VIRTUAL_CPUS", 0);
+		const char* disable_rseq = getenv("DETERMINISTIC_DISABLE_RSEQ");
+		process_state.disable_rseq = disable_rseq != NULL && strcmp(disable_rseq, "1") == 0;
+		const char* watch_window = getenv("DETERMINISTIC_WATCH_WINDOW");
+		process_state.watch_window = watch_window != NULL && *watch_window != '\0' ? atoi(watch_window) : -1;
+		stream_init(&process_state.random_state, 0);
+		load_entropy_paths(getenv("DETERMINISTIC_ENTROPY_PATHS"));
+		lineage_init();
+		digest_init();
+		const char* policy = getenv("DETERMINISTIC_POLICY");
+		if (policy != NULL && *policy != '\0') {
+			load_policy(policy);
+		}
+		if (LAZY_IO_HOOKS && (process_state.read_chunk != 0 || process_state.watch_window >= 0)) {
+			// Chunked and watch reads need the read hook whether or not
+			// entropy is ever opened.
+			patch_io_hooks();
+		}
+	}
+}
+
+int INTERNAL add_text_ranges(struct dl_phdr_info* info, size_t size, void* data) {
+	(void)size;
+	range_table_t* table = data;
+	const char* path = info->dlpi_name;
+	char executable[PATH_MAX];
+	if (path == NULL || *path == '\0') {
+		ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+		executable[length > 0 ? length : 0] = '\0';
+		path = executable;
+	}
+	const char* file_name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	policy_action_t action = POLICY_DETERMINISTIC;
+	for (size_t i = 0; i < process_state.used_policy_rules; ++i) {
+		const char* pattern = process_state.policy_rules[i].pattern;
+		if (fnmatch(pattern, strchr(pattern, '/') ? path : file_name, 0) == 0) {
+			action = process_state.policy_rules[i].action;
+			break;
+		}
+	}
+	for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+		const ElfW(Phdr)* segment = &info->dlpi_phdr[i];
+		if (segment->p_type != PT_LOAD || !(segment->p_flags & PF_X)) {
+			continue;
+		}
+		if (table->used_ranges == table->capacity) {
+			size_t capacity = table->capacity ? table->capacity * 2 : 64;
+			text_range_t* ranges = realloc(table->ranges, capacity * sizeof(text_range_t));
+			if (ranges == NULL) {
+				return 1;
+			}
+			table->ranges = ranges;
+			table->capacity = capacity;
+		}
+		table->ranges[table->used_ranges++] = (text_range_t){
+			.start = info->dlpi_addr + segment->p_vaddr,
+			.end = info->dlpi_addr + segment->p_vaddr + segment->p_memsz,
+			.action = action,
+			.stream = action == POLICY_STREAM ? named_stream(file_name) : NULL,
+		};
+	}
+	return 0;
+}
+
+int INTERNAL compare_ranges(const void* left, const void* right) {
+	uintptr_t a = ((const text_range_t*)left)->start;
+	uintptr_t b = ((const text_range_t*)right)->start;
+	return (a > b) - (a < b);
+}
+
+int INTERNAL read_load_counts(struct dl_phdr_info* info, size_t size, void* data) {
+	(void)size;
+	((unsigned long long*)data)[0] = info->dlpi_adds;
+	((unsigned long long*)data)[1] = info->dlpi_subs;
+	return 1;
+}
+
+/*
+ * Rebuilds the table if it is still seen and objects have been loaded or
+ * unloaded since it was built. Callers whose address is in no object (JIT
+ * code, trampolines) then cost one dl_iterate_phdr step, not a rebuild.
+ */
+void INTERNAL rebuild_ranges(range_table_t* seen) {
+	unsigned long long counts[2] = {0, 0};
+	dl_iterate_phdr(read_load_counts, counts);
+	pthread_mutex_lock(&process_state.ranges_lock);
+	// Another thread may have rebuilt it while we waited.
+	if (__atomic_load_n(&process_state.ranges, __ATOMIC_SEQ_CST) == seen && (seen == NULL || seen->adds != counts[0] || seen->subs != counts[1])) {
+		range_table_t* table = calloc(1, sizeof(range_table_t));
+		if (table != NULL) {
+			table->adds = counts[0];
+			table->subs = counts[1];
+			dl_iterate_phdr(add_text_ranges, table);
+			qsort(table->ranges, table->used_ranges, sizeof(text_range_t), compare_ranges);
+			__atomic_store_n(&process_state.ranges, table, __ATOMIC_SEQ_CST);
+			if (seen != NULL) {
+				seen->next_retired = process_state.retired_ranges;
+				process_state.retired_ranges = seen;
+			}
+		}
+	}
+	// A reader counts itself before loading the table, so with none counted
+	// now, any later reader can only find the new one.
+	if (__atomic_load_n(&process_state.range_readers, __ATOMIC_SEQ_CST) == 0) {
+		while (process_state.retired_ranges != NULL) {
+			range_table_t* retired = process_state.retired_ranges;
+			process_state.retired_ranges = retired->next_retired;
+			free(retired->ranges);
+			free(retired);
+		}
+	}
+	pthread_mutex_unlock(&process_state.ranges_lock);
+}
+
+const text_range_t* INTERNAL find_range(const range_table_t* table, uintptr_t address) {
+	if (table == NULL) {
+		return NULL;
+	}
+	size_t low = 0;
+	size_t high = table->used_ranges;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (address < table->ranges[middle].start) {
+			high = middle;
+		} else if (address >= table->ranges[middle].end) {
+			low = middle + 1;
+		} else {
+			return &table->ranges[middle];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The stream a call from caller should draw from, or NULL for real entropy.
+ * Without a policy this is just the fallback.
+ */
+det_stream_t* INTERNAL policy_stream(const void* caller, det_stream_t* fallback) {
+	if (LIKELY(process_state.used_policy_rules == 0)) {
+		return fallback;
+	}
+	for (bool rebuilt = false;; rebuilt = true) {
+		__atomic_add_fetch(&process_state.range_readers, 1, __ATOMIC_SEQ_CST);
+		range_table_t* table = __atomic_load_n(&process_state.ranges, __ATOMIC_SEQ_CST);
+		const text_range_t* range = find_range(table, (uintptr_t)caller);
+		// Named streams outlive the table.
+		det_stream_t* stream = range == NULL || range->action == POLICY_DETERMINISTIC ? fallback
+			: range->action == POLICY_REAL ? NULL
+			: range->stream;
+		__atomic_sub_fetch(&process_state.range_readers, 1, __ATOMIC_SEQ_CST);
+		if (LIKELY(range != NULL) || rebuilt) {
+			return stream;
+		}
+		// Perhaps a library dlopen'd since the last build. The current table
+		// is never freed, so comparing against it is safe.
+		rebuild_ranges(table);
+	}
+}
+
+/*
+ * dlopen is deliberately not wrapped: glibc searches the caller's RUNPATH,
+ * and it finds the caller from its return address. New libraries are found
+ * instead by the first lookup that misses. An unloaded library's range could
+ * be reused by the next one, so a dlclose that unloads one rebuilds the table.
+ */
+int dlclose(void* handle) {
+	ensure_initialized();
+	int result = process_state.real_dlclose(handle);
+	if (process_state.used_policy_rules > 0) {
+		rebuild_ranges(__atomic_load_n(&process_state.ranges, __ATOMIC_ACQUIRE));
+	}
+	return result;
+}
+
+/*
+ * Returns the calling CLONE_VM child's private state, or NULL in the process
+ * that owns process_state. Costs one load unless a CLONE_VM child is alive.
+ */
+vm_child_t* INTERNAL claim_vm_child(pid_t pid, uint64_t ordinal);
+
+vm_child_t* INTERNAL current_vm_child() {
+	if (LIKELY(__atomic_load_n(&process_state.vm_pending, __ATOMIC_ACQUIRE) == 0)) {
+		return NULL;
+	}
+	pid_t pid = syscall(SYS_getpid);
+	if (pid == process_state.pid) {
+		return NULL;
+	}
+	// Only a vfork-style child gets here unclaimed, and its parent is
+	// suspended, so the parent's TLS is stable.
+	return claim_vm_child(pid, vm_spawn_ordinal);
+}
+
+/*
+ * The slot for CLONE_VM child pid, taking a free one and seeding its
+ * stream from ordinal if it has none yet.
+ */
+vm_child_t* INTERNAL claim_vm_child(pid_t pid, uint64_t ordinal) {
+	vm_child_t* child = NULL;
+	for (size_t i = 0; i < MAX_VM_CHILDREN; ++i) {
+		if (__atomic_load_n(&process_state.vm_children[i].pid, __ATOMIC_ACQUIRE) == pid) {
+			return &process_state.vm_children[i];
+		}
+	}
+	for (size_t i = 0; i < MAX_VM_CHILDREN && child == NULL; ++i) {
+		pid_t free_slot = 0;
+		if (__atomic_compare_exchange_n(&process_state.vm_children[i].pid, &free_slot, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			child = &process_state.vm_children[i];
+		}
+	}
+	if (UNLIKELY(child == NULL)) {
+		// Every slot is taken; share the last one rather than the parent's stream.
+		child = &process_state.vm_children[MAX_VM_CHILDREN - 1];
+	}
+	if (!child->ready) {
+		// Keys near 2^64 are reserved for these.
+		stream_init(&child->stream, ~ordinal);
+		child->clock_ns = __atomic_load_n(&process_state.clock_ns, __ATOMIC_RELAXED);
+		child->ready = true;
+	}
+	return child;
+}
+
+void INTERNAL vm_spawn_begin() {
+	vm_spawn_ordinal = __atomic_fetch_add(&process_state.vm_spawns, 1, __ATOMIC_RELAXED);
+	vm_spawn_lineage = __atomic_add_fetch(&process_state.forks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&process_state.vm_pending, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The child with this pid no longer shares our memory (it exec'd or exited).
+ * Returns whether it held a slot.
+ */
+bool INTERNAL vm_child_release(pid_t pid) {
+	bool released = false;
+	for (size_t i = 0; i < MAX_VM_CHILDREN; ++i) {
+		pid_t expected = pid;
+		if (pid > 0 && __atomic_load_n(&process_state.vm_children[i].pid, __ATOMIC_ACQUIRE) == pid) {
+			process_state.vm_children[i].ready = false;
+			released |= __atomic_compare_exchange_n(&process_state.vm_children[i].pid, &expected, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+		}
+	}
+	return released;
+}
+
+void INTERNAL vm_spawn_end(pid_t pid) {
+	vm_child_release(pid);
+	__atomic_fetch_sub(&process_state.vm_pending, 1, __ATOMIC_RELEASE);
+}
+
+void INTERNAL set_entropy_fd(int fd, const entropy_rule_t* rule) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) {
+		return;
+	}
+	uint16_t** chunk = &process_state.entropy_fds[fd / FD_CHUNK];
+	if (__atomic_load_n(chunk, __ATOMIC_ACQUIRE) == NULL) {
+		uint16_t* fresh = calloc(FD_CHUNK, sizeof(uint16_t));
+		uint16_t* expected = NULL;
+		if (fresh == NULL) {
+			return;
+		}
+		if (!__atomic_compare_exchange_n(chunk, &expected, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(fresh);
+		}
+	}
+	uint16_t value = rule == NULL ? 0 : rule - process_state.entropy_rules + 1;
+	__atomic_store_n(&(*chunk)[fd % FD_CHUNK], value, __ATOMIC_RELEASE);
+}
+
+const entropy_rule_t* INTERNAL get_entropy_fd(int fd) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) {
+		return NULL;
+	}
+	uint16_t* chunk = __atomic_load_n(&process_state.entropy_fds[fd / FD_CHUNK], __ATOMIC_ACQUIRE);
+	if (LIKELY(chunk == NULL)) {
+		return NULL;
+	}
+	uint16_t value = __atomic_load_n(&chunk[fd % FD_CHUNK], __ATOMIC_ACQUIRE);
+	return LIKELY(value == 0) ? NULL : &process_state.entropy_rules[value - 1];
+}
+
+void INTERNAL fill_with_random(det_stream_t* stream, void* buffer, size_t size) {
+	vm_child_t* child = current_vm_child();
+	if (UNLIKELY(child != NULL)) {
+		stream = &child->stream;
+	}
+	stream_sync(stream);
+	size_t words = size / sizeof(uint32_t);
+	size_t tail = size % sizeof(uint32_t);
+	mt_fill(&stream->state, buffer, words);
+	if (tail) {
+		uint32_t last = mt_random(&stream->state);
+		memcpy((char*)buffer + words * sizeof(uint32_t), &last, tail);
+	}
+	stream->position += words + (tail ? 1 : 0);
+	if (PRINT_INTERCEPTION) {
+		for (size_t i = 0; i < size; ++i) {
+			printf("%02x", ((unsigned char*)buffer)[i]);
+		}
+		printf("\n");
+	}
+}
+
+watch_kind_t INTERNAL get_watch_fd(int fd);
+void INTERNAL forget_watch_fd(int fd);
+ssize_t INTERNAL read_watch_fd(int fd, char* buffer, size_t size);
+void INTERNAL place_fork_child();
+
+/*
+ * Shared by the open family.
+ */
+int INTERNAL open_at(int directory, const char* pathname, int flags, mode_t mode) {
+	ensure_initialized();
+	if (PRINT_CALL) {
+		printf("Called open(%s, %d, %d)\n", pathname, flags, mode);
+	}
+	const entropy_rule_t* rule;
+	// A CLONE_VM child has its own fd table, so it must not edit ours.
+	if (ENABLE && LIKELY(pathname != NULL) && UNLIKELY(NULL != (rule = match_entropy_path(pathname))) && current_vm_child() == NULL) {
+		if (rule->open_error) {
+			errno = rule->open_error;
+			return -1;
+		}
+		int fd = process_state.real_openat(directory, pathname, flags, mode);
+		if (fd < 0 && errno == ENOENT) {
+			// Served from a stream, so it only needs to be something we can read.
+			fd = process_state.real_openat(AT_FDCWD, "/dev/null", O_RDONLY | (flags & O_CLOEXEC), 0);
+		}
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting open(%s, %d, %d) = %d\n", pathname, flags, mode, fd);
+		}
+		set_entropy_fd(fd, rule);
+		if (LAZY_IO_HOOKS && fd >= 0) {
+			patch_io_hooks();
+		}
+		return fd;
+	} else {
+		int fd = process_state.real_openat(directory, pathname, flags, mode);
+		// A close we did not see (e.g. from inside libc) can leave a stale entry.
+		if (UNLIKELY(get_entropy_fd(fd) != NULL) && current_vm_child() == NULL) {
+			set_entropy_fd(fd, NULL);
+		}
+		if (LAZY_IO_HOOKS && process_state.io_hooks_active) {
+			// Catch objects dlopen'd since the last patch.
+			patch_io_hooks();
+		}
+		return fd;
+	}
+}
+
+mode_t INTERNAL open_mode(int flags, va_list args) {
+	return flags & (O_CREAT | O_TMPFILE) ? va_arg(args, mode_t) : 0;
+}
+
+int open(const char* pathname, int flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return open_at(AT_FDCWD, pathname, flags, mode);
+}
+
+int open64(const char* pathname, int flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return open_at(AT_FDCWD, pathname, flags | O_LARGEFILE, mode);
+}
+
+int openat(int directory, const char* pathname, int flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return open_at(directory, pathname, flags, mode);
+}
+
+int openat64(int directory, const char* pathname, int flags, ...) {
+	va_list args;
+	va_start(args, flags);
+	mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return open_at(directory, pathname, flags | O_LARGEFILE, mode);
+}
+
+int INTERNAL close_fd(int fd) {
+	ensure_initialized();
+	if (PRINT_CALL) {
+		printf("Called close(%d)\n", fd);
+	}
+	if (ENABLE && current_vm_child() == NULL && UNLIKELY(get_entropy_fd(fd) != NULL)) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting close(%d)\n", fd);
+		}
+		set_entropy_fd(fd, NULL);
+	}
+	if (UNLIKELY(process_state.watch_window >= 0) && get_watch_fd(fd) != WATCH_NONE) {
+		forget_watch_fd(fd);
+	}
+	return process_state.real_close(fd);
+}
+
+bool INTERNAL is_stream_fd(int fd) {
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		return false;
+	}
+	if (S_ISFIFO(status.st_mode)) {
+		return true;
+	}
+	int type;
+	socklen_t length = sizeof(type);
+	return S_ISSOCK(status.st_mode) && getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0 && type == SOCK_STREAM;
+}
+
+/*
+ * A read from a pipe or stream socket that returns as much as the kernel
+ * had buffered, which depends on when the writer ran. Here it returns
+ * min(size, read_chunk) bytes unless EOF, an error or O_NONBLOCK cuts it
+ * short, so a reader that asks for the same sizes sees the same chunks.
+ *
+ * Each refill is one kernel read straight into the caller's buffer for
+ * everything still missing. Reading ahead into a buffer of our own would
+ * take bytes that a forked or exec'd process sharing the pipe should see.
+ * Regular files and terminals are read natively; the fd's type is only
+ * checked when it matters.
+ */
+ssize_t INTERNAL read_in_chunks(int fd, char* buffer, size_t size, int flags, bool socket_call) {
+	size_t wanted = size;
+	bool checked = false;
+	if (size > process_state.read_chunk) {
+		if (!is_stream_fd(fd)) {
+			wanted = 0;
+		} else {
+			wanted = process_state.read_chunk;
+			checked = true;
+		}
+	}
+	if (wanted == 0) {
+		return socket_call ? process_state.real_recvfrom(fd, buffer, size, flags, NULL, NULL) : process_state.real_read(fd, buffer, size);
+	}
+	size_t total = 0;
+	while (total < wanted) {
+		ssize_t got = socket_call
+			? process_state.real_recvfrom(fd, buffer + total, wanted - total, flags, NULL, NULL)
+			: process_state.real_read(fd, buffer + total, wanted - total);
+		if (got <= 0) {
+			return total > 0 ? (ssize_t)total : got;
+		}
+		total += got;
+		if (total < wanted && !checked) {
+			if (!is_stream_fd(fd)) {
+				break;
+			}
+			checked = true;
+		}
+	}
+	return total;
+}
+
+/*
+ * caller is the return address of whoever called read, for DETERMINISTIC_POLICY.
+ */
+ssize_t INTERNAL read_fd(const void* caller, int fd, void *buffer, size_t size) {
+	ensure_initialized();
+	if (PRINT_CALL) {
+		printf("Called read(%d, %p, %ld)\n", fd, buffer, size);
+	}
+	const entropy_rule_t* rule;
+	det_stream_t* stream;
+	if (ENABLE && UNLIKELY(NULL != (rule = get_entropy_fd(fd))) && NULL != (stream = policy_stream(caller, rule->stream))) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting read(%d, %p, %ld)\n", fd, buffer, size);
+		}
+		if (rule->read_error) {
+			errno = rule->read_error;
+			return -1;
+		}
+		if (rule->read_limit && size > rule->read_limit) {
+			size = rule->read_limit;
+		}
+		fill_with_random(stream, buffer, size);
+		digest_event("read", size, stream->position);
+		return size;
+	} else if (UNLIKELY(process_state.watch_window >= 0) && get_watch_fd(fd) != WATCH_NONE) {
+		return read_watch_fd(fd, buffer, size);
+	} else if (UNLIKELY(process_state.read_chunk != 0)) {
+		return read_in_chunks(fd, buffer, size, 0, false);
+	} else {
+		return process_state.real_read(fd, buffer, size);
+	}
+}
+
+ssize_t INTERNAL readv_fd(const void* caller, int fd, const struct iovec* vector, int count) {
+	ensure_initialized();
+	const entropy_rule_t* rule;
+	det_stream_t* stream;
+	if (ENABLE && UNLIKELY(NULL != (rule = get_entropy_fd(fd))) && NULL != (stream = policy_stream(caller, rule->stream))) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting readv(%d, %p, %d)\n", fd, vector, count);
+		}
+		if (rule->read_error) {
+			errno = rule->read_error;
+			return -1;
+		}
+		size_t total = 0;
+		for (int i = 0; i < count; ++i) {
+			size_t size = vector[i].iov_len;
+			if (rule->read_limit && total + size > rule->read_limit) {
+				size = rule->read_limit - total;
+			}
+			fill_with_random(stream, vector[i].iov_base, size);
+			total += size;
+		}
+		digest_event("readv", total, stream->position);
+		return total;
+	} else {
+		return process_state.real_readv(fd, vector, count);
+	}
+}
+
+/*
+ * Peeking, non-blocking and out-of-band receives are left alone, as are
+ * ones that ask for the sender's address, which only datagrams have.
+ */
+ssize_t recvfrom(int fd, void* buffer, size_t size, int flags, struct sockaddr* address, socklen_t* address_length) {
+	ensure_initialized();
+	if (LIKELY(process_state.read_chunk == 0) || address != NULL || (flags & (MSG_PEEK | MSG_DONTWAIT | MSG_OOB | MSG_TRUNC)) != 0) {
+		return process_state.real_recvfrom(fd, buffer, size, flags, address, address_length);
+	}
+	return read_in_chunks(fd, buffer, size, flags, true);
+}
+
+ssize_t recv(int fd, void* buffer, size_t size, int flags) {
+	return recvfrom(fd, buffer, size, flags, NULL, NULL);
+}
+
+#if !LAZY_IO_HOOKS
+int close(int fd) {
+	return close_fd(fd);
+}
+
+ssize_t read(int fd, void *buffer, size_t size) {
+	return read_fd(__builtin_return_address(0), fd, buffer, size);
+}
+
+ssize_t readv(int fd, const struct iovec* vector, int count) {
+	return readv_fd(__builtin_return_address(0), fd, vector, count);
+}
+
+void INTERNAL patch_io_hooks() {
+}
+#else
+__attribute__((visibility("hidden"))) int lazy_close(int fd) {
+	return close_fd(fd);
+}
+
+__attribute__((visibility("hidden"))) ssize_t lazy_read(int fd, void *buffer, size_t size) {
+	return read_fd(__builtin_return_address(0), fd, buffer, size);
+}
+
+__attribute__((visibility("hidden"))) ssize_t lazy_readv(int fd, const struct iovec* vector, int count) {
+	return readv_fd(__builtin_return_address(0), fd, vector, count);
+}
+
+#if defined(__x86_64__)
+#define RELOCATION_JUMP_SLOT R_X86_64_JUMP_SLOT
+#define RELOCATION_GLOB_DAT R_X86_64_GLOB_DAT
+#elif defined(__aarch64__)
+#define RELOCATION_JUMP_SLOT R_AARCH64_JUMP_SLOT
+#define RELOCATION_GLOB_DAT R_AARCH64_GLOB_DAT
+#else
+#error "LAZY_IO_HOOKS supports x86-64 and AArch64"
+#endif
+
+/*
+ * Points every read, readv and close GOT entry of one loaded object at our
+ * wrappers. Entries inside PT_GNU_RELRO are made writable for the write.
+ */
+int INTERNAL patch_object_got(struct dl_phdr_info* info, size_t size, void* data) {
+	(void)size;
+	(void)data;
+	const ElfW(Dyn)* dynamic = NULL;
+	uintptr_t relro_start = 0;
+	uintptr_t relro_end = 0;
+	for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+		const ElfW(Phdr)* segment = &info->dlpi_phdr[i];
+		uintptr_t start = info->dlpi_addr + segment->p_vaddr;
+		if (segment->p_type == PT_DYNAMIC) {
+			dynamic = (const ElfW(Dyn)*)start;
+		} else if (segment->p_type == PT_GNU_RELRO) {
+			relro_start = start;
+			relro_end = start + segment->p_memsz;
+		} else if (segment->p_type == PT_LOAD && (uintptr_t)lazy_read >= start && (uintptr_t)lazy_read < start + segment->p_memsz) {
+			// That's us.
+			return 0;
+		}
+	}
+	if (dynamic == NULL) {
+		return 0;
+	}
+	const ElfW(Sym)* symbols = NULL;
+	const char* strings = NULL;
+	const ElfW(Rela)* tables[2] = {NULL, NULL};
+	size_t table_sizes[2] = {0, 0};
+	for (const ElfW(Dyn)* entry = dynamic; entry->d_tag != DT_NULL; ++entry) {
+		// ld.so relocates these in place, except in read-only dynamic sections (the vDSO).
+		uintptr_t pointer = entry->d_un.d_ptr < info->dlpi_addr ? info->dlpi_addr + entry->d_un.d_ptr : entry->d_un.d_ptr;
+		switch (entry->d_tag) {
+		case DT_SYMTAB:
+			symbols = (const ElfW(Sym)*)pointer;
+			break;
+		case DT_STRTAB:
+			strings = (const char*)pointer;
+			break;
+		case DT_JMPREL:
+			tables[0] = (const ElfW(Rela)*)pointer;
+			break;
+		case DT_PLTRELSZ:
+			table_sizes[0] = entry->d_un.d_val;
+			break;
+		case DT_RELA:
+			tables[1] = (const ElfW(Rela)*)pointer;
+			break;
+		case DT_RELASZ:
+			table_sizes[1] = entry->d_un.d_val;
+			break;
+		}
+	}
+	if (symbols == NULL || strings == NULL) {
+		return 0;
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (size_t table = 0; table < 2; ++table) {
+		for (size_t i = 0; tables[table] != NULL && i < table_sizes[table] / sizeof(ElfW(Rela)); ++i) {
+			const ElfW(Rela)* relocation = &tables[table][i];
+			unsigned type = ELF64_R_TYPE(relocation->r_info);
+			if (type != RELOCATION_JUMP_SLOT && type != RELOCATION_GLOB_DAT) {
+				continue;
+			}
+			const char* name = strings + symbols[ELF64_R_SYM(relocation->r_info)].st_name;
+			void* replacement;
+			if (strcmp(name, "read") == 0) {
+				replacement = lazy_read;
+			} else if (strcmp(name, "readv") == 0) {
+				replacement = lazy_readv;
+			} else if (strcmp(name, "close") == 0) {
+				replacement = lazy_close;
+			} else {
+				continue;
+			}
+			void** slot = (void**)(info->dlpi_addr + relocation->r_offset);
+			if (*slot == replacement) {
+				continue;
+			}
+			bool relro = (uintptr_t)slot >= relro_start && (uintptr_t)slot < relro_end;
+			void* page = (void*)((uintptr_t)slot & ~(uintptr_t)(page_size - 1));
+			if (relro && mprotect(page, page_size, PROT_READ | PROT_WRITE) != 0) {
+				continue;
+			}
+			__atomic_store_n(slot, replacement, __ATOMIC_RELEASE);
+			if (relro) {
+				mprotect(page, page_size, PROT_READ);
+			}
+		}
+	}
+	return 0;
+}
+
+int INTERNAL read_load_count(struct dl_phdr_info* info, size_t size, void* data) {
+	(void)size;
+	*(unsigned long long*)data = info->dlpi_adds;
+	return 1;
+}
+
+/*
+ * dlopen is not wrapped (see dlclose), so objects loaded later are caught
+ * by the load count, which every open checks once the hooks are active.
+ */
+void INTERNAL patch_io_hooks() {
+	unsigned long long loads = 0;
+	dl_iterate_phdr(read_load_count, &loads);
+	if (process_state.io_hooks_active && loads == __atomic_load_n(&process_state.patched_loads, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	pthread_mutex_lock(&process_state.got_lock);
+	dl_iterate_phdr(patch_object_got, NULL);
+	__atomic_store_n(&process_state.patched_loads, loads, __ATOMIC_RELEASE);
+	process_state.io_hooks_active = true;
+	pthread_mutex_unlock(&process_state.got_lock);
+}
+#endif
+
+ssize_t getrandom(void *buffer, size_t size, unsigned int flags) {
+	ensure_initialized();
+	det_stream_t* stream;
+	if (ENABLE && NULL != (stream = policy_stream(__builtin_return_address(0), &process_state.random_state))) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting getrandom(%p, %ld, %d)\n", buffer, size, flags);
+		}
+		fill_with_random(stream, buffer, size);
+		digest_event("getrandom", size, stream->position);
+		return size;
+	} else {
+		return process_state.real_getrandom(buffer, size, flags);
+	}
+}
+
+int getentropy(void *buffer, size_t size) {
+	ensure_initialized();
+	if (PRINT_CALL) {
+		printf("Called getentropy(%p, %ld)\n", buffer, size);
+	}
+	det_stream_t* stream;
+	if (ENABLE && NULL != (stream = policy_stream(__builtin_return_address(0), &process_state.random_state))) {
+		if (PRINT_INTERCEPTION) {
+			printf("Intercepting getentropy(%p, %ld)\n", buffer, size);
+		}
+		fill_with_random(stream, buffer, size);
+		digest_event("getentropy", size, stream->position);
+		return size;
+	} else {
+		return process_state.real_getentropy(buffer, size);
+	}
+}
+
+void INTERNAL add_child(pid_t pid) {
+	pthread_mutex_lock(&process_state.children_lock);
+	if (process_state.used_children == process_state.children_capacity) {
+		size_t capacity = process_state.children_capacity ? process_state.children_capacity * 2 : 16;
+		pid_t* children = realloc(process_state.children, capacity * sizeof(pid_t));
+		if (children == NULL) {
+			pthread_mutex_unlock(&process_state.children_lock);
+			return;
+		}
+		process_state.children = children;
+		process_state.children_capacity = capacity;
+	}
+	process_state.children[process_state.used_children++] = pid;
+	pthread_mutex_unlock(&process_state.children_lock);
+}
+
+void INTERNAL remove_child(pid_t pid) {
+	pthread_mutex_lock(&process_state.children_lock);
+	for (size_t i = 0; i < process_state.used_children; ++i) {
+		if (process_state.children[i] == pid) {
+			memmove(&process_state.children[i], &process_state.children[i + 1], (process_state.used_children - i - 1) * sizeof(pid_t));
+			process_state.used_children--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&process_state.children_lock);
+}
+
+/*
+ * Returns 0 when there is no tracked child to choose.
+ */
+pid_t INTERNAL choose_child() {
+	pid_t pid = 0;
+	pthread_mutex_lock(&process_state.children_lock);
+	size_t used = process_state.used_children;
+	if (used > 0) {
+		switch (process_state.reap_order) {
+		case REAP_FIFO:
+			pid = process_state.children[0];
+			break;
+		case REAP_LIFO:
+			pid = process_state.children[used - 1];
+			break;
+		case REAP_SEEDED:
+			pid = process_state.children[mix_seed(process_state.seed, process_state.reaps++) % used];
+			break;
+		case REAP_NATIVE:
+			break;
+		}
+	}
+	pthread_mutex_unlock(&process_state.children_lock);
+	return pid;
+}
+
+pid_t INTERNAL reap(pid_t pid, int* status, int options, struct rusage* usage) {
+	int local_status;
+	if (status == NULL) {
+		status = &local_status;
+	}
+	pid_t target;
+	while (true) {
+		target = pid;
+		if (pid == -1 && process_state.reap_order != REAP_NATIVE && !(options & (WUNTRACED | WCONTINUED))) {
+			target = choose_child();
+			if (target == 0) {
+				target = -1;
+			}
+		}
+		pid_t result = process_state.real_wait4(target, status, options, usage);
+		if (result < 0 && errno == ECHILD && target != pid) {
+			// Reaped behind our back (e.g. by waitid); choose again.
+			remove_child(target);
+			continue;
+		}
+		if (result > 0 && (WIFEXITED(*status) || WIFSIGNALED(*status))) {
+			digest_event("wait", 0, *status);
+			remove_child(result);
+			// A vfork child's slot is gone by now; a clone(CLONE_VM) child that
+			// exec'd or exited without returning from fn still holds one.
+			if (UNLIKELY(__atomic_load_n(&process_state.vm_pending, __ATOMIC_ACQUIRE) > 0) && vm_child_release(result)) {
+				__atomic_fetch_sub(&process_state.vm_pending, 1, __ATOMIC_RELEASE);
+			}
+		}
+		return result;
+	}
+}
+
+/*
+ * Timers are not inherited across fork.
+ */
+void INTERNAL forget_virtual_timers() {
+	memset(process_state.timers, 0, sizeof(process_state.timers));
+	process_state.next_deadline = UINT64_MAX;
+	process_state.timers_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+}
+
+/*
+ * In a child with a copy of our memory, which is fork child ordinal of ours.
+ */
+void INTERNAL fork_child_reset(uint64_t ordinal) {
+	// The parent's children are not ours.
+	process_state.used_children = 0;
+	process_state.children_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	process_state.pid = syscall(SYS_getpid);
+	process_state.forks = 0;
+	forget_virtual_timers();
+	lineage_fork_child(ordinal);
+	digest_fork_child();
+	place_fork_child();
+}
+
+pid_t fork(void) {
+	ensure_initialized();
+	uint64_t ordinal = __atomic_add_fetch(&process_state.forks, 1, __ATOMIC_RELAXED);
+	pid_t pid = process_state.real_fork();
+	if (pid == 0) {
+		fork_child_reset(ordinal);
+	} else if (pid > 0) {
+		add_child(pid);
+	}
+	return pid;
+}
+
+/*
+ * vfork cannot be wrapped by a C function: the child would return through
+ * the wrapper's frame and clobber it before the parent resumes. Like glibc's
+ * own vfork, keep the return address in a register across the syscall, then
+ * tail-call vfork_end in the parent.
+ */
+__attribute__((visibility("hidden"))) void vfork_begin(void) {
+	ensure_initialized();
+	vm_spawn_begin();
+}
+
+__attribute__((visibility("hidden"))) pid_t vfork_end(long result) {
+	if (result < 0) {
+		vm_spawn_end(0);
+		errno = -result;
+		return -1;
+	}
+	// We only resume once the child has exec'd or exited.
+	vm_spawn_end(result);
+	add_child(result);
+	return result;
+}
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".globl vfork\n"
+	".type vfork, @function\n"
+	"vfork:\n"
+	"	sub $8, %rsp\n"
+	"	call vfork_begin\n"
+	"	add $8, %rsp\n"
+	"	pop %rdi\n"
+	"	mov $58, %eax\n" // SYS_vfork
+	"	syscall\n"
+	"	push %rdi\n"
+	"	test %eax, %eax\n"
+	"	jz 1f\n"
+	"	mov %rax, %rdi\n"
+	"	jmp vfork_end\n"
+	"1:\n"
+	"	ret\n"
+	".size vfork, .-vfork\n"
+);
+#endif
+
+typedef struct {
+	int (*fn)(void*);
+	void* arg;
+	int flags;
+	/*
+	 * For CLONE_VM, copied from the parent's TLS, which the child shares and
+	 * the parent may change before the child reads it.
+	 */
+	uint64_t spawn_ordinal;
+	/*
+	 * Otherwise, the child's fork ordinal.
+	 */
+	uint64_t lineage_ordinal;
+} clone_start_t;
+
+/*
+ * Runs first in a clone() child, on the child's stack.
+ */
+int INTERNAL clone_trampoline(void* data) {
+	clone_start_t start = *(clone_start_t*)data;
+	if (!(start.flags & CLONE_VM)) {
+		// A copy of our memory, like fork.
+		fork_child_reset(start.lineage_ordinal);
+		return start.fn(start.arg);
+	}
+	pid_t pid = syscall(SYS_getpid);
+	claim_vm_child(pid, start.spawn_ordinal);
+	int result = start.fn(start.arg);
+	// Returning exits the child. If it exec'd or exited instead, reap
+	// releases the slot; whichever releases it settles vm_pending. A vfork
+	// child's parent settles it when it resumes.
+	if (!(start.flags & CLONE_VFORK) && vm_child_release(pid)) {
+		__atomic_fetch_sub(&process_state.vm_pending, 1, __ATOMIC_RELEASE);
+	}
+	return result;
+}
+
+int clone(int (*fn)(void*), void* stack, int flags, void* arg, ...) {
+	ensure_initialized();
+	va_list args;
+	va_start(args, arg);
+	pid_t* parent_tid = va_arg(args, pid_t*);
+	void* tls = va_arg(args, void*);
+	pid_t* child_tid = va_arg(args, pid_t*);
+	va_end(args);
+	if (flags & CLONE_THREAD) {
+		return process_state.real_clone(fn, stack, flags, arg, parent_tid, tls, child_tid);
+	}
+	if (fn == NULL || stack == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	// The child's stack is free until it starts, so carry fn and arg at its top.
+	clone_start_t* start = (clone_start_t*)(((uintptr_t)stack - sizeof(clone_start_t)) & ~(uintptr_t)15);
+	*start = (clone_start_t){.fn = fn, .arg = arg, .flags = flags};
+	if (flags & CLONE_VM) {
+		vm_spawn_begin();
+		start->spawn_ordinal = vm_spawn_ordinal;
+	} else {
+		start->lineage_ordinal = __atomic_add_fetch(&process_state.forks, 1, __ATOMIC_RELAXED);
+	}
+	pid_t pid = process_state.real_clone(clone_trampoline, start, flags, start, parent_tid, tls, child_tid);
+	if (flags & CLONE_VM) {
+		if (pid < 0) {
+			vm_spawn_end(0);
+		} else if (flags & CLONE_VFORK) {
+			vm_spawn_end(pid);
+		}
+	}
+	if (pid > 0) {
+		add_child(pid);
+	}
+	return pid;
+}
+
+/*
+ * Children started with env -i, or by tools that sanitize the environment,
+ * would lose LD_PRELOAD and the DETERMINISTIC_* settings and quietly run
+ * unshimmed. Every exec and spawn re-adds whichever of them the new
+ * environment lacks, taking each from our environment, or from the
+ * start-up copy if ours has lost it too. The libraries we were
+ * preloaded with are appended to any LD_PRELOAD that lacks them.
+ *
+ * This may run in a vfork child, so nothing here touches the heap: the new
+ * envp and the strings built for it live on the caller's stack.
+ */
+typedef struct {
+	char preload[2 * PATH_MAX];
+	char lineage[sizeof(((process_state_t*)0)->lineage) + 32];
+	char lineage_owner[64];
+} carried_strings_t;
+
+size_t INTERNAL carried_capacity(char* const envp[]) {
+	size_t count = 4 + process_state.used_carried;
+	for (size_t i = 0; envp != NULL && envp[i] != NULL; ++i) {
+		++count;
+	}
+	for (char** entry = environ; entry != NULL && *entry != NULL; ++entry) {
+		++count;
+	}
+	return count;
+}
+
+bool INTERNAL has_component(const char* list, const char* component, size_t length) {
+	while (*list != '\0') {
+		size_t other = strcspn(list, ": ");
+		if (other == length && strncmp(list, component, length) == 0) {
+			return true;
+		}
+		list += other;
+		list += strspn(list, ": ");
+	}
+	return false;
+}
+
+/*
+ * Fills entries (carried_capacity(envp) long) with envp plus the carried
+ * variables, and the new image's lineage. spawned is for a new process,
+ * rather than this one exec'ing.
+ */
+char* const* INTERNAL carry_environment(char* const envp[], char** entries, carried_strings_t* strings, bool spawned) {
+	// An unknown lineage is passed on as it is, so that it stays unknown.
+	bool lineage = process_state.lineage_known;
+	size_t count = 0;
+	for (size_t i = 0; envp != NULL && envp[i] != NULL; ++i) {
+		if (!(lineage && strncmp(envp[i], "DETERMINISTIC_LINEAGE", strlen("DETERMINISTIC_LINEAGE")) == 0)) {
+			entries[count++] = envp[i];
+		}
+	}
+	char** sources[2] = {environ, process_state.carried};
+	size_t source_counts[2] = {SIZE_MAX, process_state.used_carried};
+	for (size_t s = 0; s < 2; ++s) {
+		for (size_t i = 0; i < source_counts[s] && sources[s] != NULL && sources[s][i] != NULL; ++i) {
+			const char* entry = sources[s][i];
+			if (!is_carried(entry) || (lineage && strncmp(entry, "DETERMINISTIC_LINEAGE", strlen("DETERMINISTIC_LINEAGE")) == 0)) {
+				continue;
+			}
+			size_t j = 0;
+			while (j < count && !same_name(entry, entries[j])) {
+				++j;
+			}
+			if (j == count) {
+				entries[count++] = (char*)entry;
+			}
+		}
+	}
+	const char* preload = NULL;
+	for (size_t i = 0; i < process_state.used_carried; ++i) {
+		if (same_name("LD_PRELOAD=", process_state.carried[i])) {
+			preload = process_state.carried[i] + strlen("LD_PRELOAD=");
+		}
+	}
+	bool has_preload = false;
+	for (size_t j = 0; j < count && preload != NULL; ++j) {
+		if (same_name("LD_PRELOAD=", entries[j])) {
+			has_preload = true;
+			size_t used = snprintf(strings->preload, sizeof(strings->preload), "%s", entries[j]);
+			bool extended = false;
+			for (const char* ours = preload + strspn(preload, ": "); *ours != '\0' && used < sizeof(strings->preload);) {
+				size_t length = strcspn(ours, ": ");
+				if (!has_component(entries[j] + strlen("LD_PRELOAD="), ours, length)) {
+					used += snprintf(strings->preload + used, sizeof(strings->preload) - used, ":%.*s", (int)length, ours);
+					extended = true;
+				}
+				ours += length;
+				ours += strspn(ours, ": ");
+			}
+			if (extended && used < sizeof(strings->preload)) {
+				entries[j] = strings->preload;
+			}
+			break;
+		}
+	}
+	if (preload != NULL && !has_preload) {
+		entries[count++] = (char*)preload - strlen("LD_PRELOAD=");
+	}
+	if (lineage) {
+		uint64_t ordinal = spawned ? vm_spawn_lineage : __atomic_add_fetch(&process_state.forks, 1, __ATOMIC_RELAXED);
+		snprintf(strings->lineage, sizeof(strings->lineage), "DETERMINISTIC_LINEAGE=%s.%llu", process_state.lineage, (unsigned long long)ordinal);
+		snprintf(strings->lineage_owner, sizeof(strings->lineage_owner), "DETERMINISTIC_LINEAGE_%s=%d", spawned ? "PARENT" : "PID", (int)process_state.pid);
+		entries[count++] = strings->lineage;
+		entries[count++] = strings->lineage_owner;
+	}
+	entries[count] = NULL;
+	return entries;
+}
+
+void INTERNAL flush_audit();
+
+/*
+ * A successful exec skips our destructors, so report the audit and close
+ * this image's digest now. Not from a vfork child, which must not touch the
+ * parent's stdio.
+ */
+void INTERNAL before_exec() {
+	if (current_vm_child() != NULL) {
+		return;
+	}
+	flush_audit();
+	if (process_state.digest_mode != DIGEST_OFF) {
+		pthread_mutex_lock(&process_state.digest_lock);
+		digest_checkpoint("exec");
+		pthread_mutex_unlock(&process_state.digest_lock);
+	}
+}
+
+int execve(const char* path, char* const argv[], char* const envp[]) {
+	ensure_initialized();
+	char* entries[carried_capacity(envp)];
+	carried_strings_t strings;
+	char* const* carried = carry_environment(envp, entries, &strings, current_vm_child() != NULL);
+	before_exec();
+	return process_state.real_execve(path, argv, carried);
+}
+
+int execvpe(const char* file, char* const argv[], char* const envp[]) {
+	ensure_initialized();
+	char* entries[carried_capacity(envp)];
+	carried_strings_t strings;
+	char* const* carried = carry_environment(envp, entries, &strings, current_vm_child() != NULL);
+	before_exec();
+	return process_state.real_execvpe(file, argv, carried);
+}
+
+int fexecve(int fd, char* const argv[], char* const envp[]) {
+	ensure_initialized();
+	char* entries[carried_capacity(envp)];
+	carried_strings_t strings;
+	char* const* carried = carry_environment(envp, entries, &strings, current_vm_child() != NULL);
+	before_exec();
+	return process_state.real_fexecve(fd, argv, carried);
+}
+
+/*
+ * libc's own exec variants call its internal execve, past our hook.
+ */
+int execv(const char* path, char* const argv[]) {
+	return execve(path, argv, environ);
+}
+
+int execvp(const char* file, char* const argv[]) {
+	return execvpe(file, argv, environ);
+}
+
+/*
+ * Collects execl-style arguments, up to the NULL, into argv on the stack.
+ */
+#define COLLECT_ARGUMENTS(first, argv, after) \
+	size_t argument_count = 1; \
+	va_list arguments; \
+	va_start(arguments, first); \
+	while (va_arg(arguments, char*) != NULL) { \
+		++argument_count; \
+	} \
+	va_end(arguments); \
+	char* argv[argument_count + 1]; \
+	argv[0] = (char*)first; \
+	va_start(arguments, first); \
+	for (size_t i = 1; i <= argument_count; ++i) { \
+		argv[i] = va_arg(arguments, char*); \
+	} \
+	after; \
+	va_end(arguments)
+
+int execl(const char* path, const char* argument, ...) {
+	COLLECT_ARGUMENTS(argument, argv, (void)0);
+	return execve(path, argv, environ);
+}
+
+int execlp(const char* file, const char* argument, ...) {
+	COLLECT_ARGUMENTS(argument, argv, (void)0);
+	return execvpe(file, argv, environ);
+}
+
+int execle(const char* path, const char* argument, ...) {
+	char* const* envp;
+	COLLECT_ARGUMENTS(argument, argv, envp = va_arg(arguments, char* const*));
+	return execve(path, argv, envp);
+}
+
+/*
+ * glibc's posix_spawn clones with CLONE_VM | CLONE_VFORK internally, so the
+ * child is done with our memory by the time it returns. Its exec is internal
+ * to libc, so the environment is carried here.
+ */
+int posix_spawn(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions, const posix_spawnattr_t* attributes, char* const argv[], char* const envp[]) {
+	ensure_initialized();
+	pid_t child = 0;
+	vm_spawn_begin();
+	char* entries[carried_capacity(envp)];
+	carried_strings_t strings;
+	int result = process_state.real_posix_spawn(&child, path, actions, attributes, argv, carry_environment(envp, entries, &strings, true));
+	vm_spawn_end(result == 0 ? child : 0);
+	if (result == 0) {
+		add_child(child);
+		if (pid != NULL) {
+			*pid = child;
+		}
+	}
+	return result;
+}
+
+int posix_spawnp(pid_t* pid, const char* file, const posix_spawn_file_actions_t* actions, const posix_spawnattr_t* attributes, char* const argv[], char* const envp[]) {
+	ensure_initialized();
+	pid_t child = 0;
+	vm_spawn_begin();
+	char* entries[carried_capacity(envp)];
+	carried_strings_t strings;
+	int result = process_state.real_posix_spawnp(&child, file, actions, attributes, argv, carry_environment(envp, entries, &strings, true));
+	vm_spawn_end(result == 0 ? child : 0);
+	if (result == 0) {
+		add_child(child);
+		if (pid != NULL) {
+			*pid = child;
+		}
+	}
+	return result;
+}
+
+pid_t wait(int* status) {
+	ensure_initialized();
+	return reap(-1, status, 0, NULL);
+}
+
+pid_t waitpid(pid_t pid, int* status, int options) {
+	ensure_initialized();
+	return reap(pid, status, options, NULL);
+}
+
+pid_t wait4(pid_t pid, int* status, int options, struct rusage* usage) {
+	ensure_initialized();
+	return reap(pid, status, options, usage);
+}
+
+/*
+ * Temporary names. Every job starts from the same seed, so names drawn from
+ * the stream would be the same in concurrent jobs, which then collide and
+ * spin in O_EXCL retry loops. Instead, a process image's n-th name hashes
+ * (DETERMINISTIC_NAMESPACE, seed, lineage, n): the same on every run of a
+ * job, and different between jobs with different namespaces or seeds and
+ * between the processes of one job. Concurrent jobs from one seed must
+ * each be given a namespace (det-batch uses the job id; deterministic-run
+ * has --namespace) or they draw the same names. A name that exists anyway
+ * (say, left over from an earlier run) is skipped, as glibc does.
+ */
+typedef enum {
+	TEMP_FILE,
+	TEMP_DIRECTORY,
+	TEMP_NAME,
+} temp_kind_t;
+
+static const char temp_letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+int det_tempname(char* template, int suffix_length) {
+	ensure_initialized();
+	size_t length = strlen(template);
+	if (suffix_length < 0 || length < 6 + (size_t)suffix_length || strncmp(template + length - suffix_length - 6, "XXXXXX", 6) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	char* name = template + length - suffix_length - 6;
+	const char* namespace = getenv("DETERMINISTIC_NAMESPACE");
+	uint64_t key = mix_seed(mix_seed(hash_name(namespace != NULL ? namespace : ""), hash_name(process_state.lineage)), process_state.seed);
+	uint64_t bits = mix_seed(key, __atomic_fetch_add(&process_state.tempnames, 1, __ATOMIC_RELAXED));
+	for (size_t i = 0; i < 6; ++i) {
+		name[i] = temp_letters[bits % (sizeof(temp_letters) - 1)];
+		bits /= sizeof(temp_letters) - 1;
+	}
+	return 0;
+}
+
+int INTERNAL make_temp(char* template, int suffix_length, int flags, temp_kind_t kind) {
+	for (int attempt = 0; attempt < TMP_MAX; ++attempt) {
+		if (det_tempname(template, suffix_length) != 0) {
+			return -1;
+		}
+		int result;
+		struct stat info;
+		switch (kind) {
+		case TEMP_FILE:
+			result = process_state.real_open(template, (flags & ~O_ACCMODE) | O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+			break;
+		case TEMP_DIRECTORY:
+			result = mkdir(template, S_IRUSR | S_IWUSR | S_IXUSR);
+			break;
+		default:
+			if (lstat(template, &info) == 0) {
+				errno = EEXIST;
+				result = -1;
+			} else {
+				result = errno == ENOENT ? 0 : -1;
+			}
+			break;
+		}
+		if (result >= 0 || errno != EEXIST) {
+			return result;
+		}
+	}
+	errno = EEXIST;
+	return -1;
+}
+
+int mkstemp(char* template) {
+	return make_temp(template, 0, 0, TEMP_FILE);
+}
+
+int mkstemp64(char* template) {
+	return make_temp(template, 0, 0, TEMP_FILE);
+}
+
+int mkostemp(char* template, int flags) {
+	return make_temp(template, 0, flags, TEMP_FILE);
+}
+
+int mkostemp64(char* template, int flags) {
+	return make_temp(template, 0, flags, TEMP_FILE);
+}
+
+int mkstemps(char* template, int suffix_length) {
+	return make_temp(template, suffix_length, 0, TEMP_FILE);
+}
+
+int mkstemps64(char* template, int suffix_length) {
+	return make_temp(template, suffix_length, 0, TEMP_FILE);
+}
+
+int mkostemps(char* template, int suffix_length, int flags) {
+	return make_temp(template, suffix_length, flags, TEMP_FILE);
+}
+
+int mkostemps64(char* template, int suffix_length, int flags) {
+	return make_temp(template, suffix_length, flags, TEMP_FILE);
+}
+
+char* mkdtemp(char* template) {
+	return make_temp(template, 0, 0, TEMP_DIRECTORY) == 0 ? template : NULL;
+}
+
+char* mktemp(char* template) {
+	if (make_temp(template, 0, 0, TEMP_NAME) != 0) {
+		template[0] = '\0';
+	}
+	return template;
+}
+
+FILE* tmpfile(void) {
+	char path[] = P_tmpdir "/tmpfXXXXXX";
+	int fd = make_temp(path, 0, O_CLOEXEC, TEMP_FILE);
+	if (fd < 0) {
+		return NULL;
+	}
+	unlink(path);
+	FILE* file = fdopen(fd, "w+");
+	if (file == NULL) {
+		process_state.real_close(fd);
+	}
+	return file;
+}
+
+FILE* tmpfile64(void) {
+	return tmpfile();
+}
+
+char* tmpnam_r(char name[L_tmpnam]) {
+	if (name == NULL) {
+		return NULL;
+	}
+	snprintf(name, L_tmpnam, "%s/fileXXXXXX", P_tmpdir);
+	return make_temp(name, 0, 0, TEMP_NAME) == 0 ? name : NULL;
+}
+
+char* tmpnam(char name[L_tmpnam]) {
+	static char buffer[L_tmpnam];
+	return tmpnam_r(name != NULL ? name : buffer);
+}
+
+bool INTERNAL is_writable_directory(const char* path) {
+	struct stat info;
+	return path != NULL && stat(path, &info) == 0 && S_ISDIR(info.st_mode) && access(path, W_OK | X_OK) == 0;
+}
+
+/*
+ * Like glibc: TMPDIR, then directory, then P_tmpdir, whichever is usable first.
+ */
+char* tempnam(const char* directory, const char* prefix) {
+	const char* tmpdir = secure_getenv("TMPDIR");
+	const char* chosen = is_writable_directory(tmpdir) ? tmpdir : is_writable_directory(directory) ? directory : P_tmpdir;
+	char* name;
+	if (asprintf(&name, "%s/%.5sXXXXXX", chosen, prefix != NULL ? prefix : "file") < 0) {
+		return NULL;
+	}
+	if (make_temp(name, 0, 0, TEMP_NAME) != 0) {
+		free(name);
+		return NULL;
+	}
+	return name;
+}
+
+/*
+ * Audit mode: every entry in nondeterministic_sources.h gets a wrapper that
+ * only counts its calls. With DETERMINISTIC_AUDIT=1 (or =stderr) the counts
+ * are printed to stderr at exit; any other value is a file to append to.
+ * Without it nothing is counted, so hot sources do not share a cache line
+ * between threads for nothing.
+ */
+
+typedef enum {
+#define SOURCE(ret, name, params, args) AUDIT_##name,
+#define VOID_SOURCE(name, params, args) AUDIT_##name,
+#define OPT_IN_SOURCE(name) AUDIT_##name,
+#include "nondeterministic_sources.h"
+#undef SOURCE
+#undef VOID_SOURCE
+#undef OPT_IN_SOURCE
+	AUDIT_SOURCES,
+} audit_source_t;
+
+const char* audit_source_names[AUDIT_SOURCES] = {
+#define SOURCE(ret, name, params, args) #name,
+#define VOID_SOURCE(name, params, args) #name,
+#define OPT_IN_SOURCE(name) #name,
+#include "nondeterministic_sources.h"
+#undef SOURCE
+#undef VOID_SOURCE
+#undef OPT_IN_SOURCE
+};
+
+uint64_t audit_counts[AUDIT_SOURCES];
+
+/*
+ * 0 until first needed, then 1 if DETERMINISTIC_AUDIT is set and -1 if not.
+ * Read on first use, since sources are called before our constructors.
+ */
+int audit_enabled;
+
+bool INTERNAL auditing() {
+	int enabled = __atomic_load_n(&audit_enabled, __ATOMIC_RELAXED);
+	if (UNLIKELY(enabled == 0)) {
+		const char* destination = getenv("DETERMINISTIC_AUDIT");
+		enabled = destination != NULL && *destination != '\0' ? 1 : -1;
+		__atomic_store_n(&audit_enabled, enabled, __ATOMIC_RELAXED);
+	}
+	return enabled > 0;
+}
+
+#define AUDIT_COUNT(name) do { \
+		if (UNLIKELY(auditing())) { \
+			__atomic_fetch_add(&audit_counts[AUDIT_##name], 1, __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
+#define SOURCE(ret, name, params, args) \
+	ret name params { \
+		static ret (*real) params; \
+		AUDIT_COUNT(name); \
+		if (UNLIKELY(real == NULL)) { \
+			real = dlsym(RTLD_NEXT, #name); \
+		} \
+		return real args; \
+	}
+#define VOID_SOURCE(name, params, args) \
+	void name params { \
+		static void (*real) params; \
+		AUDIT_COUNT(name); \
+		if (UNLIKELY(real == NULL)) { \
+			real = dlsym(RTLD_NEXT, #name); \
+		} \
+		real args; \
+	}
+#define OPT_IN_SOURCE(name)
+#include "nondeterministic_sources.h"
+#undef SOURCE
+#undef VOID_SOURCE
+#undef OPT_IN_SOURCE
+
+/*
+ * What libfaketime intercepts, when it is preloaded alongside the shim.
+ */
+bool INTERNAL faketime_covers(const char* name) {
+	const char* covered[] = {"clock_gettime", "gettimeofday", "time", "nanosleep", "clock_nanosleep", "sleep", "usleep", "alarm", "setitimer", "timer_create"};
+	for (size_t i = 0; i < sizeof(covered) / sizeof(covered[0]); ++i) {
+		if (strcmp(name, covered[i]) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+__attribute__((destructor)) void INTERNAL report_audit() {
+	const char* destination = getenv("DETERMINISTIC_AUDIT");
+	if (destination == NULL || *destination == '\0') {
+		return;
+	}
+	FILE* out = stderr;
+	if (strcmp(destination, "1") != 0 && strcmp(destination, "stderr") != 0) {
+		out = fopen(destination, "a");
+		if (out == NULL) {
+			return;
+		}
+	}
+	bool faketime = getenv("FAKETIME") != NULL;
+	// The raw syscall, so that reporting does not count itself.
+	long pid = syscall(SYS_getpid);
+	size_t used = 0;
+	for (size_t i = 0; i < AUDIT_SOURCES; ++i) {
+		uint64_t count = __atomic_load_n(&audit_counts[i], __ATOMIC_RELAXED);
+		if (count > 0) {
+			if (used++ == 0) {
+				fprintf(out, "deterministic audit: %s (pid %ld) used nondeterminism the shim does not cover:\n", program_invocation_name, pid);
+			}
+			fprintf(out, "  %-20s %10llu%s\n", audit_source_names[i], (unsigned long long)count, faketime && faketime_covers(audit_source_names[i]) ? "  (likely covered by libfaketime)" : "");
+		}
+	}
+	if (used == 0) {
+		fprintf(out, "deterministic audit: %s (pid %ld) used no uncovered nondeterminism\n", program_invocation_name, pid);
+	}
+	if (out != stderr) {
+		fclose(out);
+	} else {
+		fflush(out);
+	}
+}
+
+/*
+ * Before an exec: report what was used so far, then start counting afresh in
+ * case the exec fails.
+ */
+void INTERNAL flush_audit() {
+	bool used = false;
+	for (size_t i = 0; i < AUDIT_SOURCES && !used; ++i) {
+		used = __atomic_load_n(&audit_counts[i], __ATOMIC_RELAXED) > 0;
+	}
+	if (!used) {
+		// Failed execs along a PATH search would each report nothing.
+		return;
+	}
+	report_audit();
+	for (size_t i = 0; i < AUDIT_SOURCES; ++i) {
+		__atomic_store_n(&audit_counts[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Virtual clock mode (DETERMINISTIC_VIRTUAL_CLOCK=1): clock_gettime,
+ * gettimeofday and time read det_clock_gettime's clock. Sleeps advance that
+ * clock by their duration and return at once. alarm, setitimer(ITIMER_REAL)
+ * and timer_create timers run on it too: their signals are sent at the
+ * intercepted call that moves virtual time past the deadline, so handlers
+ * interrupt the program at the same point on every run. A sleep that a
+ * timer cuts short returns EINTR with the rest of its duration, and pause()
+ * jumps to the next deadline.
+ *
+ * CPU-time clocks and timers stay real. Virtual timers do not survive exec,
+ * and poll, select and epoll timeouts still wait in real time.
+ */
+
+#define VIRTUAL_TIMER_TAG ((uintptr_t)1 << 62)
+
+bool INTERNAL is_cpu_clock(clockid_t clock) {
+	return clock < 0 || clock == CLOCK_PROCESS_CPUTIME_ID || clock == CLOCK_THREAD_CPUTIME_ID;
+}
+
+uint64_t INTERNAL timespec_ns(const struct timespec* time) {
+	return (uint64_t)time->tv_sec * NS_PER_S + time->tv_nsec;
+}
+
+struct timespec INTERNAL ns_timespec(uint64_t ns) {
+	return (struct timespec){ns / NS_PER_S, ns % NS_PER_S};
+}
+
+struct timeval INTERNAL ns_timeval(uint64_t ns) {
+	// Round up, as the kernel does, so that an armed timer never reads as zero.
+	return (struct timeval){ns / NS_PER_S, (ns % NS_PER_S + 999) / 1000};
+}
+
+/*
+ * Moves virtual time forward to at least target; never back.
+ */
+void INTERNAL advance_clock_to(uint64_t target) {
+	uint64_t now = __atomic_load_n(&process_state.clock_ns, __ATOMIC_RELAXED);
+	while (now < target && !__atomic_compare_exchange_n(&process_state.clock_ns, &now, target, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/*
+ * Called with timers_lock held.
+ */
+void INTERNAL update_next_deadline() {
+	uint64_t next = UINT64_MAX;
+	for (size_t i = 0; i < MAX_VIRTUAL_TIMERS; ++i) {
+		if (process_state.timers[i].armed && process_state.timers[i].deadline < next) {
+			next = process_state.timers[i].deadline;
+		}
+	}
+	__atomic_store_n(&process_state.next_deadline, next, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+	size_t index;
+	uint64_t deadline;
+	struct sigevent event;
+	thread_attributes_t attributes;
+} timer_expiry_t;
+
+typedef struct {
+	void (*function)(union sigval);
+	union sigval value;
+} timer_thread_start_t;
+
+void* INTERNAL timer_thread(void* data) {
+	timer_thread_start_t start = *(timer_thread_start_t*)data;
+	free(data);
+	start.function(start.value);
+	return NULL;
+}
+
+/*
+ * Whether sig, sent now, would run a handler and so interrupt a sleep.
+ */
+bool INTERNAL signal_interrupts(int sig) {
+	sigset_t blocked;
+	struct sigaction action;
+	if (pthread_sigmask(SIG_BLOCK, NULL, &blocked) != 0 || sigismember(&blocked, sig) || sigaction(sig, NULL, &action) != 0) {
+		return false;
+	}
+	if (action.sa_handler == SIG_IGN) {
+		return false;
+	}
+	return action.sa_handler != SIG_DFL || !(sig == SIGCHLD || sig == SIGURG || sig == SIGWINCH || sig == SIGCONT);
+}
+
+void INTERNAL copy_thread_attributes(const pthread_attr_t* from, thread_attributes_t* to) {
+	*to = (thread_attributes_t){.set = from != NULL};
+	if (from == NULL) {
+		return;
+	}
+	pthread_attr_getstacksize(from, &to->stack_size);
+	pthread_attr_getguardsize(from, &to->guard_size);
+	pthread_attr_getscope(from, &to->scope);
+	pthread_attr_getinheritsched(from, &to->inherit);
+	pthread_attr_getschedpolicy(from, &to->policy);
+	pthread_attr_getschedparam(from, &to->parameters);
+	CPU_ZERO(&to->cpus);
+	to->pinned = pthread_attr_getaffinity_np(from, sizeof(to->cpus), &to->cpus) == 0 && CPU_COUNT(&to->cpus) > 0;
+}
+
+/*
+ * Builds a detached attr from the copy; the caller destroys it.
+ */
+void INTERNAL make_thread_attributes(const thread_attributes_t* from, pthread_attr_t* to) {
+	pthread_attr_init(to);
+	pthread_attr_setdetachstate(to, PTHREAD_CREATE_DETACHED);
+	if (!from->set) {
+		return;
+	}
+	pthread_attr_setstacksize(to, from->stack_size);
+	pthread_attr_setguardsize(to, from->guard_size);
+	pthread_attr_setscope(to, from->scope);
+	pthread_attr_setinheritsched(to, from->inherit);
+	pthread_attr_setschedpolicy(to, from->policy);
+	pthread_attr_setschedparam(to, &from->parameters);
+	if (from->pinned) {
+		pthread_attr_setaffinity_np(to, sizeof(from->cpus), &from->cpus);
+	}
+}
+
+/*
+ * Sends an expired timer's notification. A signal goes to the calling
+ * thread, so that it lands at this call, unless that thread blocks it.
+ */
+bool INTERNAL notify_timer(const timer_expiry_t* expiry) {
+	const struct sigevent* event = &expiry->event;
+	if (event->sigev_notify == SIGEV_THREAD) {
+		timer_thread_start_t* start = malloc(sizeof(timer_thread_start_t));
+		if (start == NULL) {
+			return false;
+		}
+		*start = (timer_thread_start_t){event->sigev_notify_function, event->sigev_value};
+		pthread_attr_t attributes;
+		make_thread_attributes(&expiry->attributes, &attributes);
+		pthread_t thread;
+		if (pthread_create(&thread, &attributes, timer_thread, start) != 0) {
+			free(start);
+		}
+		pthread_attr_destroy(&attributes);
+		return false;
+	}
+	if (event->sigev_notify != SIGEV_SIGNAL && event->sigev_notify != SIGEV_THREAD_ID) {
+		return false;
+	}
+	siginfo_t info = {0};
+	info.si_signo = event->sigev_signo;
+	// ITIMER_REAL's SIGALRM comes from the kernel; POSIX timers carry their value.
+	info.si_code = expiry->index == 0 ? SI_KERNEL : SI_TIMER;
+	info.si_value = event->sigev_value;
+	pid_t pid = syscall(SYS_getpid);
+	pid_t tid = event->sigev_notify == SIGEV_THREAD_ID ? event->_sigev_un._tid : (pid_t)syscall(SYS_gettid);
+	bool interrupts = signal_interrupts(event->sigev_signo);
+	if (event->sigev_notify == SIGEV_THREAD_ID || interrupts) {
+		syscall(SYS_rt_tgsigqueueinfo, pid, tid, event->sigev_signo, &info);
+	} else {
+		syscall(SYS_rt_sigqueueinfo, pid, event->sigev_signo, &info);
+	}
+	return interrupts && tid == syscall(SYS_gettid);
+}
+
+int INTERNAL compare_expiries(const void* left, const void* right) {
+	const timer_expiry_t* a = left;
+	const timer_expiry_t* b = right;
+	if (a->deadline != b->deadline) {
+		return a->deadline < b->deadline ? -1 : 1;
+	}
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/*
+ * Sends every timer whose deadline is at or before now, earliest first, and
+ * re-arms the periodic ones. Returns whether one interrupted this thread.
+ */
+bool INTERNAL fire_timers(uint64_t now) {
+	if (LIKELY(now < __atomic_load_n(&process_state.next_deadline, __ATOMIC_ACQUIRE)) || current_vm_child() != NULL) {
+		return false;
+	}
+	timer_expiry_t expiries[MAX_VIRTUAL_TIMERS];
+	size_t used = 0;
+	pthread_mutex_lock(&process_state.timers_lock);
+	for (size_t i = 0; i < MAX_VIRTUAL_TIMERS; ++i) {
+		virtual_timer_t* timer = &process_state.timers[i];
+		if (!timer->armed || timer->deadline > now) {
+			continue;
+		}
+		expiries[used++] = (timer_expiry_t){i, timer->deadline, timer->event, timer->attributes};
+		if (timer->interval == 0) {
+			timer->armed = false;
+			timer->overruns = 0;
+		} else {
+			// Expirations skipped over count as overruns, as in the kernel.
+			timer->overruns = (now - timer->deadline) / timer->interval;
+			timer->deadline += (timer->overruns + 1) * timer->interval;
+		}
+	}
+	update_next_deadline();
+	pthread_mutex_unlock(&process_state.timers_lock);
+	qsort(expiries, used, sizeof(timer_expiry_t), compare_expiries);
+	bool interrupted = false;
+	for (size_t i = 0; i < used; ++i) {
+		interrupted = notify_timer(&expiries[i]) || interrupted;
+	}
+	return interrupted;
+}
+
+uint64_t INTERNAL virtual_now() {
+	return __atomic_load_n(&process_state.clock_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleeps for duration virtual nanoseconds without waiting. Returns the
+ * part left when a timer's signal interrupted it, or 0.
+ */
+uint64_t INTERNAL virtual_sleep(uint64_t duration) {
+	uint64_t end = virtual_now() + duration;
+	while (true) {
+		uint64_t next = __atomic_load_n(&process_state.next_deadline, __ATOMIC_ACQUIRE);
+		uint64_t stop = next < end ? next : end;
+		advance_clock_to(stop);
+		if (fire_timers(stop) && stop < end) {
+			return end - stop;
+		}
+		if (stop >= end) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Arms (or with a zero value, disarms) slot. value and interval are
+ * virtual nanoseconds; absolute values are on the timer's own clock.
+ */
+void INTERNAL arm_timer(size_t slot, uint64_t value, uint64_t interval, bool absolute, uint64_t* old_remaining, uint64_t* old_interval) {
+	pthread_mutex_lock(&process_state.timers_lock);
+	virtual_timer_t* timer = &process_state.timers[slot];
+	uint64_t now = virtual_now();
+	if (old_remaining != NULL) {
+		*old_remaining = timer->armed && timer->deadline > now ? timer->deadline - now : timer->armed ? 1 : 0;
+		*old_interval = timer->interval;
+	}
+	timer->armed = value != 0;
+	timer->interval = interval;
+	timer->overruns = 0;
+	if (absolute) {
+		uint64_t offset = timer->realtime ? process_state.clock_start * NS_PER_S : 0;
+		value = value > offset ? value - offset : 0;
+		timer->deadline = value;
+	} else {
+		timer->deadline = now + value;
+	}
+	update_next_deadline();
+	pthread_mutex_unlock(&process_state.timers_lock);
+	// An absolute deadline may already have passed.
+	fire_timers(virtual_now());
+}
+
+int clock_gettime(clockid_t clock, struct timespec* time) {
+	ensure_initialized();
+	if (!process_state.virtual_clock || is_cpu_clock(clock)) {
+		AUDIT_COUNT(clock_gettime);
+		return process_state.real_clock_gettime(clock, time);
+	}
+	return det_clock_gettime(clock, time);
+}
+
+int gettimeofday(struct timeval* time, void* zone) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(gettimeofday);
+		return process_state.real_gettimeofday(time, zone);
+	}
+	struct timespec now;
+	det_clock_gettime(CLOCK_REALTIME, &now);
+	*time = (struct timeval){now.tv_sec, now.tv_nsec / 1000};
+	if (zone != NULL) {
+		memset(zone, 0, sizeof(struct timezone));
+	}
+	return 0;
+}
+
+time_t time(time_t* result) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(time);
+		return process_state.real_time(result);
+	}
+	struct timespec now;
+	det_clock_gettime(CLOCK_REALTIME, &now);
+	if (result != NULL) {
+		*result = now.tv_sec;
+	}
+	return now.tv_sec;
+}
+
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec* duration, struct timespec* remaining) {
+	ensure_initialized();
+	if (!process_state.virtual_clock || is_cpu_clock(clock)) {
+		AUDIT_COUNT(clock_nanosleep);
+		return process_state.real_clock_nanosleep(clock, flags, duration, remaining);
+	}
+	if (duration->tv_sec < 0 || duration->tv_nsec < 0 || duration->tv_nsec >= NS_PER_S) {
+		return EINVAL;
+	}
+	uint64_t ns = timespec_ns(duration);
+	if (flags & TIMER_ABSTIME) {
+		uint64_t now = virtual_now() + (clock == CLOCK_REALTIME ? process_state.clock_start * NS_PER_S : 0);
+		ns = ns > now ? ns - now : 0;
+	}
+	uint64_t left = virtual_sleep(ns);
+	if (left == 0) {
+		return 0;
+	}
+	if (remaining != NULL && !(flags & TIMER_ABSTIME)) {
+		*remaining = ns_timespec(left);
+	}
+	return EINTR;
+}
+
+int nanosleep(const struct timespec* duration, struct timespec* remaining) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(nanosleep);
+		return process_state.real_nanosleep(duration, remaining);
+	}
+	int error = clock_nanosleep(CLOCK_MONOTONIC, 0, duration, remaining);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(sleep);
+		return process_state.real_sleep(seconds);
+	}
+	uint64_t left = virtual_sleep((uint64_t)seconds * NS_PER_S);
+	return (left + NS_PER_S - 1) / NS_PER_S;
+}
+
+int usleep(useconds_t microseconds) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(usleep);
+		return process_state.real_usleep(microseconds);
+	}
+	if (virtual_sleep((uint64_t)microseconds * 1000) != 0) {
+		errno = EINTR;
+		return -1;
+	}
+	return 0;
+}
+
+int pause(void) {
+	ensure_initialized();
+	while (process_state.virtual_clock) {
+		uint64_t next = __atomic_load_n(&process_state.next_deadline, __ATOMIC_ACQUIRE);
+		if (next == UINT64_MAX) {
+			break;
+		}
+		advance_clock_to(next);
+		if (fire_timers(next)) {
+			errno = EINTR;
+			return -1;
+		}
+	}
+	return process_state.real_pause();
+}
+
+void INTERNAL itimer_event() {
+	process_state.timers[0].allocated = true;
+	process_state.timers[0].event = (struct sigevent){.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGALRM};
+}
+
+int setitimer(__itimer_which_t which, const struct itimerval* value, struct itimerval* old) {
+	ensure_initialized();
+	if (!process_state.virtual_clock || which != ITIMER_REAL) {
+		AUDIT_COUNT(setitimer);
+		return process_state.real_setitimer(which, value, old);
+	}
+	if (value->it_value.tv_usec < 0 || value->it_value.tv_usec >= 1000000 || value->it_interval.tv_usec < 0 || value->it_interval.tv_usec >= 1000000) {
+		errno = EINVAL;
+		return -1;
+	}
+	itimer_event();
+	uint64_t old_remaining;
+	uint64_t old_interval;
+	arm_timer(
+		0,
+		(uint64_t)value->it_value.tv_sec * NS_PER_S + value->it_value.tv_usec * 1000,
+		(uint64_t)value->it_interval.tv_sec * NS_PER_S + value->it_interval.tv_usec * 1000,
+		false, &old_remaining, &old_interval
+	);
+	if (old != NULL) {
+		*old = (struct itimerval){ns_timeval(old_interval), ns_timeval(old_remaining)};
+	}
+	return 0;
+}
+
+int getitimer(__itimer_which_t which, struct itimerval* value) {
+	ensure_initialized();
+	if (!process_state.virtual_clock || which != ITIMER_REAL) {
+		return process_state.real_getitimer(which, value);
+	}
+	pthread_mutex_lock(&process_state.timers_lock);
+	const virtual_timer_t* timer = &process_state.timers[0];
+	uint64_t now = virtual_now();
+	uint64_t remaining = timer->armed ? (timer->deadline > now ? timer->deadline - now : 1) : 0;
+	*value = (struct itimerval){ns_timeval(timer->interval), ns_timeval(remaining)};
+	pthread_mutex_unlock(&process_state.timers_lock);
+	return 0;
+}
+
+unsigned int alarm(unsigned int seconds) {
+	ensure_initialized();
+	if (!process_state.virtual_clock) {
+		AUDIT_COUNT(alarm);
+		return process_state.real_alarm(seconds);
+	}
+	itimer_event();
+	uint64_t old_remaining;
+	uint64_t old_interval;
+	arm_timer(0, (uint64_t)seconds * NS_PER_S, 0, false, &old_remaining, &old_interval);
+	// Like the kernel: round to the nearest second, but never report a pending alarm as 0.
+	unsigned int old = (old_remaining + NS_PER_S / 2) / NS_PER_S;
+	return old == 0 && old_remaining != 0 ? 1 : old;
+}
+
+/*
+ * The slot behind a timer_t from timer_create, or 0 for a real timer.
+ */
+size_t INTERNAL virtual_timer_slot(timer_t timer) {
+	uintptr_t id = (uintptr_t)timer;
+	if ((id & VIRTUAL_TIMER_TAG) == 0) {
+		return 0;
+	}
+	size_t slot = id & ~VIRTUAL_TIMER_TAG;
+	return slot > 0 && slot < MAX_VIRTUAL_TIMERS && process_state.timers[slot].allocated ? slot : 0;
+}
+
+int timer_create(clockid_t clock, struct sigevent* event, timer_t* timer) {
+	ensure_initialized();
+	if (!process_state.virtual_clock || is_cpu_clock(clock)) {
+		AUDIT_COUNT(timer_create);
+		return process_state.real_timer_create(clock, event, timer);
+	}
+	pthread_mutex_lock(&process_state.timers_lock);
+	size_t slot = 1;
+	while (slot < MAX_VIRTUAL_TIMERS && process_state.timers[slot].allocated) {
+		++slot;
+	}
+	if (slot == MAX_VIRTUAL_TIMERS) {
+		pthread_mutex_unlock(&process_state.timers_lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	virtual_timer_t* created = &process_state.timers[slot];
+	*created = (virtual_timer_t){.allocated = true, .realtime = clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE || clock == CLOCK_REALTIME_ALARM};
+	*timer = (timer_t)(VIRTUAL_TIMER_TAG | slot);
+	if (event != NULL) {
+		created->event = *event;
+		if (event->sigev_notify == SIGEV_THREAD) {
+			copy_thread_attributes(event->sigev_notify_attributes, &created->attributes);
+			created->event.sigev_notify_attributes = NULL;
+		}
+	} else {
+		// The default: SIGALRM carrying the timer's id.
+		created->event = (struct sigevent){.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGALRM};
+		created->event.sigev_value.sival_ptr = *timer;
+	}
+	pthread_mutex_unlock(&process_state.timers_lock);
+	return 0;
+}
+
+int timer_settime(timer_t timer, int flags, const struct itimerspec* value, struct itimerspec* old) {
+	ensure_initialized();
+	size_t slot = virtual_timer_slot(timer);
+	if (slot == 0) {
+		return process_state.real_timer_settime(timer, flags, value, old);
+	}
+	if (value->it_value.tv_nsec < 0 || value->it_value.tv_nsec >= NS_PER_S || value->it_interval.tv_nsec < 0 || value->it_interval.tv_nsec >= NS_PER_S) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t old_remaining;
+	uint64_t old_interval;
+	arm_timer(slot, timespec_ns(&value->it_value), timespec_ns(&value->it_interval), flags & TIMER_ABSTIME, &old_remaining, &old_interval);
+	if (old != NULL) {
+		*old = (struct itimerspec){ns_timespec(old_interval), ns_timespec(old_remaining)};
+	}
+	return 0;
+}
+
+int timer_gettime(timer_t timer, struct itimerspec* value) {
+	ensure_initialized();
+	size_t slot = virtual_timer_slot(timer);
+	if (slot == 0) {
+		return process_state.real_timer_gettime(timer, value);
+	}
+	pthread_mutex_lock(&process_state.timers_lock);
+	const virtual_timer_t* found = &process_state.timers[slot];
+	uint64_t now = virtual_now();
+	uint64_t remaining = found->armed ? (found->deadline > now ? found->deadline - now : 1) : 0;
+	*value = (struct itimerspec){ns_timespec(found->interval), ns_timespec(remaining)};
+	pthread_mutex_unlock(&process_state.timers_lock);
+	return 0;
+}
+
+int timer_getoverrun(timer_t timer) {
+	ensure_initialized();
+	size_t slot = virtual_timer_slot(timer);
+	if (slot == 0) {
+		return process_state.real_timer_getoverrun(timer);
+	}
+	return process_state.timers[slot].overruns > INT32_MAX ? INT32_MAX : (int)process_state.timers[slot].overruns;
+}
+
+int timer_delete(timer_t timer) {
+	ensure_initialized();
+	size_t slot = virtual_timer_slot(timer);
+	if (slot == 0) {
+		return process_state.real_timer_delete(timer);
+	}
+	pthread_mutex_lock(&process_state.timers_lock);
+	process_state.timers[slot] = (virtual_timer_t){0};
+	update_next_deadline();
+	pthread_mutex_unlock(&process_state.timers_lock);
+	return 0;
+}
+
+/*
+ * Epoll ordering; see epoll_order_t. The registration table is only
+ * touched with epoll_lock held.
+ */
+
+uint32_t* INTERNAL epoll_fd_head(int fd, bool create) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) {
+		return NULL;
+	}
+	uint32_t** chunk = &process_state.epoll_fds[fd / FD_CHUNK];
+	if (*chunk == NULL && create) {
+		*chunk = calloc(FD_CHUNK, sizeof(uint32_t));
+	}
+	return *chunk == NULL ? NULL : &(*chunk)[fd % FD_CHUNK];
+}
+
+/*
+ * Slot plus one of epfd's registration of fd, or 0.
+ */
+uint32_t INTERNAL find_epoll_registration(int epfd, int fd) {
+	uint32_t* head = epoll_fd_head(fd, false);
+	for (uint32_t slot = head == NULL ? 0 : *head; slot != 0; slot = process_state.epoll_registrations[slot - 1].next) {
+		if (process_state.epoll_registrations[slot - 1].epfd == epfd) {
+			return slot;
+		}
+	}
+	return 0;
+}
+
+uint32_t INTERNAL add_epoll_registration(int epfd, int fd, epoll_data_t data) {
+	uint32_t* head = epoll_fd_head(fd, true);
+	if (head == NULL) {
+		return 0;
+	}
+	uint32_t slot = process_state.free_epoll_registration;
+	if (slot != 0) {
+		process_state.free_epoll_registration = process_state.epoll_registrations[slot - 1].next;
+	} else {
+		if (process_state.used_epoll_registrations == process_state.epoll_registrations_capacity) {
+			uint32_t capacity = process_state.epoll_registrations_capacity ? process_state.epoll_registrations_capacity * 2 : 64;
+			epoll_registration_t* registrations = realloc(process_state.epoll_registrations, capacity * sizeof(epoll_registration_t));
+			if (registrations == NULL) {
+				return 0;
+			}
+			process_state.epoll_registrations = registrations;
+			process_state.epoll_registrations_capacity = capacity;
+		}
+		slot = ++process_state.used_epoll_registrations;
+		process_state.epoll_registrations[slot - 1].generation = 0;
+	}
+	epoll_registration_t* registration = &process_state.epoll_registrations[slot - 1];
+	registration->used = true;
+	registration->epfd = epfd;
+	registration->fd = fd;
+	registration->generation++;
+	registration->ordinal = ++process_state.epoll_ordinals;
+	registration->data = data;
+	registration->next = *head;
+	*head = slot;
+	return slot;
+}
+
+void INTERNAL remove_epoll_registration(uint32_t slot) {
+	epoll_registration_t* registration = &process_state.epoll_registrations[slot - 1];
+	uint32_t* link = epoll_fd_head(registration->fd, false);
+	while (link != NULL && *link != 0 && *link != slot) {
+		link = &process_state.epoll_registrations[*link - 1].next;
+	}
+	if (link != NULL && *link == slot) {
+		*link = registration->next;
+	}
+	registration->used = false;
+	registration->next = process_state.free_epoll_registration;
+	process_state.free_epoll_registration = slot;
+}
+
+uint64_t INTERNAL epoll_key(uint32_t slot) {
+	return (uint64_t)process_state.epoll_registrations[slot - 1].generation << 32 | slot;
+}
+
+/*
+ * The registration an event's data came from, or NULL for an fd registered
+ * before ordering began (or past the fd table).
+ */
+epoll_registration_t* INTERNAL epoll_event_registration(int epfd, const struct epoll_event* event) {
+	uint32_t slot = event->data.u64 & UINT32_MAX;
+	if (slot == 0 || slot > process_state.used_epoll_registrations) {
+		return NULL;
+	}
+	epoll_registration_t* registration = &process_state.epoll_registrations[slot - 1];
+	return registration->used && registration->epfd == epfd && registration->generation == event->data.u64 >> 32 ? registration : NULL;
+}
+
+int epoll_ctl(int epfd, int operation, int fd, struct epoll_event* event) {
+	ensure_initialized();
+	if (LIKELY(process_state.epoll_order == EPOLL_NATIVE)) {
+		return process_state.real_epoll_ctl(epfd, operation, fd, event);
+	}
+	if (event == NULL && operation != EPOLL_CTL_DEL) {
+		// Let the kernel fail it with EFAULT; nothing is registered.
+		return process_state.real_epoll_ctl(epfd, operation, fd, event);
+	}
+	pthread_mutex_lock(&process_state.epoll_lock);
+	uint32_t old = find_epoll_registration(epfd, fd);
+	int result;
+	if (operation == EPOLL_CTL_ADD) {
+		uint32_t slot = add_epoll_registration(epfd, fd, event->data);
+		struct epoll_event keyed = *event;
+		if (slot != 0) {
+			keyed.data.u64 = epoll_key(slot);
+		}
+		result = process_state.real_epoll_ctl(epfd, operation, fd, &keyed);
+		if (slot != 0 && result != 0) {
+			remove_epoll_registration(slot);
+		} else if (old != 0 && result == 0) {
+			// Left over from an fd that was closed without EPOLL_CTL_DEL.
+			remove_epoll_registration(old);
+		}
+	} else if (operation == EPOLL_CTL_MOD && old != 0) {
+		struct epoll_event keyed = *event;
+		keyed.data.u64 = epoll_key(old);
+		result = process_state.real_epoll_ctl(epfd, operation, fd, &keyed);
+		if (result == 0) {
+			process_state.epoll_registrations[old - 1].data = event->data;
+		}
+	} else {
+		result = process_state.real_epoll_ctl(epfd, operation, fd, event);
+		if (operation == EPOLL_CTL_DEL && old != 0 && result == 0) {
+			remove_epoll_registration(old);
+		}
+	}
+	pthread_mutex_unlock(&process_state.epoll_lock);
+	return result;
+}
+
+typedef struct {
+	uint64_t ordinal;
+	size_t position;
+	struct epoll_event event;
+} ordered_event_t;
+
+int INTERNAL compare_ordered_events(const void* left, const void* right) {
+	const ordered_event_t* a = left;
+	const ordered_event_t* b = right;
+	if (a->ordinal != b->ordinal) {
+		return a->ordinal < b->ordinal ? -1 : 1;
+	}
+	return a->position < b->position ? -1 : a->position > b->position;
+}
+
+/*
+ * Settles, sorts and unkeys the count events that a wait returned.
+ */
+int INTERNAL order_epoll_events(int epfd, struct epoll_event* events, int maxevents, int count) {
+	if (count <= 0) {
+		return count;
+	}
+	if (process_state.epoll_order == EPOLL_SETTLED) {
+		struct epoll_event late[64];
+		for (size_t round = 0; round < EPOLL_SETTLE_ROUNDS; ++round) {
+			int found = process_state.real_epoll_wait(epfd, late, maxevents < 64 ? maxevents : 64, 0);
+			size_t added = 0;
+			for (int i = 0; i < found; ++i) {
+				int j = 0;
+				while (j < count && events[j].data.u64 != late[i].data.u64) {
+					++j;
+				}
+				if (j < count) {
+					events[j].events |= late[i].events;
+				} else if (count < maxevents) {
+					events[count++] = late[i];
+					++added;
+				}
+			}
+			if (added == 0) {
+				break;
+			}
+		}
+	}
+	ordered_event_t ordered[count];
+	pthread_mutex_lock(&process_state.epoll_lock);
+	for (int i = 0; i < count; ++i) {
+		epoll_registration_t* registration = epoll_event_registration(epfd, &events[i]);
+		ordered[i] = (ordered_event_t){registration == NULL ? UINT64_MAX : registration->ordinal, i, events[i]};
+		if (registration != NULL) {
+			ordered[i].event.data = registration->data;
+		}
+	}
+	pthread_mutex_unlock(&process_state.epoll_lock);
+	qsort(ordered, count, sizeof(ordered_event_t), compare_ordered_events);
+	for (int i = 0; i < count; ++i) {
+		events[i] = ordered[i].event;
+	}
+	return count;
+}
+
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+	ensure_initialized();
+	if (LIKELY(process_state.epoll_order == EPOLL_NATIVE)) {
+		AUDIT_COUNT(epoll_wait);
+		return process_state.real_epoll_wait(epfd, events, maxevents, timeout);
+	}
+	return order_epoll_events(epfd, events, maxevents, process_state.real_epoll_wait(epfd, events, maxevents, timeout));
+}
+
+int epoll_pwait(int epfd, struct epoll_event* events, int maxevents, int timeout, const sigset_t* mask) {
+	ensure_initialized();
+	int count = process_state.real_epoll_pwait(epfd, events, maxevents, timeout, mask);
+	return LIKELY(process_state.epoll_order == EPOLL_NATIVE) ? count : order_epoll_events(epfd, events, maxevents, count);
+}
+
+#if __GLIBC_PREREQ(2, 35)
+int epoll_pwait2(int epfd, struct epoll_event* events, int maxevents, const struct timespec* timeout, const sigset_t* mask) {
+	ensure_initialized();
+	int count = process_state.real_epoll_pwait2(epfd, events, maxevents, timeout, mask);
+	return LIKELY(process_state.epoll_order == EPOLL_NATIVE) ? count : order_epoll_events(epfd, events, maxevents, count);
+}
+#endif
+
+/*
+ * File watch ordering. The kernel queues inotify and fanotify events as
+ * they happen, so a read returns them in an order, and split into batches,
+ * that depends on timing. With DETERMINISTIC_WATCH_WINDOW set, a read keeps
+ * collecting events until none arrive for that many milliseconds (or the
+ * caller's buffer is full), stable-sorts them by path, and merges an event
+ * into an identical one just before it for the same path. Events for one
+ * path keep the kernel's order, which is the order they happened in.
+ */
+
+void INTERNAL set_watch_fd(int fd, watch_kind_t kind) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) {
+		return;
+	}
+	uint8_t** chunk = &process_state.watch_fds[fd / FD_CHUNK];
+	if (__atomic_load_n(chunk, __ATOMIC_ACQUIRE) == NULL) {
+		uint8_t* fresh = calloc(FD_CHUNK, sizeof(uint8_t));
+		uint8_t* expected = NULL;
+		if (fresh == NULL) {
+			return;
+		}
+		if (!__atomic_compare_exchange_n(chunk, &expected, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(fresh);
+		}
+	}
+	__atomic_store_n(&(*chunk)[fd % FD_CHUNK], kind, __ATOMIC_RELEASE);
+}
+
+watch_kind_t INTERNAL get_watch_fd(int fd) {
+	if (fd < 0 || fd >= FD_CHUNK * FD_CHUNKS) {
+		return WATCH_NONE;
+	}
+	uint8_t* chunk = __atomic_load_n(&process_state.watch_fds[fd / FD_CHUNK], __ATOMIC_ACQUIRE);
+	return chunk == NULL ? WATCH_NONE : __atomic_load_n(&chunk[fd % FD_CHUNK], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Must hold watch_lock. Forgets fd's watch wd, or all of fd's watches if wd
+ * is -1.
+ */
+void INTERNAL forget_watched_paths(int fd, int wd) {
+	size_t kept = 0;
+	for (size_t i = 0; i < process_state.used_watched_paths; ++i) {
+		watched_path_t* watched = &process_state.watched_paths[i];
+		if (watched->fd == fd && (wd == -1 || watched->wd == wd)) {
+			free(watched->path);
+		} else {
+			process_state.watched_paths[kept++] = *watched;
+		}
+	}
+	process_state.used_watched_paths = kept;
+}
+
+void INTERNAL forget_watch_fd(int fd) {
+	set_watch_fd(fd, WATCH_NONE);
+	pthread_mutex_lock(&process_state.watch_lock);
+	forget_watched_paths(fd, -1);
+	pthread_mutex_unlock(&process_state.watch_lock);
+}
+
+/*
+ * Must hold watch_lock.
+ */
+const char* INTERNAL watched_path(int fd, int wd) {
+	for (size_t i = 0; i < process_state.used_watched_paths; ++i) {
+		if (process_state.watched_paths[i].fd == fd && process_state.watched_paths[i].wd == wd) {
+			return process_state.watched_paths[i].path;
+		}
+	}
+	return "";
+}
+
+typedef struct {
+	char* key;
+	size_t position;
+	const char* event;
+	size_t length;
+} watch_event_t;
+
+int INTERNAL compare_watch_events(const void* left, const void* right) {
+	const watch_event_t* a = left;
+	const watch_event_t* b = right;
+	int order = strcmp(a->key, b->key);
+	if (order != 0) {
+		return order;
+	}
+	return a->position < b->position ? -1 : a->position > b->position;
+}
+
+/*
+ * Whether two events for the same path say the same thing. fanotify events
+ * each carry their own fd, so compare from the mask on; permission events
+ * each need a response and are never repeats.
+ */
+bool INTERNAL same_watch_event(watch_kind_t kind, const watch_event_t* a, const watch_event_t* b) {
+	if (kind == WATCH_INOTIFY) {
+		return a->length == b->length && memcmp(a->event, b->event, a->length) == 0;
+	}
+	const struct fanotify_event_metadata* x = (const void*)a->event;
+	const struct fanotify_event_metadata* y = (const void*)b->event;
+	return x->fd >= 0 && y->fd >= 0 && x->mask == y->mask && (x->mask & FAN_ALL_PERM_EVENTS) == 0
+		&& x->event_len == y->event_len
+		&& memcmp((const char*)x + x->metadata_len, (const char*)y + y->metadata_len, x->event_len - x->metadata_len) == 0;
+}
+
+/*
+ * Splits the events in buffer and gives each its sort key: the watched
+ * directory and name for inotify, the event fd's path for fanotify.
+ * Returns the number of events, or -1 if out of memory.
+ */
+ssize_t INTERNAL split_watch_events(int fd, watch_kind_t kind, const char* buffer, size_t size, watch_event_t* events) {
+	size_t count = 0;
+	pthread_mutex_lock(&process_state.watch_lock);
+	for (size_t offset = 0; offset < size; ++count) {
+		watch_event_t* event = &events[count];
+		event->position = count;
+		event->event = buffer + offset;
+		if (kind == WATCH_INOTIFY) {
+			const struct inotify_event* inotify = (const void*)event->event;
+			event->length = sizeof(struct inotify_event) + inotify->len;
+			const char* directory = watched_path(fd, inotify->wd);
+			size_t key_size = strlen(directory) + 1 + inotify->len + 1;
+			event->key = malloc(key_size);
+			if (event->key != NULL) {
+				snprintf(event->key, key_size, "%s/%s", directory, inotify->len ? inotify->name : "");
+			}
+		} else {
+			const struct fanotify_event_metadata* fanotify = (const void*)event->event;
+			event->length = fanotify->event_len;
+			char link[32];
+			char path[PATH_MAX];
+			ssize_t length = -1;
+			if (fanotify->fd >= 0) {
+				snprintf(link, sizeof(link), "/proc/self/fd/%d", fanotify->fd);
+				length = readlink(link, path, sizeof(path) - 1);
+			}
+			path[length < 0 ? 0 : length] = '\0';
+			event->key = strdup(path);
+		}
+		if (event->key == NULL || event->length == 0) {
+			pthread_mutex_unlock(&process_state.watch_lock);
+			for (size_t i = 0; i <= count; ++i) {
+				free(events[i].key);
+			}
+			return -1;
+		}
+		offset += event->length;
+	}
+	pthread_mutex_unlock(&process_state.watch_lock);
+	return count;
+}
+
+/*
+ * Collects no more than the caller asked for, so nothing is held back
+ * between reads and poll and epoll on fd stay accurate.
+ */
+ssize_t INTERNAL read_watch_fd(int fd, char* buffer, size_t size) {
+	ssize_t total = process_state.real_read(fd, buffer, size);
+	if (total <= 0) {
+		return total;
+	}
+	watch_kind_t kind = get_watch_fd(fd);
+	// Each event is at least this large, and reads only return whole events.
+	size_t smallest = kind == WATCH_INOTIFY ? sizeof(struct inotify_event) : FAN_EVENT_METADATA_LEN;
+	struct pollfd waiting = {fd, POLLIN, 0};
+	while ((size_t)total + smallest <= size && poll(&waiting, 1, process_state.watch_window) > 0) {
+		ssize_t got = process_state.real_read(fd, buffer + total, size - total);
+		if (got <= 0) {
+			// Most likely EINVAL: the next event does not fit. It stays queued.
+			break;
+		}
+		total += got;
+	}
+
+	char* original = malloc(total);
+	watch_event_t* events = malloc((total / smallest + 1) * sizeof(watch_event_t));
+	ssize_t count = original == NULL || events == NULL ? -1 : split_watch_events(fd, kind, memcpy(original, buffer, total), total, events);
+	if (count < 0) {
+		// Hand the batch over as the kernel gave it.
+		free(original);
+		free(events);
+		return total;
+	}
+	qsort(events, count, sizeof(watch_event_t), compare_watch_events);
+	size_t written = 0;
+	for (ssize_t i = 0; i < count; ++i) {
+		// Only back-to-back repeats, as the kernel coalesces: a create after a delete matters.
+		bool repeat = i > 0 && strcmp(events[i - 1].key, events[i].key) == 0 && same_watch_event(kind, &events[i - 1], &events[i]);
+		if (!repeat) {
+			memcpy(buffer + written, events[i].event, events[i].length);
+			written += events[i].length;
+		} else if (kind == WATCH_FANOTIFY) {
+			process_state.real_close(((const struct fanotify_event_metadata*)events[i].event)->fd);
+		}
+	}
+	for (ssize_t i = 0; i < count; ++i) {
+		free(events[i].key);
+	}
+	free(original);
+	free(events);
+	return written;
+}
+
+int inotify_init1(int flags) {
+	static int (*real)(int);
+	ensure_initialized();
+	if (UNLIKELY(real == NULL)) {
+		real = dlsym(RTLD_NEXT, "inotify_init1");
+	}
+	int fd = real(flags);
+	if (LIKELY(process_state.watch_window < 0)) {
+		AUDIT_COUNT(inotify_init1);
+	} else if (fd >= 0) {
+		set_watch_fd(fd, WATCH_INOTIFY);
+	}
+	return fd;
+}
+
+int inotify_init(void) {
+	return inotify_init1(0);
+}
+
+int inotify_add_watch(int fd, const char* path, uint32_t mask) {
+	static int (*real)(int, const char*, uint32_t);
+	ensure_initialized();
+	if (UNLIKELY(real == NULL)) {
+		real = dlsym(RTLD_NEXT, "inotify_add_watch");
+	}
+	int wd = real(fd, path, mask);
+	if (LIKELY(process_state.watch_window < 0) || wd < 0 || get_watch_fd(fd) != WATCH_INOTIFY) {
+		return wd;
+	}
+	pthread_mutex_lock(&process_state.watch_lock);
+	// Watching an inode again returns its existing wd.
+	forget_watched_paths(fd, wd);
+	if (process_state.used_watched_paths == process_state.watched_paths_capacity) {
+		size_t capacity = process_state.watched_paths_capacity ? process_state.watched_paths_capacity * 2 : 64;
+		watched_path_t* watched_paths = realloc(process_state.watched_paths, capacity * sizeof(watched_path_t));
+		if (watched_paths != NULL) {
+			process_state.watched_paths = watched_paths;
+			process_state.watched_paths_capacity = capacity;
+		}
+	}
+	char* copy = strdup(path);
+	if (copy != NULL && process_state.used_watched_paths < process_state.watched_paths_capacity) {
+		process_state.watched_paths[process_state.used_watched_paths++] = (watched_path_t){fd, wd, copy};
+	} else {
+		free(copy);
+	}
+	pthread_mutex_unlock(&process_state.watch_lock);
+	return wd;
+}
+
+int inotify_rm_watch(int fd, int wd) {
+	static int (*real)(int, int);
+	ensure_initialized();
+	if (UNLIKELY(real == NULL)) {
+		real = dlsym(RTLD_NEXT, "inotify_rm_watch");
+	}
+	int result = real(fd, wd);
+	if (UNLIKELY(process_state.watch_window >= 0) && result == 0) {
+		pthread_mutex_lock(&process_state.watch_lock);
+		forget_watched_paths(fd, wd);
+		pthread_mutex_unlock(&process_state.watch_lock);
+	}
+	return result;
+}
+
+int fanotify_init(unsigned int flags, unsigned int event_flags) {
+	static int (*real)(unsigned int, unsigned int);
+	ensure_initialized();
+	if (UNLIKELY(real == NULL)) {
+		real = dlsym(RTLD_NEXT, "fanotify_init");
+	}
+	int fd = real(flags, event_flags);
+	if (UNLIKELY(process_state.watch_window >= 0) && fd >= 0) {
+		set_watch_fd(fd, WATCH_FANOTIFY);
+	}
+	return fd;
+}
+
+/*
+ * Thread placement. With DETERMINISTIC_PLACEMENT set, each thread is
+ * pinned to one CPU and prefers one memory node, both picked from its
+ * slot, so a run's performance repeats as well as its results. The
+ * topology is read from sysfs once, restricted to the CPUs the process
+ * was allowed to run on at startup, and ordered node by node. =compact
+ * fills one node before the next; =spread deals threads out across nodes.
+ *
+ * Slots come from one counter shared by the whole process tree, in a file
+ * named by DETERMINISTIC_PLACEMENT_SLOTS, so no two threads of the tree
+ * share a CPU until every CPU is taken. A thread's slot is claimed by the
+ * thread that creates it, so one process's threads are numbered the same
+ * every run; processes that create threads at the same time interleave.
+ * Without the counter, only the first process's threads are pinned.
+ */
+
+typedef enum {
+	PLACEMENT_NONE,
+	PLACEMENT_COMPACT,
+	PLACEMENT_SPREAD,
+} placement_t;
+
+typedef struct {
+	placement_t policy;
+	size_t cpu_count;
+	int cpus[CPU_SETSIZE];
+	size_t node_count;
+	int nodes[CPU_SETSIZE];
+	/*
+	 * Index into cpus of each node's first CPU, and one past the last node's.
+	 */
+	size_t node_starts[CPU_SETSIZE + 1];
+	/*
+	 * The shared slot counter, or NULL.
+	 */
+	uint64_t* slots;
+	/*
+	 * Whether this process read the topology first. It created the
+	 * counter, and removes it at exit.
+	 */
+	bool first;
+	char slots_path[64];
+} topology_t;
+
+topology_t topology;
+
+/*
+ * Parses a cpulist ("0-3,8,10-11"), as sysfs writes them, into set.
+ */
+void INTERNAL parse_cpu_list(const char* text, cpu_set_t* set) {
+	CPU_ZERO(set);
+	while (*text >= '0' && *text <= '9') {
+		char* end;
+		unsigned long first = strtoul(text, &end, 10);
+		unsigned long last = first;
+		if (*end == '-') {
+			last = strtoul(end + 1, &end, 10);
+		}
+		for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, set);
+		}
+		text = *end == ',' ? end + 1 : end;
+	}
+}
+
+void INTERNAL format_cpu_list(const cpu_set_t* set, char* text, size_t size) {
+	size_t length = 0;
+	text[0] = '\0';
+	for (int cpu = 0; cpu < CPU_SETSIZE && length < size; ++cpu) {
+		if (!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+			++last;
+		}
+		length += snprintf(text + length, size - length, last > cpu ? "%s%d-%d" : "%s%d", length ? "," : "", cpu, last);
+		cpu = last;
+	}
+}
+
+/*
+ * Adds the CPUs of a sysfs cpulist file that are in allowed.
+ */
+void INTERNAL add_cpu_list(const char* path, const cpu_set_t* allowed) {
+	FILE* file = fopen(path, "re");
+	if (file == NULL) {
+		return;
+	}
+	char text[4096];
+	cpu_set_t listed;
+	parse_cpu_list(fgets(text, sizeof(text), file) ? text : "", &listed);
+	fclose(file);
+	for (int cpu = 0; cpu < CPU_SETSIZE && topology.cpu_count < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &listed) && CPU_ISSET(cpu, allowed)) {
+			topology.cpus[topology.cpu_count++] = cpu;
+		}
+	}
+}
+
+/*
+ * The first placed process records the CPUs it was allowed in
+ * DETERMINISTIC_PLACEMENT_CPUS. Its descendants inherit a mask already
+ * narrowed to one CPU, so they read the original from there.
+ */
+void INTERNAL read_topology() {
+	cpu_set_t allowed;
+	const char* recorded = getenv("DETERMINISTIC_PLACEMENT_CPUS");
+	if (recorded != NULL && *recorded != '\0') {
+		parse_cpu_list(recorded, &allowed);
+	} else if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		char text[4096];
+		format_cpu_list(&allowed, text, sizeof(text));
+		setenv("DETERMINISTIC_PLACEMENT_CPUS", text, 1);
+		topology.first = true;
+	} else {
+		return;
+	}
+	char path[64];
+	for (int node = 0; node < CPU_SETSIZE; ++node) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (access(path, R_OK) != 0) {
+			continue;
+		}
+		size_t start = topology.cpu_count;
+		add_cpu_list(path, &allowed);
+		if (topology.cpu_count > start) {
+			topology.nodes[topology.node_count] = node;
+			topology.node_starts[topology.node_count++] = start;
+		}
+	}
+	if (topology.cpu_count == 0) {
+		// No NUMA in sysfs: one node holding every online CPU.
+		add_cpu_list("/sys/devices/system/cpu/online", &allowed);
+		topology.nodes[0] = -1;
+		topology.node_count = topology.cpu_count > 0;
+	}
+	topology.node_starts[topology.node_count] = topology.cpu_count;
+}
+
+/*
+ * Maps the slot counter, which the first process creates.
+ */
+void INTERNAL open_slots() {
+	const char* path = topology.first ? topology.slots_path : getenv("DETERMINISTIC_PLACEMENT_SLOTS");
+	if (topology.first) {
+		snprintf(topology.slots_path, sizeof(topology.slots_path), "/dev/shm/deterministic-placement.%d", process_state.pid);
+	} else if (path == NULL || *path == '\0') {
+		return;
+	}
+	int fd = process_state.real_open(path, O_RDWR | O_CLOEXEC | O_NOFOLLOW | (topology.first ? O_CREAT | O_TRUNC : 0), S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		return;
+	}
+	void* slots = MAP_FAILED;
+	if (!topology.first || ftruncate(fd, sizeof(uint64_t)) == 0) {
+		slots = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	process_state.real_close(fd);
+	if (slots == MAP_FAILED) {
+		if (topology.first) {
+			unlink(path);
+		}
+		return;
+	}
+	topology.slots = slots;
+	if (topology.first) {
+		setenv("DETERMINISTIC_PLACEMENT_SLOTS", path, 1);
+	}
+}
+
+__attribute__((destructor)) void INTERNAL close_slots() {
+	if (topology.first && topology.slots != NULL) {
+		// Descendants that have it mapped keep it; later ones go unpinned.
+		unlink(topology.slots_path);
+	}
+}
+
+/*
+ * Returns false if the thread is not to be pinned.
+ */
+bool INTERNAL claim_slot(uint64_t ordinal, uint64_t* slot) {
+	if (topology.slots != NULL) {
+		*slot = __atomic_fetch_add(topology.slots, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	*slot = ordinal;
+	return topology.first;
+}
+
+void INTERNAL place_thread(uint64_t slot) {
+	if (topology.cpu_count == 0) {
+		return;
+	}
+	size_t node = 0;
+	size_t index;
+	if (topology.policy == PLACEMENT_SPREAD) {
+		node = slot % topology.node_count;
+		size_t node_cpus = topology.node_starts[node + 1] - topology.node_starts[node];
+		index = topology.node_starts[node] + slot / topology.node_count % node_cpus;
+	} else {
+		index = slot % topology.cpu_count;
+		while (topology.node_starts[node + 1] <= index) {
+			++node;
+		}
+	}
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(topology.cpus[index], &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+	if (topology.nodes[node] >= 0) {
+		unsigned long nodes[CPU_SETSIZE / (8 * sizeof(unsigned long))] = {0};
+		nodes[topology.nodes[node] / (8 * sizeof(unsigned long))] |= 1UL << topology.nodes[node] % (8 * sizeof(unsigned long));
+		// Preferred rather than bound, so a full node spills over instead of failing.
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, CPU_SETSIZE);
+	}
+}
+
+/*
+ * The forking thread is all that is left; move it to a slot of its own.
+ * Without the counter it would share its parent's CPU, so it gets the
+ * whole original mask instead.
+ */
+void INTERNAL place_fork_child() {
+	if (UNLIKELY(topology.policy != PLACEMENT_NONE)) {
+		topology.first = false;
+		uint64_t slot;
+		if (claim_slot(thread_ordinal, &slot)) {
+			place_thread(slot);
+		} else if (topology.cpu_count > 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			for (size_t i = 0; i < topology.cpu_count; ++i) {
+				CPU_SET(topology.cpus[i], &cpus);
+			}
+			sched_setaffinity(0, sizeof(cpus), &cpus);
+		}
+	}
+}
+
+/*
+ * Runs before save_carried_environment, so the DETERMINISTIC_PLACEMENT_*
+ * variables are carried into scrubbed environments too.
+ */
+__attribute__((constructor(101))) void INTERNAL place_main_thread() {
+	const char* policy = getenv("DETERMINISTIC_PLACEMENT");
+	if (policy == NULL || *policy == '\0') {
+		return;
+	} else if (strcmp(policy, "compact") == 0) {
+		topology.policy = PLACEMENT_COMPACT;
+	} else if (strcmp(policy, "spread") == 0) {
+		topology.policy = PLACEMENT_SPREAD;
+	} else {
+		fprintf(stderr, "deterministic: unknown DETERMINISTIC_PLACEMENT %s; not placing threads\n", policy);
+		return;
+	}
+	ensure_initialized();
+	read_topology();
+	open_slots();
+	uint64_t slot;
+	if (claim_slot(0, &slot)) {
+		place_thread(slot);
+	}
+}
+
+/*
+ * Threads. Each thread started through pthread_create gets the next
+ * ordinal of its process; the main thread is 0. With
+ * DETERMINISTIC_VIRTUAL_CPUS=N, sched_getcpu and getcpu report the ordinal
+ * modulo N, so per-CPU shards (malloc caches, counters) are picked the same
+ * way every run. DETERMINISTIC_DISABLE_RSEQ=1 unregisters the glibc rseq
+ * area, whose cpu_id such libraries read instead of calling sched_getcpu;
+ * they see a negative cpu_id and fall back to it. Threads created by an
+ * unregistered thread are left unregistered by glibc itself.
+ */
+
+typedef struct {
+	void* (*start)(void*);
+	void* argument;
+	uint64_t ordinal;
+	/*
+	 * With DETERMINISTIC_PLACEMENT, where to pin the thread; otherwise false.
+	 */
+	bool placed;
+	uint64_t slot;
+} thread_start_t;
+
+void INTERNAL unregister_rseq() {
+#if __GLIBC_PREREQ(2, 35) && defined(RSEQ_SIG)
+	if (__rseq_size == 0) {
+		return;
+	}
+	struct rseq* area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	// glibc registers the original 32-byte area; __rseq_size is the part in use.
+	if (syscall(SYS_rseq, area, 32, RSEQ_FLAG_UNREGISTER, RSEQ_SIG) != 0) {
+		syscall(SYS_rseq, area, __rseq_size, RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+	}
+#endif
+}
+
+__attribute__((constructor)) void INTERNAL unregister_main_rseq() {
+	const char* disable = getenv("DETERMINISTIC_DISABLE_RSEQ");
+	if (disable != NULL && strcmp(disable, "1") == 0) {
+		unregister_rseq();
+	}
+}
+
+void* INTERNAL start_thread(void* data) {
+	thread_start_t start = *(thread_start_t*)data;
+	free(data);
+	thread_ordinal = start.ordinal;
+	if (process_state.disable_rseq) {
+		unregister_rseq();
+	}
+	if (UNLIKELY(start.placed)) {
+		place_thread(start.slot);
+	}
+	return start.start(start.argument);
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attributes, void* (*start)(void*), void* argument) {
+	ensure_initialized();
+	thread_start_t* data = malloc(sizeof(thread_start_t));
+	if (data == NULL) {
+		return EAGAIN;
+	}
+	*data = (thread_start_t){.start = start, .argument = argument, .ordinal = __atomic_add_fetch(&process_state.threads, 1, __ATOMIC_RELAXED)};
+	if (UNLIKELY(topology.policy != PLACEMENT_NONE)) {
+		data->placed = claim_slot(data->ordinal, &data->slot);
+	}
+	int result = process_state.real_pthread_create(thread, attributes, start_thread, data);
+	if (result != 0) {
+		free(data);
+	}
+	return result;
+}
+
+int sched_getcpu(void) {
+	ensure_initialized();
+	if (LIKELY(process_state.virtual_cpus == 0)) {
+		AUDIT_COUNT(sched_getcpu);
+		return process_state.real_sched_getcpu();
+	}
+	return thread_ordinal % process_state.virtual_cpus;
+}
+
+int getcpu(unsigned int* cpu, unsigned int* node) {
+	ensure_initialized();
+	if (LIKELY(process_state.virtual_cpus == 0)) {
+		AUDIT_COUNT(getcpu);
+		return process_state.real_getcpu(cpu, node);
+	}
+	if (cpu != NULL) {
+		*cpu = thread_ordinal % process_state.virtual_cpus;
+	}
+	if (node != NULL) {
+		*node = 0;
+	}
+	return 0;
+}
+
+/*
+ * In-process API; see deterministic.h.
+ */
+
+unsigned det_api_version(void) {
+	return DET_API_VERSION;
+}
+
+det_stream_t* det_stream_default(void) {
+	ensure_initialized();
+	return &process_state.random_state;
+}
+
+det_stream_t* det_stream_create(uint64_t key) {
+	ensure_initialized();
+	det_stream_t* stream = malloc(sizeof(det_stream_t));
+	if (LIKELY(stream != NULL)) {
+		stream_init(stream, key);
+	}
+	return stream;
+}
+
+det_stream_t* det_stream_split(det_stream_t* parent) {
+	parent->splits++;
+	return det_stream_create(mix_seed(parent->key, parent->splits));
+}
+
+void det_stream_destroy(det_stream_t* stream) {
+	if (stream != &process_state.random_state) {
+		free(stream);
+	}
+}
+
+void det_fill(det_stream_t* stream, void* buffer, size_t size) {
+	fill_with_random(stream, buffer, size);
+	digest_event("det_fill", size, stream->position);
+}
+
+void det_seek(det_stream_t* stream, uint64_t position) {
+	stream_sync(stream);
+	if (position < stream->position) {
+		stream_reset(stream);
+	}
+	mt_discard(&stream->state, position - stream->position);
+	stream->position = position;
+}
+
+uint64_t det_tell(const det_stream_t* stream) {
+	return stream->position;
+}
+
+int det_clock_gettime(clockid_t clock, struct timespec* time) {
+	ensure_initialized();
+	vm_child_t* child = current_vm_child();
+	uint64_t* clock_ns = UNLIKELY(child != NULL) ? &child->clock_ns : &process_state.clock_ns;
+	uint64_t ns = __atomic_fetch_add(clock_ns, process_state.clock_step, __ATOMIC_RELAXED);
+	if (clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE) {
+		ns += process_state.clock_start * NS_PER_S;
+	}
+	time->tv_sec = ns / NS_PER_S;
+	time->tv_nsec = ns % NS_PER_S;
+	digest_event("clock_gettime", clock, ns);
+	if (child == NULL) {
+		fire_timers(virtual_now());
+	}
+	return 0;
+}
+
+/*
+ * Zygote mode: fork one child per seed in DETERMINISTIC_ZYGOTE_SEEDS (a file
+ * of seeds, one per line), at most DETERMINISTIC_ZYGOTE_JOBS at a time
+ * (default: online CPUs). With DETERMINISTIC_ZYGOTE_OUTPUT=dir, child i
+ * writes dir/i.stdout and dir/i.stderr, and the zygote writes dir/summary.tsv
+ * (index, seed, wait status).
+ */
+
+size_t INTERNAL read_seeds(const char* path, uint64_t** seeds) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		_exit(125);
+	}
+	size_t count = 0;
+	size_t capacity = 64;
+	*seeds = malloc(capacity * sizeof(uint64_t));
+	if (*seeds == NULL) {
+		perror(path);
+		_exit(125);
+	}
+	unsigned long long seed;
+	while (fscanf(file, "%llu", &seed) == 1) {
+		if (count == capacity) {
+			capacity *= 2;
+			uint64_t* grown = realloc(*seeds, capacity * sizeof(uint64_t));
+			if (grown == NULL) {
+				perror(path);
+				_exit(125);
+			}
+			*seeds = grown;
+		}
+		(*seeds)[count++] = seed;
+	}
+	fclose(file);
+	return count;
+}
+
+void INTERNAL redirect_output(const char* directory, size_t index, const char* stream, int fd) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%zu.%s", directory, index, stream);
+	int file = process_state.real_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file >= 0) {
+		dup2(file, fd);
+		process_state.real_close(file);
+	}
+}
+
+int det_zygote(void) {
+	ensure_initialized();
+	const char* seeds_path = getenv("DETERMINISTIC_ZYGOTE_SEEDS");
+	if (seeds_path == NULL || *seeds_path == '\0') {
+		return -1;
+	}
+	const char* output = getenv("DETERMINISTIC_ZYGOTE_OUTPUT");
+	size_t jobs = env_u64("DETERMINISTIC_ZYGOTE_JOBS", sysconf(_SC_NPROCESSORS_ONLN));
+	if (jobs == 0) {
+		jobs = 1;
+	}
+	uint64_t* seeds;
+	size_t count = read_seeds(seeds_path, &seeds);
+	pid_t* pids = calloc(count, sizeof(pid_t));
+	int* statuses = calloc(count, sizeof(int));
+	if (count > 0 && (pids == NULL || statuses == NULL)) {
+		perror("det_zygote");
+		_exit(125);
+	}
+
+	fflush(NULL);
+	size_t next = 0;
+	size_t running = 0;
+	while (next < count || running > 0) {
+		if (next < count && running < jobs) {
+			uint64_t ordinal = __atomic_add_fetch(&process_state.forks, 1, __ATOMIC_RELAXED);
+			pid_t pid = process_state.real_fork();
+			if (pid == 0) {
+				char seed[32];
+				snprintf(seed, sizeof(seed), "%llu", (unsigned long long)seeds[next]);
+				// Children of this child, including exec'd ones, continue from its seed.
+				setenv("DETERMINISTIC_SEED", seed, 1);
+				unsetenv("DETERMINISTIC_ZYGOTE_SEEDS");
+				forget_carried("DETERMINISTIC_ZYGOTE_SEEDS");
+				if (output != NULL) {
+					redirect_output(output, next, "stdout", STDOUT_FILENO);
+					redirect_output(output, next, "stderr", STDERR_FILENO);
+				}
+				fork_child_reset(ordinal);
+				reseed(rank_seed(seeds[next]));
+				int index = next;
+				free(seeds);
+				free(pids);
+				free(statuses);
+				return index;
+			}
+			if (pid < 0) {
+				perror("det_zygote: fork");
+				statuses[next] = W_EXITCODE(126, 0);
+			} else {
+				pids[next] = pid;
+				running++;
+			}
+			next++;
+		} else {
+			int status;
+			pid_t pid = process_state.real_wait4(-1, &status, 0, NULL);
+			if (pid < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			for (size_t i = 0; i < next; ++i) {
+				if (pids[i] == pid) {
+					statuses[i] = status;
+					running--;
+				}
+			}
+		}
+	}
+
+	int result = 0;
+	FILE* summary = NULL;
+	if (output != NULL) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/summary.tsv", output);
+		summary = fopen(path, "w");
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (summary != NULL) {
+			fprintf(summary, "%zu\t%llu\t%d\n", i, (unsigned long long)seeds[i], statuses[i]);
+		}
+		if (statuses[i] != 0) {
+			result = 1;
+		}
+	}
+	if (summary != NULL) {
+		fclose(summary);
 	}
+	_exit(result);
 }
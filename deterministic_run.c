@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+
+/*
+gcc -O2 -Wall -Werror -o deterministic-run deterministic_run.c -ldl
+./deterministic-run --seed 42 -- python3 -c 'import random; print(random.random())'
+
+Launches one program under the shim with a single exec: sets the
+personality (no address randomization, as setarch -R does), the rlimits,
+LD_PRELOAD and the DETERMINISTIC_* environment in this process and then
+execs the target. It replaces script.sh's sh -> env -> setarch chain.
+
+The settings come from a text config, by default deterministic-run.conf
+next to this binary (or DETERMINISTIC_RUN_CONFIG):
+
+    # Bare names are looked up next to the config, then in the "search"
+    # directories given before them, then in the usual library directories
+    # and their faketime/ subdirectories, then by the dynamic linker.
+    search /opt/faketime/lib
+    preload? libfaketime.so.1
+    preload deterministic_random_preload.so
+    env FAKETIME=2022-01-01 00:00:00
+    seed 12345
+    namespace job-1
+    limit nofile 4096
+    limit core 0 unlimited
+    randomize_addresses no
+
+"preload?" is a preload that is skipped when it cannot be found, rather
+than failing the run. Since that is decided at parse time, touch the
+config after installing one.
+
+The config is parsed once into CONFIG.cache, which records the config's
+identity; a run only reads the cache and stats the config, and re-parses
+only when the config has changed. Variables already in the environment win
+over the config's, except that LD_PRELOAD is appended to and --seed and
+--namespace override DETERMINISTIC_SEED and DETERMINISTIC_NAMESPACE.
+Setup errors exit with 125.
+
+Jobs that run at the same time from the same seed only get disjoint
+temporary names if each has its own namespace.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/personality.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define INTERNAL
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#define CACHE_MAGIC 0x314e5552544544ULL /* "DETRUN1" */
+#define MAX_LIMITS 16
+#define MAX_SEARCH 16
+#define MAX_STRINGS 65536
+
+extern char** environ;
+
+typedef struct {
+	uint32_t resource;
+	struct rlimit limit;
+} run_limit_t;
+
+/*
+ * The cache file is this struct written as is. strings holds the preload
+ * list (without "LD_PRELOAD="), then env_count "NAME=VALUE" entries, each
+ * NUL-terminated.
+ */
+typedef struct {
+	uint64_t magic;
+	dev_t config_dev;
+	ino_t config_ino;
+	off_t config_size;
+	struct timespec config_mtime;
+	uint32_t no_randomize;
+	uint32_t limit_count;
+	uint32_t env_count;
+	uint32_t strings_size;
+	run_limit_t limits[MAX_LIMITS];
+	char strings[MAX_STRINGS];
+} run_config_t;
+
+static const struct {
+	const char* name;
+	int resource;
+} limit_names[] = {
+	{"as", RLIMIT_AS},
+	{"core", RLIMIT_CORE},
+	{"cpu", RLIMIT_CPU},
+	{"data", RLIMIT_DATA},
+	{"fsize", RLIMIT_FSIZE},
+	{"memlock", RLIMIT_MEMLOCK},
+	{"nofile", RLIMIT_NOFILE},
+	{"nproc", RLIMIT_NPROC},
+	{"stack", RLIMIT_STACK},
+};
+
+static const char* library_directories[] = {
+#if defined(__x86_64__)
+	"/usr/lib/x86_64-linux-gnu",
+#elif defined(__aarch64__)
+	"/usr/lib/aarch64-linux-gnu",
+#endif
+	"/usr/local/lib",
+	"/usr/lib64",
+	"/usr/lib",
+};
+
+void INTERNAL fail(const char* format, ...) {
+	va_list arguments;
+	va_start(arguments, format);
+	fprintf(stderr, "deterministic-run: ");
+	vfprintf(stderr, format, arguments);
+	fprintf(stderr, "\n");
+	va_end(arguments);
+	exit(125);
+}
+
+size_t INTERNAL config_size(const run_config_t* config) {
+	return offsetof(run_config_t, strings) + config->strings_size;
+}
+
+void INTERNAL add_string(run_config_t* config, const char* string, size_t length) {
+	if (config->strings_size + length + 1 > MAX_STRINGS) {
+		fail("config too large");
+	}
+	memcpy(config->strings + config->strings_size, string, length);
+	config->strings_size += length;
+	config->strings[config->strings_size++] = '\0';
+}
+
+bool INTERNAL is_file(const char* path) {
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+/*
+ * Resolves a preload entry to an absolute path at parse time, so that runs
+ * never search. Returns false if it is not found.
+ */
+bool INTERNAL resolve_preload(const char* name, const char* config_directory, char search[][PATH_MAX], size_t search_count, char* resolved) {
+	char candidate[PATH_MAX];
+	if (name[0] == '/') {
+		if (!is_file(name)) {
+			return false;
+		}
+		strcpy(resolved, name);
+		return true;
+	}
+	snprintf(candidate, sizeof(candidate), "%s/%s", config_directory, name);
+	if (is_file(candidate) && realpath(candidate, resolved) != NULL) {
+		return true;
+	}
+	if (strchr(name, '/') == NULL) {
+		for (size_t i = 0; i < search_count; ++i) {
+			snprintf(candidate, sizeof(candidate), "%s/%s", search[i], name);
+			if (is_file(candidate) && realpath(candidate, resolved) != NULL) {
+				return true;
+			}
+		}
+		for (size_t i = 0; i < sizeof(library_directories) / sizeof(*library_directories); ++i) {
+			for (size_t subdirectory = 0; subdirectory < 2; ++subdirectory) {
+				snprintf(candidate, sizeof(candidate), "%s/%s%s", library_directories[i], subdirectory ? "faketime/" : "", name);
+				if (is_file(candidate) && realpath(candidate, resolved) != NULL) {
+					return true;
+				}
+			}
+		}
+		// Whatever the dynamic linker would find (ld.so.cache, LD_LIBRARY_PATH).
+		void* handle = dlopen(name, RTLD_LAZY | RTLD_LOCAL);
+		struct link_map* map;
+		if (handle != NULL && dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0 && map->l_name[0] == '/') {
+			strcpy(resolved, map->l_name);
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t INTERNAL parse_limit_value(const char* text) {
+	if (strcmp(text, "unlimited") == 0) {
+		return RLIM_INFINITY;
+	}
+	char* end;
+	uint64_t value = strtoull(text, &end, 0);
+	if (*end != '\0') {
+		fail("bad limit value %s", text);
+	}
+	return value;
+}
+
+void INTERNAL parse_config(const char* path, const struct stat* info, run_config_t* config) {
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		fail("cannot read config %s", path);
+	}
+	char config_directory[PATH_MAX];
+	if (realpath(path, config_directory) == NULL) {
+		fail("cannot resolve config %s", path);
+	}
+	*strrchr(config_directory, '/') = '\0';
+
+	memset(config, 0, offsetof(run_config_t, strings));
+	config->magic = CACHE_MAGIC;
+	config->config_dev = info->st_dev;
+	config->config_ino = info->st_ino;
+	config->config_size = info->st_size;
+	config->config_mtime = info->st_mtim;
+	config->no_randomize = 1;
+
+	char preload[MAX_STRINGS];
+	size_t preload_size = 0;
+	char search[MAX_SEARCH][PATH_MAX];
+	size_t search_count = 0;
+	char env[MAX_STRINGS];
+	size_t env_size = 0;
+	uint32_t env_count = 0;
+
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, file)) >= 0) {
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == ' ')) {
+			line[--length] = '\0';
+		}
+		char* directive = line + strspn(line, " \t");
+		if (*directive == '\0' || *directive == '#') {
+			continue;
+		}
+		char* argument = directive + strcspn(directive, " \t");
+		if (*argument != '\0') {
+			*argument++ = '\0';
+			argument += strspn(argument, " \t");
+		}
+		if (strcmp(directive, "preload") == 0 || strcmp(directive, "preload?") == 0) {
+			char resolved[PATH_MAX];
+			if (!resolve_preload(argument, config_directory, search, search_count, resolved)) {
+				if (directive[7] == '?') {
+					continue;
+				}
+				fail("preload %s not found", argument);
+			}
+			size_t resolved_length = strlen(resolved);
+			if (preload_size + resolved_length + 2 > sizeof(preload)) {
+				fail("config too large");
+			}
+			if (preload_size > 0) {
+				preload[preload_size++] = ':';
+			}
+			memcpy(preload + preload_size, resolved, resolved_length);
+			preload_size += resolved_length;
+		} else if (strcmp(directive, "search") == 0) {
+			if (search_count == MAX_SEARCH) {
+				fail("too many search directories");
+			}
+			snprintf(search[search_count++], PATH_MAX, "%s", argument);
+		} else if (strcmp(directive, "env") == 0 || strcmp(directive, "seed") == 0 || strcmp(directive, "namespace") == 0) {
+			char entry[PATH_MAX + 64];
+			if (directive[0] == 's') {
+				snprintf(entry, sizeof(entry), "DETERMINISTIC_SEED=%s", argument);
+			} else if (directive[0] == 'n') {
+				snprintf(entry, sizeof(entry), "DETERMINISTIC_NAMESPACE=%s", argument);
+			} else if (strchr(argument, '=') == NULL) {
+				fail("env needs NAME=VALUE, got %s", argument);
+			} else {
+				snprintf(entry, sizeof(entry), "%s", argument);
+			}
+			size_t entry_length = strlen(entry);
+			if (env_size + entry_length + 1 > sizeof(env)) {
+				fail("config too large");
+			}
+			memcpy(env + env_size, entry, entry_length + 1);
+			env_size += entry_length + 1;
+			env_count++;
+		} else if (strcmp(directive, "limit") == 0) {
+			char* soft = argument + strcspn(argument, " \t");
+			if (*soft == '\0') {
+				fail("limit needs a value: %s", argument);
+			}
+			*soft++ = '\0';
+			soft += strspn(soft, " \t");
+			char* hard = soft + strcspn(soft, " \t");
+			if (*hard != '\0') {
+				*hard++ = '\0';
+				hard += strspn(hard, " \t");
+			}
+			size_t i = 0;
+			while (i < sizeof(limit_names) / sizeof(*limit_names) && strcmp(limit_names[i].name, argument) != 0) {
+				++i;
+			}
+			if (i == sizeof(limit_names) / sizeof(*limit_names)) {
+				fail("unknown limit %s", argument);
+			}
+			if (config->limit_count == MAX_LIMITS) {
+				fail("too many limits");
+			}
+			run_limit_t* limit = &config->limits[config->limit_count++];
+			limit->resource = limit_names[i].resource;
+			limit->limit.rlim_cur = parse_limit_value(soft);
+			// Without a hard value, the soft one is both.
+			limit->limit.rlim_max = *hard == '\0' ? limit->limit.rlim_cur : parse_limit_value(hard);
+		} else if (strcmp(directive, "randomize_addresses") == 0) {
+			config->no_randomize = strcmp(argument, "yes") != 0;
+		} else {
+			fail("unknown directive %s", directive);
+		}
+	}
+	free(line);
+	fclose(file);
+
+	add_string(config, preload, preload_size);
+	config->env_count = env_count;
+	if (config->strings_size + env_size > MAX_STRINGS) {
+		fail("config too large");
+	}
+	memcpy(config->strings + config->strings_size, env, env_size);
+	config->strings_size += env_size;
+}
+
+/*
+ * Best effort: an unwritable cache only costs a re-parse on every run.
+ */
+void INTERNAL write_cache(const char* path, const run_config_t* config) {
+	char temporary[PATH_MAX];
+	snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid());
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return;
+	}
+	bool written = write(fd, config, config_size(config)) == (ssize_t)config_size(config);
+	close(fd);
+	if (!written || rename(temporary, path) != 0) {
+		unlink(temporary);
+	}
+}
+
+bool INTERNAL read_cache(const char* path, const struct stat* info, run_config_t* config) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	ssize_t size = read(fd, config, sizeof(*config));
+	close(fd);
+	return size >= (ssize_t)offsetof(run_config_t, strings)
+		&& config->magic == CACHE_MAGIC
+		&& (size_t)size == config_size(config)
+		&& config->config_dev == info->st_dev
+		&& config->config_ino == info->st_ino
+		&& config->config_size == info->st_size
+		&& config->config_mtime.tv_sec == info->st_mtim.tv_sec
+		&& config->config_mtime.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+bool INTERNAL same_name(const char* entry, const char* other) {
+	size_t length = strcspn(entry, "=");
+	return strncmp(entry, other, length) == 0 && other[length] == '=';
+}
+
+/*
+ * Whether a command-line option replaces entry.
+ */
+bool INTERNAL overridden(const char* entry, const char* seed, const char* namespace) {
+	return (seed != NULL && same_name("DETERMINISTIC_SEED=", entry))
+		|| (namespace != NULL && same_name("DETERMINISTIC_NAMESPACE=", entry));
+}
+
+int main(int argc, char** argv) {
+	static run_config_t config;
+	const char* config_path = getenv("DETERMINISTIC_RUN_CONFIG");
+	char default_config[PATH_MAX];
+	const char* seed = NULL;
+	const char* namespace = NULL;
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-'; ++first) {
+		if (strcmp(argv[first], "--config") == 0 && first + 1 < argc) {
+			config_path = argv[++first];
+		} else if (strcmp(argv[first], "--seed") == 0 && first + 1 < argc) {
+			seed = argv[++first];
+		} else if (strcmp(argv[first], "--namespace") == 0 && first + 1 < argc) {
+			namespace = argv[++first];
+		} else if (strcmp(argv[first], "--") == 0) {
+			++first;
+			break;
+		} else {
+			break;
+		}
+	}
+	if (first >= argc) {
+		fprintf(stderr, "usage: %s [--config FILE] [--seed N] [--namespace NAME] [--] command [args...]\n", argv[0]);
+		return 125;
+	}
+	if (config_path == NULL || *config_path == '\0') {
+		ssize_t length = readlink("/proc/self/exe", default_config, sizeof(default_config) - 32);
+		if (length < 0) {
+			fail("cannot find own executable");
+		}
+		default_config[length] = '\0';
+		strcpy(strrchr(default_config, '/') + 1, "deterministic-run.conf");
+		config_path = default_config;
+	}
+
+	struct stat info;
+	if (stat(config_path, &info) != 0) {
+		fail("cannot stat config %s", config_path);
+	}
+	char cache_path[PATH_MAX + 8];
+	snprintf(cache_path, sizeof(cache_path), "%s.cache", config_path);
+	if (!read_cache(cache_path, &info, &config)) {
+		parse_config(config_path, &info, &config);
+		write_cache(cache_path, &config);
+	}
+
+	int persona = personality(0xffffffff);
+	if (config.no_randomize && persona >= 0 && !(persona & ADDR_NO_RANDOMIZE) && personality(persona | ADDR_NO_RANDOMIZE) < 0) {
+		fail("cannot disable address randomization");
+	}
+	for (uint32_t i = 0; i < config.limit_count; ++i) {
+		if (setrlimit(config.limits[i].resource, &config.limits[i].limit) != 0) {
+			fail("setrlimit: %s", strerror(errno));
+		}
+	}
+
+	// Each cache entry that the environment does not already set, plus
+	// LD_PRELOAD, DETERMINISTIC_SEED and DETERMINISTIC_NAMESPACE.
+	size_t environ_count = 0;
+	while (environ[environ_count] != NULL) {
+		++environ_count;
+	}
+	char* envp[environ_count + config.env_count + 4];
+	size_t count = 0;
+	const char* preload = config.strings;
+	const char* old_preload = NULL;
+	for (size_t i = 0; i < environ_count; ++i) {
+		if (same_name("LD_PRELOAD=", environ[i])) {
+			old_preload = environ[i] + strlen("LD_PRELOAD=");
+		} else if (!overridden(environ[i], seed, namespace)) {
+			envp[count++] = environ[i];
+		}
+	}
+	size_t inherited = count;
+	const char* entry = preload + strlen(preload) + 1;
+	for (uint32_t i = 0; i < config.env_count; ++i, entry += strlen(entry) + 1) {
+		bool present = false;
+		for (size_t j = 0; j < inherited && !present; ++j) {
+			present = same_name(entry, envp[j]);
+		}
+		if (!present && !overridden(entry, seed, namespace)) {
+			envp[count++] = (char*)entry;
+		}
+	}
+	char preload_entry[strlen("LD_PRELOAD=") + (old_preload ? strlen(old_preload) : 0) + strlen(preload) + 2];
+	if (old_preload != NULL || *preload != '\0') {
+		snprintf(preload_entry, sizeof(preload_entry), "LD_PRELOAD=%s%s%s", old_preload ? old_preload : "", old_preload && *old_preload && *preload ? ":" : "", preload);
+		envp[count++] = preload_entry;
+	}
+	char seed_entry[64];
+	if (seed != NULL) {
+		snprintf(seed_entry, sizeof(seed_entry), "DETERMINISTIC_SEED=%s", seed);
+		envp[count++] = seed_entry;
+	}
+	char namespace_entry[namespace != NULL ? strlen("DETERMINISTIC_NAMESPACE=") + strlen(namespace) + 1 : 1];
+	if (namespace != NULL) {
+		snprintf(namespace_entry, sizeof(namespace_entry), "DETERMINISTIC_NAMESPACE=%s", namespace);
+		envp[count++] = namespace_entry;
+	}
+	envp[count] = NULL;
+
+	execvpe(argv[first], &argv[first], envp);
+	perror(argv[first]);
+	return 127;
+}
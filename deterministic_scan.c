@@ -0,0 +1,792 @@
+#define _GNU_SOURCE
+
+/*
+gcc -O2 -Wall -Werror -o deterministic_scan deterministic_scan.c
+./deterministic_scan --shim ./deterministic_random_preload.so $(which python3)
+./deterministic_scan --shim ./deterministic_random_preload.so /usr/lib > coverage.tsv
+
+Predicts, without running anything, how much of a program the shim will
+see. For each ELF file (directories are walked), it loads the file and its
+DT_NEEDED closure and prints one tab-separated row:
+
+	path        the file scanned
+	linkage     dynamic, static, or static-pie; LD_PRELOAD does nothing for
+	            the last two
+	prediction  covered, partial, or bypassed
+	covered     imports the shim interposes (from --shim's exported functions)
+	uncovered   imports listed in nondeterministic_sources.h
+	getrandom_syscall, rdrand, rdseed, rdtsc
+	            objects in the closure whose executable segments contain that
+	            instruction, which the shim cannot intercept
+	missing     DT_NEEDED entries that could not be found
+
+Instruction matches are byte patterns, not a disassembly, so they can be
+false positives; a getrandom syscall inside the object that defines
+getrandom is its libc wrapper and is not reported. Each file is parsed once
+however many closures it appears in.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <elf.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <emmintrin.h>
+
+#define INTERNAL
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#define GETRANDOM_SYSCALL_NUMBER 318
+
+typedef enum {
+	FINDING_GETRANDOM_SYSCALL = 1 << 0,
+	FINDING_RDRAND = 1 << 1,
+	FINDING_RDSEED = 1 << 2,
+	FINDING_RDTSC = 1 << 3,
+} finding_t;
+
+typedef enum {
+	LINKAGE_DYNAMIC,
+	LINKAGE_STATIC,
+	LINKAGE_STATIC_PIE,
+} linkage_t;
+
+const char* linkage_names[] = {"dynamic", "static", "static-pie"};
+
+/*
+ * Symbol names we care about, each with a bit index for import bitsets.
+ */
+
+#define SYMBOL_UNCOVERED 1
+#define SYMBOL_COVERED 2
+
+typedef struct {
+	char* name;
+	unsigned kind;
+} symbol_t;
+
+typedef struct {
+	symbol_t* symbols;
+	size_t used_symbols;
+	size_t capacity;
+	// Open addressing over indices into symbols, plus one; zero is empty.
+	uint32_t* slots;
+	size_t slots_capacity;
+} symbol_set_t;
+
+symbol_set_t known = {0};
+
+typedef struct {
+	char* path;
+	dev_t dev;
+	ino_t ino;
+	bool parsed;
+	bool elf;
+	uint16_t machine;
+	linkage_t linkage;
+	uint32_t findings;
+	uint64_t* imports;
+	char** needed;
+	size_t used_needed;
+	char* rpath;
+	char* runpath;
+	char* interp;
+	bool reported;
+	// Indices of resolved dependencies, filled the first time a closure needs them.
+	bool resolved;
+	size_t* deps;
+	size_t used_deps;
+	char** missing;
+	size_t used_missing;
+	unsigned visited;
+} object_t;
+
+typedef struct {
+	object_t* objects;
+	size_t used_objects;
+	size_t capacity;
+	// Open addressing over indices into objects, plus one, keyed by (dev, ino).
+	size_t* slots;
+	size_t slots_capacity;
+	unsigned generation;
+} object_cache_t;
+
+object_cache_t cache = {0};
+
+const char* default_library_dirs[] = {
+	"/lib/x86_64-linux-gnu",
+	"/usr/lib/x86_64-linux-gnu",
+	"/lib64",
+	"/usr/lib64",
+	"/lib",
+	"/usr/lib",
+	"/usr/local/lib",
+};
+
+void INTERNAL* checked_realloc(void* pointer, size_t size) {
+	pointer = realloc(pointer, size);
+	if (UNLIKELY(pointer == NULL)) {
+		perror("deterministic_scan");
+		exit(2);
+	}
+	return pointer;
+}
+
+uint64_t INTERNAL hash_name(const char* name) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *name; ++name) {
+		hash = (hash ^ (uint8_t)*name) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+ssize_t INTERNAL symbol_find(const symbol_set_t* set, const char* name) {
+	if (set->slots_capacity == 0) {
+		return -1;
+	}
+	size_t mask = set->slots_capacity - 1;
+	for (size_t slot = hash_name(name) & mask; set->slots[slot]; slot = (slot + 1) & mask) {
+		if (strcmp(set->symbols[set->slots[slot] - 1].name, name) == 0) {
+			return set->slots[slot] - 1;
+		}
+	}
+	return -1;
+}
+
+void INTERNAL symbol_add(symbol_set_t* set, const char* name, unsigned kind) {
+	ssize_t existing = symbol_find(set, name);
+	if (existing >= 0) {
+		set->symbols[existing].kind |= kind;
+		return;
+	}
+	if ((set->used_symbols + 1) * 2 > set->slots_capacity) {
+		set->slots_capacity = set->slots_capacity ? set->slots_capacity * 2 : 256;
+		free(set->slots);
+		set->slots = calloc(set->slots_capacity, sizeof(uint32_t));
+		if (UNLIKELY(set->slots == NULL)) {
+			perror("deterministic_scan");
+			exit(2);
+		}
+		size_t mask = set->slots_capacity - 1;
+		for (size_t i = 0; i < set->used_symbols; ++i) {
+			size_t slot = hash_name(set->symbols[i].name) & mask;
+			while (set->slots[slot]) {
+				slot = (slot + 1) & mask;
+			}
+			set->slots[slot] = i + 1;
+		}
+	}
+	if (set->used_symbols == set->capacity) {
+		set->capacity = set->capacity ? set->capacity * 2 : 64;
+		set->symbols = checked_realloc(set->symbols, set->capacity * sizeof(symbol_t));
+	}
+	size_t mask = set->slots_capacity - 1;
+	size_t slot = hash_name(name) & mask;
+	while (set->slots[slot]) {
+		slot = (slot + 1) & mask;
+	}
+	set->symbols[set->used_symbols] = (symbol_t){strdup(name), kind};
+	set->slots[slot] = ++set->used_symbols;
+}
+
+size_t INTERNAL bitset_words() {
+	return (known.used_symbols + 63) / 64;
+}
+
+/*
+ * ELF parsing. Everything read from the file is bounds-checked; a malformed
+ * file just yields fewer facts.
+ */
+
+bool INTERNAL in_bounds(size_t size, uint64_t offset, uint64_t length) {
+	return offset <= size && length <= size - offset;
+}
+
+const char* INTERNAL string_at(const uint8_t* data, size_t size, const Elf64_Shdr* strtab, uint64_t offset) {
+	if (!in_bounds(size, strtab->sh_offset, strtab->sh_size) || offset >= strtab->sh_size) {
+		return NULL;
+	}
+	const char* string = (const char*)data + strtab->sh_offset + offset;
+	if (memchr(string, '\0', strtab->sh_size - offset) == NULL) {
+		return NULL;
+	}
+	return string;
+}
+
+/*
+ * "0f 31" turns up inside all sorts of longer instructions. Real rdtsc is
+ * followed almost immediately by "shl $32, %rdx" to join the halves, which
+ * is what __rdtsc() and every hand-written sequence we have seen compile to.
+ */
+bool INTERNAL joins_edx_eax(const uint8_t* text, size_t size, size_t offset) {
+	static const uint8_t shl[] = {0x48, 0xc1, 0xe2, 0x20};
+	for (size_t start = offset; start <= offset + 8 && start + sizeof(shl) <= size; ++start) {
+		if (memcmp(text + start, shl, sizeof(shl)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint32_t INTERNAL classify(const uint8_t* text, size_t size, size_t offset) {
+	switch (text[offset + 1]) {
+	case 0x05:
+		// syscall; look for "mov $318, %eax" shortly before it.
+		for (size_t back = 5; back <= 16 && back <= offset; ++back) {
+			const uint8_t* mov = text + offset - back;
+			if (mov[0] == 0xb8 && mov[1] == (GETRANDOM_SYSCALL_NUMBER & 0xff) && mov[2] == (GETRANDOM_SYSCALL_NUMBER >> 8) && mov[3] == 0 && mov[4] == 0) {
+				return FINDING_GETRANDOM_SYSCALL;
+			}
+		}
+		return 0;
+	case 0xc7:
+		// Register forms of group 9: /6 is rdrand, /7 is rdseed.
+		if (offset + 2 < size && (text[offset + 2] & 0xc0) == 0xc0) {
+			switch ((text[offset + 2] >> 3) & 7) {
+			case 6:
+				return FINDING_RDRAND;
+			case 7:
+				return FINDING_RDSEED;
+			}
+		}
+		return 0;
+	case 0x31:
+		return joins_edx_eax(text, size, offset + 2) ? FINDING_RDTSC : 0;
+	case 0x01:
+		// rdtscp
+		return offset + 2 < size && text[offset + 2] == 0xf9 && joins_edx_eax(text, size, offset + 3) ? FINDING_RDTSC : 0;
+	}
+	return 0;
+}
+
+/*
+ * Every instruction we look for starts with 0x0f followed by one of four
+ * bytes, so compare 16 positions at a time against both and only classify
+ * the positions where the pair matches.
+ */
+uint32_t INTERNAL scan_text(const uint8_t* text, size_t size) {
+	uint32_t findings = 0;
+	const __m128i escape = _mm_set1_epi8(0x0f);
+	const __m128i syscall = _mm_set1_epi8(0x05);
+	const __m128i group9 = _mm_set1_epi8((char)0xc7);
+	const __m128i rdtsc = _mm_set1_epi8(0x31);
+	const __m128i group7 = _mm_set1_epi8(0x01);
+	size_t offset = 0;
+	for (; offset + 17 <= size; offset += 16) {
+		__m128i first = _mm_loadu_si128((const __m128i*)(text + offset));
+		__m128i second = _mm_loadu_si128((const __m128i*)(text + offset + 1));
+		__m128i candidates = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(second, syscall), _mm_cmpeq_epi8(second, group9)),
+			_mm_or_si128(_mm_cmpeq_epi8(second, rdtsc), _mm_cmpeq_epi8(second, group7))
+		);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, escape), candidates));
+		while (UNLIKELY(mask)) {
+			findings |= classify(text, size, offset + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+	for (; offset + 1 < size; ++offset) {
+		if (text[offset] == 0x0f) {
+			findings |= classify(text, size, offset);
+		}
+	}
+	return findings;
+}
+
+void INTERNAL parse_sections(object_t* object, const uint8_t* data, size_t size, const Elf64_Shdr* sections, size_t section_count, bool* defines_getrandom, bool* pie) {
+	for (size_t i = 0; i < section_count; ++i) {
+		const Elf64_Shdr* section = &sections[i];
+		if (section->sh_link >= section_count || !in_bounds(size, section->sh_offset, section->sh_size)) {
+			continue;
+		}
+		const Elf64_Shdr* strtab = &sections[section->sh_link];
+		if (section->sh_type == SHT_DYNSYM) {
+			const Elf64_Sym* symbols = (const Elf64_Sym*)(data + section->sh_offset);
+			for (size_t j = 0; j < section->sh_size / sizeof(Elf64_Sym); ++j) {
+				unsigned bind = ELF64_ST_BIND(symbols[j].st_info);
+				if (bind != STB_GLOBAL && bind != STB_WEAK) {
+					continue;
+				}
+				const char* name = string_at(data, size, strtab, symbols[j].st_name);
+				if (name == NULL || *name == '\0') {
+					continue;
+				}
+				if (symbols[j].st_shndx == SHN_UNDEF) {
+					ssize_t index = symbol_find(&known, name);
+					if (index >= 0) {
+						object->imports[index / 64] |= 1ULL << (index % 64);
+					}
+				} else if (strcmp(name, "getrandom") == 0) {
+					*defines_getrandom = true;
+				}
+			}
+		} else if (section->sh_type == SHT_DYNAMIC) {
+			const Elf64_Dyn* entries = (const Elf64_Dyn*)(data + section->sh_offset);
+			for (size_t j = 0; j < section->sh_size / sizeof(Elf64_Dyn) && entries[j].d_tag != DT_NULL; ++j) {
+				const char* string;
+				switch (entries[j].d_tag) {
+				case DT_NEEDED:
+					if ((string = string_at(data, size, strtab, entries[j].d_un.d_val))) {
+						object->needed = checked_realloc(object->needed, (object->used_needed + 1) * sizeof(char*));
+						object->needed[object->used_needed++] = strdup(string);
+					}
+					break;
+				case DT_RPATH:
+					if ((string = string_at(data, size, strtab, entries[j].d_un.d_val))) {
+						object->rpath = strdup(string);
+					}
+					break;
+				case DT_RUNPATH:
+					if ((string = string_at(data, size, strtab, entries[j].d_un.d_val))) {
+						object->runpath = strdup(string);
+					}
+					break;
+				case DT_FLAGS_1:
+					*pie = entries[j].d_un.d_val & DF_1_PIE;
+					break;
+				}
+			}
+		}
+	}
+}
+
+void INTERNAL parse_elf(object_t* object, const uint8_t* data, size_t size) {
+	const Elf64_Ehdr* header = (const Elf64_Ehdr*)data;
+	if (size < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_ident[EI_DATA] != ELFDATA2LSB || (header->e_type != ET_EXEC && header->e_type != ET_DYN)) {
+		return;
+	}
+	object->elf = true;
+	object->machine = header->e_machine;
+	object->imports = calloc(bitset_words() ? bitset_words() : 1, sizeof(uint64_t));
+
+	bool dynamic = false;
+	if (header->e_phentsize == sizeof(Elf64_Phdr) && in_bounds(size, header->e_phoff, (uint64_t)header->e_phnum * sizeof(Elf64_Phdr))) {
+		const Elf64_Phdr* segments = (const Elf64_Phdr*)(data + header->e_phoff);
+		for (size_t i = 0; i < header->e_phnum; ++i) {
+			const Elf64_Phdr* segment = &segments[i];
+			if (segment->p_type == PT_DYNAMIC) {
+				dynamic = true;
+			} else if (segment->p_type == PT_INTERP && in_bounds(size, segment->p_offset, segment->p_filesz) && segment->p_filesz > 0) {
+				object->interp = strndup((const char*)data + segment->p_offset, segment->p_filesz);
+			} else if (segment->p_type == PT_LOAD && (segment->p_flags & PF_X) && object->machine == EM_X86_64) {
+				uint64_t length = segment->p_filesz;
+				if (segment->p_offset <= size && length > size - segment->p_offset) {
+					length = size - segment->p_offset;
+				}
+				if (segment->p_offset <= size) {
+					object->findings |= scan_text(data + segment->p_offset, length);
+				}
+			}
+		}
+	}
+	bool defines_getrandom = false;
+	bool pie = false;
+	if (header->e_shentsize == sizeof(Elf64_Shdr) && in_bounds(size, header->e_shoff, (uint64_t)header->e_shnum * sizeof(Elf64_Shdr))) {
+		parse_sections(object, data, size, (const Elf64_Shdr*)(data + header->e_shoff), header->e_shnum, &defines_getrandom, &pie);
+	}
+	// A static PIE keeps a PT_DYNAMIC for its self-relocation but has no
+	// interpreter; a shared library has neither an interpreter nor DF_1_PIE.
+	if (!dynamic) {
+		object->linkage = LINKAGE_STATIC;
+	} else if (object->interp == NULL && pie) {
+		object->linkage = LINKAGE_STATIC_PIE;
+	} else {
+		object->linkage = LINKAGE_DYNAMIC;
+	}
+	if (defines_getrandom) {
+		object->findings &= ~FINDING_GETRANDOM_SYSCALL;
+	}
+}
+
+/*
+ * Object cache, so each file is mapped and scanned once.
+ */
+
+size_t INTERNAL object_slot(dev_t dev, ino_t ino) {
+	uint64_t hash = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)ino * 0xbf58476d1ce4e5b9ULL);
+	return (hash ^ (hash >> 29)) & (cache.slots_capacity - 1);
+}
+
+void INTERNAL object_cache_grow() {
+	size_t capacity = cache.slots_capacity ? cache.slots_capacity * 2 : 1024;
+	free(cache.slots);
+	cache.slots = calloc(capacity, sizeof(size_t));
+	if (UNLIKELY(cache.slots == NULL)) {
+		perror("deterministic_scan");
+		exit(2);
+	}
+	cache.slots_capacity = capacity;
+	for (size_t i = 0; i < cache.used_objects; ++i) {
+		size_t slot = object_slot(cache.objects[i].dev, cache.objects[i].ino);
+		while (cache.slots[slot]) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		cache.slots[slot] = i + 1;
+	}
+}
+
+/*
+ * Returns the index of the object for path, parsing it on first sight, or -1
+ * if it cannot be opened.
+ */
+ssize_t INTERNAL load_object(const char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	if ((cache.used_objects + 1) * 2 > cache.slots_capacity) {
+		object_cache_grow();
+	}
+	size_t slot = object_slot(info.st_dev, info.st_ino);
+	for (; cache.slots[slot]; slot = (slot + 1) & (cache.slots_capacity - 1)) {
+		object_t* object = &cache.objects[cache.slots[slot] - 1];
+		if (object->dev == info.st_dev && object->ino == info.st_ino) {
+			close(fd);
+			return cache.slots[slot] - 1;
+		}
+	}
+	if (cache.used_objects == cache.capacity) {
+		cache.capacity = cache.capacity ? cache.capacity * 2 : 256;
+		cache.objects = checked_realloc(cache.objects, cache.capacity * sizeof(object_t));
+	}
+	object_t* object = &cache.objects[cache.used_objects];
+	*object = (object_t){.path = strdup(path), .dev = info.st_dev, .ino = info.st_ino, .parsed = true};
+	if (info.st_size > 0) {
+		void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			parse_elf(object, data, info.st_size);
+			munmap(data, info.st_size);
+		}
+	}
+	close(fd);
+	cache.slots[slot] = ++cache.used_objects;
+	return cache.used_objects - 1;
+}
+
+/*
+ * Dependency resolution, following ld.so's order: DT_RPATH (only without
+ * DT_RUNPATH), LD_LIBRARY_PATH, DT_RUNPATH, then the default directories.
+ * ld.so.cache is not consulted.
+ */
+
+ssize_t INTERNAL search_path(const char* path_list, const char* origin, const char* name, uint16_t machine) {
+	if (path_list == NULL) {
+		return -1;
+	}
+	char candidate[PATH_MAX];
+	const char* start = path_list;
+	while (true) {
+		const char* end = strchrnul(start, ':');
+		size_t length = 0;
+		for (const char* cursor = start; cursor < end && length < sizeof(candidate) - 1;) {
+			size_t token = 0;
+			if (strncmp(cursor, "$ORIGIN", 7) == 0) {
+				token = 7;
+			} else if (strncmp(cursor, "${ORIGIN}", 9) == 0) {
+				token = 9;
+			}
+			if (token) {
+				length += snprintf(candidate + length, sizeof(candidate) - length, "%s", origin);
+				cursor += token;
+			} else {
+				candidate[length++] = *cursor++;
+			}
+		}
+		if (length > 0 && length < sizeof(candidate) - 1) {
+			snprintf(candidate + length, sizeof(candidate) - length, "/%s", name);
+			ssize_t index = load_object(candidate);
+			// Like ld.so, skip libraries built for another machine.
+			if (index >= 0 && cache.objects[index].elf && cache.objects[index].machine == machine) {
+				return index;
+			}
+		}
+		if (*end == '\0') {
+			return -1;
+		}
+		start = end + 1;
+	}
+}
+
+ssize_t INTERNAL resolve_needed(size_t loader, const char* name) {
+	uint16_t machine = cache.objects[loader].machine;
+	if (strchr(name, '/')) {
+		return load_object(name);
+	}
+	char origin[PATH_MAX];
+	snprintf(origin, sizeof(origin), "%s", cache.objects[loader].path);
+	dirname(origin);
+	ssize_t index = -1;
+	if (cache.objects[loader].runpath == NULL) {
+		index = search_path(cache.objects[loader].rpath, origin, name, machine);
+	}
+	if (index < 0) {
+		index = search_path(getenv("LD_LIBRARY_PATH"), origin, name, machine);
+	}
+	if (index < 0) {
+		index = search_path(cache.objects[loader].runpath, origin, name, machine);
+	}
+	for (size_t i = 0; index < 0 && i < sizeof(default_library_dirs) / sizeof(default_library_dirs[0]); ++i) {
+		index = search_path(default_library_dirs[i], origin, name, machine);
+	}
+	return index;
+}
+
+void INTERNAL resolve_deps(size_t index) {
+	if (cache.objects[index].resolved) {
+		return;
+	}
+	cache.objects[index].resolved = true;
+	size_t* deps = NULL;
+	size_t used_deps = 0;
+	char** missing = NULL;
+	size_t used_missing = 0;
+	// load_object may move cache.objects, so re-index after every call.
+	if (cache.objects[index].interp) {
+		ssize_t interp = load_object(cache.objects[index].interp);
+		if (interp >= 0) {
+			// ld.so reads the TSC only for LD_DEBUG=statistics.
+			cache.objects[interp].findings &= ~FINDING_RDTSC;
+			deps = checked_realloc(deps, (used_deps + 1) * sizeof(size_t));
+			deps[used_deps++] = interp;
+		}
+	}
+	for (size_t i = 0; i < cache.objects[index].used_needed; ++i) {
+		ssize_t dep = resolve_needed(index, cache.objects[index].needed[i]);
+		if (dep >= 0) {
+			deps = checked_realloc(deps, (used_deps + 1) * sizeof(size_t));
+			deps[used_deps++] = dep;
+		} else {
+			missing = checked_realloc(missing, (used_missing + 1) * sizeof(char*));
+			missing[used_missing++] = cache.objects[index].needed[i];
+		}
+	}
+	cache.objects[index].deps = deps;
+	cache.objects[index].used_deps = used_deps;
+	cache.objects[index].missing = missing;
+	cache.objects[index].used_missing = used_missing;
+}
+
+/*
+ * Report.
+ */
+
+typedef struct {
+	uint64_t* imports;
+	size_t* members;
+	size_t used_members;
+	size_t capacity;
+} closure_t;
+
+void INTERNAL collect_closure(size_t index, closure_t* closure) {
+	if (cache.objects[index].visited == cache.generation) {
+		return;
+	}
+	cache.objects[index].visited = cache.generation;
+	resolve_deps(index);
+	if (closure->used_members == closure->capacity) {
+		closure->capacity = closure->capacity ? closure->capacity * 2 : 32;
+		closure->members = checked_realloc(closure->members, closure->capacity * sizeof(size_t));
+	}
+	closure->members[closure->used_members++] = index;
+	for (size_t i = 0; i < bitset_words(); ++i) {
+		closure->imports[i] |= cache.objects[index].imports[i];
+	}
+	for (size_t i = 0; i < cache.objects[index].used_deps; ++i) {
+		collect_closure(cache.objects[index].deps[i], closure);
+	}
+}
+
+void INTERNAL print_symbols(const closure_t* closure, unsigned kind) {
+	bool any = false;
+	for (size_t i = 0; i < known.used_symbols; ++i) {
+		// A name the shim exports only as an audit wrapper is still uncovered.
+		unsigned symbol_kind = known.symbols[i].kind & SYMBOL_UNCOVERED ? SYMBOL_UNCOVERED : SYMBOL_COVERED;
+		if (symbol_kind == kind && (closure->imports[i / 64] >> (i % 64)) & 1) {
+			printf("%s%s", any ? "," : "", known.symbols[i].name);
+			any = true;
+		}
+	}
+	printf(any ? "\t" : "-\t");
+}
+
+bool INTERNAL print_finding(const closure_t* closure, finding_t finding) {
+	bool any = false;
+	for (size_t i = 0; i < closure->used_members; ++i) {
+		const object_t* object = &cache.objects[closure->members[i]];
+		if (object->findings & finding) {
+			printf("%s%s", any ? "," : "", strrchr(object->path, '/') ? strrchr(object->path, '/') + 1 : object->path);
+			any = true;
+		}
+	}
+	printf(any ? "\t" : "-\t");
+	return any;
+}
+
+void INTERNAL report(size_t index) {
+	closure_t closure = {.imports = calloc(bitset_words() ? bitset_words() : 1, sizeof(uint64_t))};
+	++cache.generation;
+	collect_closure(index, &closure);
+	const object_t* object = &cache.objects[index];
+
+	bool uncovered = false;
+	for (size_t i = 0; i < known.used_symbols; ++i) {
+		if ((known.symbols[i].kind & SYMBOL_UNCOVERED) && ((closure.imports[i / 64] >> (i % 64)) & 1)) {
+			uncovered = true;
+		}
+	}
+	bool missing = false;
+	for (size_t i = 0; i < closure.used_members; ++i) {
+		missing |= cache.objects[closure.members[i]].used_missing > 0;
+	}
+	uint32_t findings = 0;
+	for (size_t i = 0; i < closure.used_members; ++i) {
+		findings |= cache.objects[closure.members[i]].findings;
+	}
+	const char* prediction = "covered";
+	if (object->linkage != LINKAGE_DYNAMIC) {
+		prediction = "bypassed";
+	} else if (uncovered || missing || findings) {
+		prediction = "partial";
+	}
+
+	printf("%s\t%s\t%s\t", object->path, linkage_names[object->linkage], prediction);
+	print_symbols(&closure, SYMBOL_COVERED);
+	print_symbols(&closure, SYMBOL_UNCOVERED);
+	print_finding(&closure, FINDING_GETRANDOM_SYSCALL);
+	print_finding(&closure, FINDING_RDRAND);
+	print_finding(&closure, FINDING_RDSEED);
+	print_finding(&closure, FINDING_RDTSC);
+	bool any = false;
+	for (size_t i = 0; i < closure.used_members; ++i) {
+		const object_t* member = &cache.objects[closure.members[i]];
+		for (size_t j = 0; j < member->used_missing; ++j) {
+			printf("%s%s", any ? "," : "", member->missing[j]);
+			any = true;
+		}
+	}
+	printf(any ? "\n" : "-\n");
+	free(closure.imports);
+	free(closure.members);
+}
+
+/*
+ * Command line.
+ */
+
+void INTERNAL load_shim_exports(const char* path) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		fprintf(stderr, "deterministic_scan: %s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+	const uint8_t* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	const Elf64_Ehdr* header = (const Elf64_Ehdr*)data;
+	if (data == MAP_FAILED || info.st_size < (off_t)sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_shentsize != sizeof(Elf64_Shdr) || !in_bounds(info.st_size, header->e_shoff, (uint64_t)header->e_shnum * sizeof(Elf64_Shdr))) {
+		fprintf(stderr, "deterministic_scan: %s: not a 64-bit ELF shared object\n", path);
+		exit(2);
+	}
+	const Elf64_Shdr* sections = (const Elf64_Shdr*)(data + header->e_shoff);
+	for (size_t i = 0; i < header->e_shnum; ++i) {
+		if (sections[i].sh_type != SHT_DYNSYM || sections[i].sh_link >= header->e_shnum || !in_bounds(info.st_size, sections[i].sh_offset, sections[i].sh_size)) {
+			continue;
+		}
+		const Elf64_Sym* symbols = (const Elf64_Sym*)(data + sections[i].sh_offset);
+		for (size_t j = 0; j < sections[i].sh_size / sizeof(Elf64_Sym); ++j) {
+			const char* name = string_at(data, info.st_size, &sections[sections[i].sh_link], symbols[j].st_name);
+			// The det_* API is for programs that opt in, not something they import by accident.
+			if (symbols[j].st_shndx != SHN_UNDEF && ELF64_ST_TYPE(symbols[j].st_info) == STT_FUNC && ELF64_ST_BIND(symbols[j].st_info) == STB_GLOBAL && name && strncmp(name, "det_", 4) != 0) {
+				symbol_add(&known, name, SYMBOL_COVERED);
+			}
+		}
+	}
+	munmap((void*)data, info.st_size);
+}
+
+void INTERNAL scan_path(const char* path, bool top_level) {
+	struct stat info;
+	if ((top_level ? stat(path, &info) : lstat(path, &info)) != 0) {
+		if (top_level) {
+			fprintf(stderr, "deterministic_scan: %s: %s\n", path, strerror(errno));
+		}
+		return;
+	}
+	if (S_ISDIR(info.st_mode)) {
+		DIR* directory = opendir(path);
+		if (directory == NULL) {
+			return;
+		}
+		struct dirent* entry;
+		char child[PATH_MAX];
+		while ((entry = readdir(directory))) {
+			if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 && (size_t)snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) < sizeof(child)) {
+				scan_path(child, false);
+			}
+		}
+		closedir(directory);
+	} else if (S_ISREG(info.st_mode)) {
+		// Inside a directory, symlinks were skipped above and hard links are
+		// reported once, because load_object dedupes by inode.
+		ssize_t index = load_object(path);
+		if (index < 0 || !cache.objects[index].elf) {
+			if (top_level) {
+				fprintf(stderr, "deterministic_scan: %s: not a 64-bit ELF executable or library\n", path);
+			}
+			return;
+		}
+		if (top_level || !cache.objects[index].reported) {
+			cache.objects[index].reported = true;
+			report(index);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	int first_path = 1;
+	for (; first_path < argc && argv[first_path][0] == '-'; ++first_path) {
+		if (strcmp(argv[first_path], "--shim") == 0 && first_path + 1 < argc) {
+			load_shim_exports(argv[++first_path]);
+		} else if (strcmp(argv[first_path], "--") == 0) {
+			++first_path;
+			break;
+		} else {
+			fprintf(stderr, "usage: %s [--shim deterministic_random_preload.so] path...\n", argv[0]);
+			return 2;
+		}
+	}
+	if (first_path == argc) {
+		fprintf(stderr, "usage: %s [--shim deterministic_random_preload.so] path...\n", argv[0]);
+		return 2;
+	}
+#define SOURCE(ret, name, params, args) symbol_add(&known, #name, SYMBOL_UNCOVERED);
+#define VOID_SOURCE(name, params, args) symbol_add(&known, #name, SYMBOL_UNCOVERED);
+// Covered only in opt-in modes.
+#define OPT_IN_SOURCE(name) symbol_add(&known, #name, SYMBOL_UNCOVERED);
+#include "nondeterministic_sources.h"
+#undef SOURCE
+#undef VOID_SOURCE
+#undef OPT_IN_SOURCE
+
+	printf("path\tlinkage\tprediction\tcovered\tuncovered\tgetrandom_syscall\trdrand\trdseed\trdtsc\tmissing\n");
+	for (int i = first_path; i < argc; ++i) {
+		scan_path(argv[i], true);
+	}
+	return 0;
+}
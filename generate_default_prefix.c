@@ -0,0 +1,39 @@
+/*
+gcc -O2 -Wall -Werror -o generate_default_prefix generate_default_prefix.c && ./generate_default_prefix > default_stream_prefix.h
+
+Prints the first twisted block of the default stream for DEFAULT_SEED, which
+deterministic_random_preload.c embeds so that processes running with the
+default seed start drawing without mt_init or a twist. Rerun it whenever
+mersenne_twister.h or the seed derivation changes; test_all.py checks that
+the committed header is current.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#include "mersenne_twister.h"
+
+/*
+ * Must match DEFAULT_SEED in deterministic_random_preload.c.
+ */
+#define DEFAULT_SEED 12345
+
+int main() {
+	uint64_t seed = DEFAULT_SEED;
+	mt_state state;
+	// The same folding as stream_reset.
+	mt_init(&state, seed ^ (seed >> 32));
+	mt_twist(&state);
+	printf("/* Generated by generate_default_prefix.c; do not edit. */\n\n");
+	printf("#define DEFAULT_STREAM_PREFIX_SEED %lluULL\n\n", (unsigned long long)seed);
+	printf("const uint32_t default_stream_prefix[MT_LEN] = {\n");
+	for (size_t i = 0; i < MT_LEN; ++i) {
+		printf("%s0x%08x,%s", i % 8 == 0 ? "\t" : "", state.buffer[i], i % 8 == 7 || i == MT_LEN - 1 ? "\n" : " ");
+	}
+	printf("};\n");
+	return 0;
+}
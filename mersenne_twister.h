@@ -15,7 +15,8 @@ typedef struct {
 } mt_state;
 
 void mt_init(mt_state* mt, size_t seed) {
-	mt->index = 0;
+	// The buffer holds the untwisted seed material, so the first draw twists.
+	mt->index = MT_LEN;
 	seed += 0xdead;
     for (uint32_t i = 0; i < MT_LEN; i++) {
 		uint32_t t = (seed*seed*seed + i*i*i);
@@ -23,22 +24,72 @@ void mt_init(mt_state* mt, size_t seed) {
 	}
 }
 
-uint32_t mt_random(mt_state* mt) {
+void mt_twist(mt_state* mt) {
     uint32_t s;
-    short i;
-    if (UNLIKELY(mt->index++ == MT_LEN)) {
+    short i = 0;
+	for (; i < MT_IB; i++) {
+		s = TWIST(mt->buffer, i, i+1);
+		mt->buffer[i] = mt->buffer[i + MT_IA] ^ (s >> 1) ^ MAGIC(s);
+	}
+	for (; i < MT_LEN-1; i++) {
+		s = TWIST(mt->buffer, i, i+1);
+		mt->buffer[i] = mt->buffer[i - MT_IB] ^ (s >> 1) ^ MAGIC(s);
+	}
+	s = TWIST(mt->buffer, MT_LEN-1, 0);
+	mt->buffer[MT_LEN-1] = mt->buffer[MT_IA-1] ^ (s >> 1) ^ MAGIC(s);
+}
+
+/*
+ * Start from a block that has already been twisted, as if mt_init and the
+ * first twist had run.
+ */
+void mt_init_twisted(mt_state* mt, const uint32_t* block) {
+	memcpy(mt->buffer, block, sizeof(mt->buffer));
+	mt->index = 0;
+}
+
+uint32_t mt_random(mt_state* mt) {
+    if (UNLIKELY(mt->index == MT_LEN)) {
+		mt_twist(mt);
 		mt->index = 0;
-		i = 0;
-		for (; i < MT_IB; i++) {
-			s = TWIST(mt->buffer, i, i+1);
-			mt->buffer[i] = mt->buffer[i + MT_IA] ^ (s >> 1) ^ MAGIC(s);
+	}
+	return mt->buffer[mt->index++];
+}
+
+/*
+ * Copy the next `count` words into `out`, a block at a time.
+ */
+void mt_fill(mt_state* mt, uint32_t* out, size_t count) {
+	while (count > 0) {
+		if (UNLIKELY(mt->index == MT_LEN)) {
+			mt_twist(mt);
+			mt->index = 0;
+		}
+		size_t chunk = MT_LEN - mt->index;
+		if (chunk > count) {
+			chunk = count;
+		}
+		memcpy(out, &mt->buffer[mt->index], chunk * sizeof(uint32_t));
+		mt->index += chunk;
+		out += chunk;
+		count -= chunk;
+	}
+}
+
+/*
+ * Skip the next `count` words. This costs one twist per block skipped.
+ */
+void mt_discard(mt_state* mt, uint64_t count) {
+	while (count > 0) {
+		if (mt->index == MT_LEN) {
+			mt_twist(mt);
+			mt->index = 0;
 		}
-		for (; i < MT_LEN-1; i++) {
-			s = TWIST(mt->buffer, i, i+1);
-			mt->buffer[i] = mt->buffer[i - MT_IB] ^ (s >> 1) ^ MAGIC(s);
+		uint64_t chunk = MT_LEN - mt->index;
+		if (chunk > count) {
+			chunk = count;
 		}
-		s = TWIST(mt->buffer, MT_LEN-1, 0);
-		mt->buffer[MT_LEN-1] = mt->buffer[MT_IA-1] ^ (s >> 1) ^ MAGIC(s);
+		mt->index += chunk;
+		count -= chunk;
 	}
-	return mt->buffer[mt->index];
 }
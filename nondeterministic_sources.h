@@ -0,0 +1,73 @@
+/*
+ * libc entry points that return nondeterministic results and that the shim
+ * does not virtualize. Include after defining
+ *
+ *     SOURCE(return_type, name, (parameters...), (arguments...))
+ *     VOID_SOURCE(name, (parameters...), (arguments...))
+ *     OPT_IN_SOURCE(name)
+ *
+ * deterministic_random_preload.c turns each SOURCE into a counting wrapper
+ * for DETERMINISTIC_AUDIT. When the shim starts covering one of these, move
+ * it out of this list and into the hook. OPT_IN_SOURCEs are hooked by hand:
+ * they are covered in an opt-in mode (DETERMINISTIC_VIRTUAL_CLOCK,
+ * DETERMINISTIC_EPOLL_ORDER, DETERMINISTIC_WATCH_WINDOW,
+ * DETERMINISTIC_VIRTUAL_CPUS) and counted otherwise.
+ */
+
+// Time: covered by DETERMINISTIC_VIRTUAL_CLOCK, or by libfaketime.
+OPT_IN_SOURCE(clock_gettime)
+OPT_IN_SOURCE(gettimeofday)
+OPT_IN_SOURCE(time)
+OPT_IN_SOURCE(nanosleep)
+OPT_IN_SOURCE(clock_nanosleep)
+OPT_IN_SOURCE(sleep)
+OPT_IN_SOURCE(usleep)
+SOURCE(clock_t, clock, (void), ())
+SOURCE(clock_t, times, (struct tms* buffer), (buffer))
+SOURCE(int, getrusage, (__rusage_who_t who, struct rusage* usage), (who, usage))
+
+// Timers deliver signals at wall-clock moments.
+OPT_IN_SOURCE(setitimer)
+OPT_IN_SOURCE(alarm)
+OPT_IN_SOURCE(timer_create)
+
+// Process identity.
+SOURCE(pid_t, getpid, (void), ())
+SOURCE(pid_t, getppid, (void), ())
+SOURCE(pid_t, gettid, (void), ())
+
+// libc PRNGs, usually seeded from time or pid.
+SOURCE(int, rand, (void), ())
+VOID_SOURCE(srand, (unsigned int seed), (seed))
+SOURCE(int, rand_r, (unsigned int* seed), (seed))
+SOURCE(long, random, (void), ())
+VOID_SOURCE(srandom, (unsigned int seed), (seed))
+SOURCE(double, drand48, (void), ())
+SOURCE(long, lrand48, (void), ())
+SOURCE(long, mrand48, (void), ())
+VOID_SOURCE(srand48, (long seed), (seed))
+#if __GLIBC_PREREQ(2, 36)
+// These draw from getrandom inside libc, out of the shim's reach.
+SOURCE(uint32_t, arc4random, (void), ())
+VOID_SOURCE(arc4random_buf, (void* buffer, size_t size), (buffer, size))
+SOURCE(uint32_t, arc4random_uniform, (uint32_t bound), (bound))
+#endif
+
+// Directory order depends on the filesystem's history.
+SOURCE(struct dirent*, readdir, (DIR* directory), (directory))
+SOURCE(struct dirent64*, readdir64, (DIR* directory), (directory))
+SOURCE(ssize_t, getdents64, (int fd, void* buffer, size_t size), (fd, buffer, size))
+
+// Scheduling and event order.
+OPT_IN_SOURCE(sched_getcpu)
+OPT_IN_SOURCE(getcpu)
+OPT_IN_SOURCE(epoll_wait)
+OPT_IN_SOURCE(inotify_init1)
+
+// Host state.
+SOURCE(int, uname, (struct utsname* name), (name))
+SOURCE(int, gethostname, (char* name, size_t size), (name, size))
+SOURCE(int, getaddrinfo, (const char* node, const char* service, const struct addrinfo* hints, struct addrinfo** result), (node, service, hints, result))
+SOURCE(int, getifaddrs, (struct ifaddrs** result), (result))
+SOURCE(int, sysinfo, (struct sysinfo* info), (info))
+SOURCE(int, getloadavg, (double loadavg[], int count), (loadavg, count))
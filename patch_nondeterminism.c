@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+
+/*
+gcc -O2 -Wall -Werror -fPIC -shared $(python3-config --includes) -o patch_nondeterminism$(python3-config --extension-suffix) patch_nondeterminism.c
+
+LD_PRELOAD=./deterministic_random_preload.so python -c 'import patch_nondeterminism; import datetime; print(id(object()), datetime.datetime.now())'
+
+Importing this module (first thing in the script) replaces
+ - builtins.id with a counter: the n-th distinct live object gets id n.
+ - time.time, time.time_ns, datetime.datetime.{now,utcnow,today} and datetime.date.today
+   with reads of the shim's virtual clock, when the shim is preloaded.
+ - tempfile's candidate names with the shim's det_tempname, so that concurrent
+   jobs with the same seed do not race for the same names.
+It also provides zygote(), which marks the fork point of a seed sweep
+(deterministic_launcher.py sweep) after the program's imports.
+
+This is the C version of the monkeypatches in report.md. The id table is an
+open-addressing map from address to counter; an entry is removed when its
+object dies, so a recycled address gets a fresh id. Before Python 3.13 only
+weak-referenceable objects report their death. Any other object's entry
+outlives it, and a later object of the same type at the same address
+inherits its id, just as CPython's own ids are reused. So before 3.13 the
+table is bounded by the distinct addresses such objects have had, not by
+the objects alive.
+ */
+
+#include <Python.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#define TABLE_MIN_CAPACITY 1024
+
+typedef struct {
+	PyObject* key;
+	uint64_t id;
+	PyObject* tracker;
+	PyTypeObject* type;
+} id_entry_t;
+
+typedef struct {
+	id_entry_t* entries;
+	size_t capacity;
+	size_t used;
+	uint64_t next_id;
+} id_table_t;
+
+static id_table_t id_table;
+
+static int (*shim_clock_gettime)(clockid_t, struct timespec*);
+static int (*shim_tempname)(char*, int);
+
+static size_t id_slot(const PyObject* key, size_t capacity) {
+	uint64_t hash = (uintptr_t)key * 0x9e3779b97f4a7c15;
+	return (hash >> 32) & (capacity - 1);
+}
+
+static id_entry_t* id_table_find(const PyObject* key) {
+	if (UNLIKELY(id_table.entries == NULL)) {
+		return NULL;
+	}
+	for (size_t i = id_slot(key, id_table.capacity);; i = (i + 1) & (id_table.capacity - 1)) {
+		if (id_table.entries[i].key == key) {
+			return &id_table.entries[i];
+		}
+		if (id_table.entries[i].key == NULL) {
+			return NULL;
+		}
+	}
+}
+
+static int id_table_grow(void) {
+	size_t capacity = id_table.capacity ? id_table.capacity * 2 : TABLE_MIN_CAPACITY;
+	id_entry_t* entries = PyMem_Calloc(capacity, sizeof(id_entry_t));
+	if (entries == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (size_t i = 0; i < id_table.capacity; ++i) {
+		if (id_table.entries[i].key != NULL) {
+			size_t j = id_slot(id_table.entries[i].key, capacity);
+			while (entries[j].key != NULL) {
+				j = (j + 1) & (capacity - 1);
+			}
+			entries[j] = id_table.entries[i];
+		}
+	}
+	PyMem_Free(id_table.entries);
+	id_table.entries = entries;
+	id_table.capacity = capacity;
+	return 0;
+}
+
+static id_entry_t* id_table_insert(PyObject* key) {
+	if (UNLIKELY((id_table.used + 1) * 2 > id_table.capacity) && id_table_grow() < 0) {
+		return NULL;
+	}
+	size_t i = id_slot(key, id_table.capacity);
+	while (id_table.entries[i].key != NULL) {
+		i = (i + 1) & (id_table.capacity - 1);
+	}
+	id_table.entries[i].key = key;
+	id_table.entries[i].id = ++id_table.next_id;
+	id_table.entries[i].tracker = NULL;
+	id_table.entries[i].type = Py_TYPE(key);
+	id_table.used++;
+	return &id_table.entries[i];
+}
+
+/*
+ * Backward-shift deletion, so lookups never have to skip tombstones.
+ */
+static void id_table_remove(const PyObject* key) {
+	id_entry_t* entry = id_table_find(key);
+	if (entry == NULL) {
+		return;
+	}
+	PyObject* tracker = entry->tracker;
+	size_t mask = id_table.capacity - 1;
+	size_t hole = entry - id_table.entries;
+	for (size_t i = (hole + 1) & mask; id_table.entries[i].key != NULL; i = (i + 1) & mask) {
+		size_t home = id_slot(id_table.entries[i].key, id_table.capacity);
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			id_table.entries[hole] = id_table.entries[i];
+			hole = i;
+		}
+	}
+	id_table.entries[hole].key = NULL;
+	id_table.entries[hole].tracker = NULL;
+	id_table.used--;
+	Py_XDECREF(tracker);
+}
+
+#if PY_VERSION_HEX >= 0x030D0000
+
+/*
+ * Python 3.13 reports every deallocation, which covers all objects alike.
+ */
+static int ref_tracer(PyObject* obj, PyRefTracerEvent event, void* data) {
+	if (event == PyRefTracer_DESTROY && id_table.used > 0) {
+		id_table_remove(obj);
+	}
+	return 0;
+}
+
+static int track_object(PyObject* obj, PyObject** tracker) {
+	return 0;
+}
+
+static int setup_tracking(PyObject* module) {
+	return PyRefTracer_SetTracer(ref_tracer, NULL);
+}
+
+#else
+
+/*
+ * Weak-referenceable objects are tracked with a weakref whose callback drops
+ * the entry. The weakref subclass remembers the address it was made for,
+ * since the referent is already gone when the callback runs.
+ */
+typedef struct {
+	PyWeakReference ref;
+	PyObject* key;
+} tracker_t;
+
+static PyTypeObject TrackerType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "patch_nondeterminism.tracker",
+	.tp_basicsize = sizeof(tracker_t),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+static PyObject* tracker_callback;
+
+static PyObject* on_tracked_death(PyObject* module, PyObject* tracker) {
+	id_table_remove(((tracker_t*)tracker)->key);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef tracker_callback_def = {"_on_tracked_death", on_tracked_death, METH_O, NULL};
+
+/*
+ * Everything else (ints, strs, tuples, lists, dicts, ...) goes untracked.
+ * Wrapping the tp_dealloc of static types like list would also switch off
+ * CPython's trashcan, which compares tp_dealloc against the type's own, and
+ * freeing a deeply nested container would then overflow the C stack.
+ */
+static int track_object(PyObject* obj, PyObject** tracker) {
+	if (!PyType_SUPPORTS_WEAKREFS(Py_TYPE(obj))) {
+		return 0;
+	}
+	*tracker = PyObject_CallFunctionObjArgs((PyObject*)&TrackerType, obj, tracker_callback, NULL);
+	if (*tracker == NULL) {
+		return -1;
+	}
+	((tracker_t*)*tracker)->key = obj;
+	return 0;
+}
+
+static int setup_tracking(PyObject* module) {
+	TrackerType.tp_base = &_PyWeakref_RefType;
+	if (PyType_Ready(&TrackerType) < 0) {
+		return -1;
+	}
+	tracker_callback = PyCFunction_New(&tracker_callback_def, module);
+	return tracker_callback == NULL ? -1 : 0;
+}
+
+#endif
+
+static PyObject* deterministic_id(PyObject* module, PyObject* obj) {
+	id_entry_t* entry = id_table_find(obj);
+	if (LIKELY(entry != NULL)) {
+		if (LIKELY(entry->tracker != NULL || entry->type == Py_TYPE(obj))) {
+			return PyLong_FromUnsignedLongLong(entry->id);
+		}
+		// An untracked object died here and one of another type took its place.
+		id_table_remove(obj);
+	}
+	entry = id_table_insert(obj);
+	if (entry == NULL) {
+		return NULL;
+	}
+	uint64_t id = entry->id;
+	// Creating the tracker can run the GC, which moves entries around.
+	PyObject* tracker = NULL;
+	if (track_object(obj, &tracker) < 0) {
+		id_table_remove(obj);
+		return NULL;
+	}
+	id_table_find(obj)->tracker = tracker;
+	return PyLong_FromUnsignedLongLong(id);
+}
+
+static PyObject* table_size(PyObject* module, PyObject* unused) {
+	return PyLong_FromSize_t(id_table.used);
+}
+
+static int64_t virtual_ns(clockid_t clock) {
+	struct timespec now;
+	shim_clock_gettime(clock, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static PyObject* virtual_time(PyObject* module, PyObject* unused) {
+	return PyFloat_FromDouble(virtual_ns(CLOCK_REALTIME) / 1e9);
+}
+
+static PyObject* virtual_time_ns(PyObject* module, PyObject* unused) {
+	return PyLong_FromLongLong(virtual_ns(CLOCK_REALTIME));
+}
+
+/*
+ * now(tz=None), bound as a classmethod on the datetime replacements.
+ */
+static PyObject* virtual_now(PyObject* module, PyObject* args) {
+	PyObject* cls;
+	PyObject* tz = Py_None;
+	if (!PyArg_ParseTuple(args, "O|O", &cls, &tz)) {
+		return NULL;
+	}
+	PyObject* timestamp = virtual_time(module, NULL);
+	if (timestamp == NULL) {
+		return NULL;
+	}
+	PyObject* result = PyObject_CallMethod(cls, "fromtimestamp", "OO", timestamp, tz);
+	Py_DECREF(timestamp);
+	return result;
+}
+
+static PyObject* virtual_utcnow(PyObject* module, PyObject* args) {
+	PyObject* cls;
+	if (!PyArg_ParseTuple(args, "O", &cls)) {
+		return NULL;
+	}
+	PyObject* timestamp = virtual_time(module, NULL);
+	if (timestamp == NULL) {
+		return NULL;
+	}
+	PyObject* result = PyObject_CallMethod(cls, "utcfromtimestamp", "O", timestamp);
+	Py_DECREF(timestamp);
+	return result;
+}
+
+static PyObject* virtual_today(PyObject* module, PyObject* args) {
+	PyObject* cls;
+	if (!PyArg_ParseTuple(args, "O", &cls)) {
+		return NULL;
+	}
+	PyObject* timestamp = virtual_time(module, NULL);
+	if (timestamp == NULL) {
+		return NULL;
+	}
+	PyObject* result = PyObject_CallMethod(cls, "fromtimestamp", "O", timestamp);
+	Py_DECREF(timestamp);
+	return result;
+}
+
+static PyMethodDef virtual_now_def = {"now", virtual_now, METH_VARARGS, NULL};
+static PyMethodDef virtual_utcnow_def = {"utcnow", virtual_utcnow, METH_VARARGS, NULL};
+static PyMethodDef virtual_today_def = {"today", virtual_today, METH_VARARGS, NULL};
+
+/*
+ * Stored as a plain builtin on the metaclass, so it is not bound to the class;
+ * `cls` is the 1-tuple holding the original class.
+ */
+static PyObject* instancecheck(PyObject* cls, PyObject* obj) {
+	int result = PyObject_IsInstance(obj, PyTuple_GET_ITEM(cls, 0));
+	return result < 0 ? NULL : PyBool_FromLong(result);
+}
+
+static PyMethodDef instancecheck_def = {"__instancecheck__", instancecheck, METH_O, NULL};
+
+static int add_classmethod(PyObject* namespace, PyMethodDef* def, PyObject* module) {
+	PyObject* function = PyCFunction_New(def, module);
+	if (function == NULL) {
+		return -1;
+	}
+	PyObject* method = PyClassMethod_New(function);
+	Py_DECREF(function);
+	if (method == NULL) {
+		return -1;
+	}
+	int result = PyDict_SetItemString(namespace, def->ml_name, method);
+	Py_DECREF(method);
+	return result;
+}
+
+/*
+ * Replace module.name (datetime.datetime or datetime.date) with a subclass
+ * whose constructors read the virtual clock. A metaclass keeps instances of
+ * the original class passing isinstance checks against the replacement.
+ */
+static int patch_datetime_class(PyObject* datetime, const char* name, PyMethodDef** methods, PyObject* module) {
+	PyObject* original = PyObject_GetAttrString(datetime, name);
+	if (original == NULL) {
+		return -1;
+	}
+	PyObject* self = PyTuple_Pack(1, original);
+	PyObject* check = self == NULL ? NULL : PyCFunction_New(&instancecheck_def, self);
+	Py_XDECREF(self);
+	PyObject* meta = check == NULL ? NULL : PyObject_CallFunction(
+		(PyObject*)&PyType_Type, "s(O){sO}", "virtual_clock_meta", Py_TYPE(original), "__instancecheck__", check
+	);
+	Py_XDECREF(check);
+	PyObject* namespace = meta == NULL ? NULL : PyDict_New();
+	int result = namespace == NULL ? -1 : 0;
+	for (; result == 0 && *methods != NULL; ++methods) {
+		result = add_classmethod(namespace, *methods, module);
+	}
+	PyObject* module_name = result < 0 ? NULL : PyUnicode_FromString("datetime");
+	result = module_name == NULL ? -1 : PyDict_SetItemString(namespace, "__module__", module_name);
+	Py_XDECREF(module_name);
+	PyObject* replacement = result < 0 ? NULL : PyObject_CallFunction(meta, "s(O)O", name, original, namespace);
+	Py_XDECREF(namespace);
+	Py_XDECREF(meta);
+	Py_DECREF(original);
+	if (replacement == NULL) {
+		return -1;
+	}
+	result = PyObject_SetAttrString(datetime, name, replacement);
+	Py_DECREF(replacement);
+	return result;
+}
+
+/*
+ * Replace module_name.name with def, keeping the original as real_<name> on this module.
+ */
+static int patch_function(const char* module_name, PyMethodDef* def, PyObject* module) {
+	const char* name = def->ml_name;
+	PyObject* target = PyImport_ImportModule(module_name);
+	if (target == NULL) {
+		return -1;
+	}
+	PyObject* original = PyObject_GetAttrString(target, name);
+	PyObject* replacement = PyCFunction_New(def, module);
+	int result = original == NULL || replacement == NULL ? -1 : 0;
+	if (result == 0) {
+		char real_name[64];
+		snprintf(real_name, sizeof(real_name), "real_%s", name);
+		result = PyModule_AddObjectRef(module, real_name, original);
+	}
+	if (result == 0) {
+		result = PyObject_SetAttrString(target, name, replacement);
+	}
+	Py_XDECREF(original);
+	Py_XDECREF(replacement);
+	Py_DECREF(target);
+	return result;
+}
+
+static PyObject* next_temp_name(PyObject* module, PyObject* unused) {
+	char name[] = "XXXXXX";
+	if (shim_tempname(name, 0) != 0) {
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	return PyUnicode_FromString(name);
+}
+
+static PyMethodDef next_temp_name_def = {"next_temp_name", next_temp_name, METH_NOARGS, NULL};
+
+/*
+ * tempfile draws every candidate name from tempfile._name_sequence, an
+ * iterator it creates on first use unless one is already there.
+ */
+static int patch_tempfile(PyObject* module) {
+	PyObject* tempfile = PyImport_ImportModule("tempfile");
+	PyObject* next = tempfile == NULL ? NULL : PyCFunction_New(&next_temp_name_def, module);
+	// Never exhausted: next_temp_name only returns strings.
+	PyObject* names = next == NULL ? NULL : PyCallIter_New(next, Py_None);
+	int result = names == NULL ? -1 : PyObject_SetAttrString(tempfile, "_name_sequence", names);
+	Py_XDECREF(names);
+	Py_XDECREF(next);
+	Py_XDECREF(tempfile);
+	return result;
+}
+
+/*
+ * zygote()
+ * Python's side of det_zygote. Returns the child's index, or None when no sweep is running.
+ */
+static PyObject* zygote(PyObject* module, PyObject* unused) {
+	int (*det_zygote)(void) = dlsym(RTLD_DEFAULT, "det_zygote");
+	if (det_zygote == NULL || getenv("DETERMINISTIC_ZYGOTE_SEEDS") == NULL) {
+		Py_RETURN_NONE;
+	}
+	const char* streams[] = {"stdout", "stderr"};
+	for (size_t i = 0; i < 2; ++i) {
+		PyObject* stream = PySys_GetObject(streams[i]);
+		PyObject* result = stream == NULL || stream == Py_None ? NULL : PyObject_CallMethod(stream, "flush", NULL);
+		if (result == NULL) {
+			PyErr_Clear();
+		}
+		Py_XDECREF(result);
+	}
+	PyOS_BeforeFork();
+	int index = det_zygote();
+	if (index < 0) {
+		// No sweep after all (the variable is empty); nothing forked.
+		PyOS_AfterFork_Parent();
+		Py_RETURN_NONE;
+	}
+	PyOS_AfterFork_Child();
+	// Generators seeded at import time would otherwise replay the zygote's draws.
+	PyObject* random = PyImport_ImportModule("random");
+	PyObject* result = random == NULL ? NULL : PyObject_CallMethod(random, "seed", NULL);
+	Py_XDECREF(random);
+	if (result == NULL) {
+		return NULL;
+	}
+	Py_DECREF(result);
+	PyObject* numpy_random = PyDict_GetItemString(PyImport_GetModuleDict(), "numpy.random");
+	if (numpy_random != NULL) {
+		result = PyObject_CallMethod(numpy_random, "seed", NULL);
+		if (result == NULL) {
+			return NULL;
+		}
+		Py_DECREF(result);
+	}
+	return PyLong_FromLong(index);
+}
+
+static PyMethodDef id_def = {"id", deterministic_id, METH_O, "Deterministic id(): a counter per live object"};
+static PyMethodDef time_def = {"time", virtual_time, METH_NOARGS, "Virtual-clock time.time()"};
+static PyMethodDef time_ns_def = {"time_ns", virtual_time_ns, METH_NOARGS, "Virtual-clock time.time_ns()"};
+
+static PyMethodDef module_methods[] = {
+	{"table_size", table_size, METH_NOARGS, "Number of id table entries, including those of dead untracked objects"},
+	{"zygote", zygote, METH_NOARGS, "Fork one child per sweep seed here (see det_zygote); returns the child's index"},
+	{NULL},
+};
+
+static struct PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "patch_nondeterminism",
+	.m_doc = "Deterministic id(), virtual-clock time and temporary names for Python programs",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+PyMODINIT_FUNC PyInit_patch_nondeterminism(void) {
+	PyObject* module = PyModule_Create(&module_def);
+	if (module == NULL) {
+		return NULL;
+	}
+	if (setup_tracking(module) < 0 || patch_function("builtins", &id_def, module) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	shim_tempname = dlsym(RTLD_DEFAULT, "det_tempname");
+	if (shim_tempname != NULL && patch_tempfile(module) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	shim_clock_gettime = dlsym(RTLD_DEFAULT, "det_clock_gettime");
+	if (shim_clock_gettime != NULL) {
+		PyObject* datetime = PyImport_ImportModule("datetime");
+		static PyMethodDef* datetime_methods[] = {&virtual_now_def, &virtual_utcnow_def, &virtual_today_def, NULL};
+		static PyMethodDef* date_methods[] = {&virtual_today_def, NULL};
+		if (
+			datetime == NULL
+			|| patch_datetime_class(datetime, "date", date_methods, module) < 0
+			|| patch_datetime_class(datetime, "datetime", datetime_methods, module) < 0
+			|| patch_function("time", &time_def, module) < 0
+			|| patch_function("time", &time_ns_def, module) < 0
+		) {
+			Py_XDECREF(datetime);
+			Py_DECREF(module);
+			return NULL;
+		}
+		Py_DECREF(datetime);
+	}
+	return module;
+}
@@ -1,4 +1,9 @@
 #!/usr/bin/env sh
 
+# Needs the launcher and the shim built next to this script:
+#   gcc -O2 -Wall -Werror -o deterministic-run deterministic_run.c -ldl
+#   gcc -O2 -Wall -Werror -fPIC -shared -o deterministic_random_preload.so deterministic_random_preload.c
+# Jobs run at the same time need distinct DETERMINISTIC_NAMESPACE values
+# for their temporary names not to collide.
 directory=$(dirname $0)
-env FAKETIME='2022-01-01 00:00:00' LD_PRELOAD=/usr/lib/x86_64-linux-gnu/faketime/libfaketime.so.1:$directory/deterministic_random_preload.so $@
+exec $directory/deterministic-run --config $directory/deterministic-run.conf -- "$@"
@@ -1,5 +1,7 @@
+import os
 import subprocess
 import itertools
+import json
 from pathlib import Path
 import sys
 import tempfile
@@ -43,3 +45,931 @@ def test_python_scripts(compiled_binary: Path, command: list[str]) -> None:
         capture_output=True,
     ).stdout
     assert proc0 == proc1
+
+
+cpp_program = r"""
+#include <iostream>
+#include <random>
+#include "deterministic.hpp"
+
+int main() {
+    det::stream rng(7);
+    std::uniform_int_distribution<int> dist(0, 99);
+    for (int i = 0; i < 5; ++i) {
+        std::cout << dist(rng) << " ";
+    }
+    det::stream child = rng.split();
+    std::cout << child() << " ";
+    rng.seek(3);
+    auto third = rng();
+    rng.seek(3);
+    std::cout << (third == rng()) << " " << rng.deterministic() << std::endl;
+}
+"""
+
+
+@pytest.fixture
+def compiled_cpp_program() -> Path:
+    with tempfile.TemporaryDirectory() as _path:
+        source = Path(_path) / "program.cpp"
+        source.write_text(cpp_program)
+        path = Path(_path) / "program"
+        subprocess.run(
+            ["g++", "-O2", "-Wall", "-Werror", f"-I{Path(__file__).parent}", "-o", path, source],
+            check=True,
+        )
+        yield path
+
+
+def test_cpp_api(compiled_binary: Path, compiled_cpp_program: Path) -> None:
+    prefix = ["env", f"LD_PRELOAD={compiled_binary}"]
+    proc0 = subprocess.run([*prefix, compiled_cpp_program], check=True, capture_output=True).stdout
+    proc1 = subprocess.run([*prefix, compiled_cpp_program], check=True, capture_output=True).stdout
+    assert proc0 == proc1
+    assert proc0.endswith(b"1 1\n")
+    fallback = subprocess.run([compiled_cpp_program], check=True, capture_output=True).stdout
+    assert fallback.endswith(b"0\n")
+
+
+def compile_extension(name: str, directory: Path, include_dirs: list[str]) -> Path:
+    import sysconfig
+    path = directory / (name + sysconfig.get_config_var("EXT_SUFFIX"))
+    subprocess.run(
+        [
+            "gcc", "-O2", "-Wall", "-Werror", "-fPIC", "-shared",
+            f"-I{sysconfig.get_paths()['include']}", *(f"-I{include}" for include in include_dirs),
+            "-o", path, f"{name}.c",
+        ],
+        check=True,
+    )
+    return path
+
+
+@pytest.fixture
+def compiled_numpy_extension() -> Path:
+    import numpy
+    with tempfile.TemporaryDirectory() as _path:
+        yield compile_extension("deterministic_numpy", Path(_path), [numpy.get_include()])
+
+
+def test_numpy_bit_generator(compiled_binary: Path, compiled_numpy_extension: Path) -> None:
+    command = "\n".join([
+        "import numpy, deterministic_numpy",
+        "bitgen = deterministic_numpy.ShimBitGenerator()",
+        "print(numpy.random.Generator(bitgen).random(10), bitgen.random_raw(4), bitgen.deterministic)",
+        "import threading",
+        "drawing = threading.Thread(target=bitgen.random_raw, args=(4,))",
+        "with bitgen.lock:",
+        "    drawing.start()",
+        "    drawing.join(0.2)",
+        "    assert drawing.is_alive()",
+        "drawing.join()",
+        "deterministic_numpy.install()",
+        "print(numpy.random.permutation(10))",
+    ])
+    env = {"PYTHONPATH": str(compiled_numpy_extension.parent)}
+    prefix = ["env", f"LD_PRELOAD={compiled_binary}"]
+    proc0 = subprocess.run([*prefix, sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout
+    proc1 = subprocess.run([*prefix, sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout
+    assert proc0 == proc1
+    assert b"True" in proc0
+    fallback = subprocess.run([sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout
+    assert b"False" in fallback
+
+
+@pytest.fixture
+def compiled_patch_extension() -> Path:
+    with tempfile.TemporaryDirectory() as _path:
+        yield compile_extension("patch_nondeterminism", Path(_path), [])
+
+
+def test_patch_nondeterminism(compiled_binary: Path, compiled_patch_extension: Path) -> None:
+    command = "\n".join([
+        "import patch_nondeterminism, datetime, time",
+        "print(id(object()), id([]), id(()), datetime.datetime.now(), datetime.date.today(), time.time())",
+        "for i in range(10000):",
+        "    id([i]), id(object()), id(str(i))",
+        "print(patch_nondeterminism.table_size() < 100, isinstance(datetime.datetime.now(), datetime.date))",
+    ])
+    env = {"PYTHONPATH": str(compiled_patch_extension.parent)}
+    prefix = ["env", f"LD_PRELOAD={compiled_binary}"]
+    proc0 = subprocess.run([*prefix, sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout
+    proc1 = subprocess.run([*prefix, sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout
+    assert proc0 == proc1
+    assert b"2022-01-01" in proc0
+    assert proc0.endswith(b"True True\n")
+
+
+def test_patch_keeps_trashcan(compiled_patch_extension: Path) -> None:
+    # Freeing a deeply nested list needs CPython's trashcan, which checks list's tp_dealloc.
+    command = "import patch_nondeterminism; id([]); id(()); id({}); x = None\nfor _ in range(10**6): x = [x]\ndel x; print('ok')"
+    env = {"PYTHONPATH": str(compiled_patch_extension.parent)}
+    assert subprocess.run([sys.executable, "-c", command], env=env, check=True, capture_output=True).stdout == b"ok\n"
+
+
+def test_zygote_sweep(compiled_binary: Path, compiled_patch_extension: Path) -> None:
+    command = "\n".join([
+        "import patch_nondeterminism, random",
+        "index = patch_nondeterminism.zygote()",
+        "print(index, random.random())",
+    ])
+    with tempfile.TemporaryDirectory() as _output:
+        output = Path(_output)
+        subprocess.run(
+            [
+                sys.executable, "deterministic_launcher.py", "sweep", "--preload", compiled_binary,
+                "--seeds", "1,2,1", "--jobs", "2", "--output", output,
+                "--", sys.executable, "-c", command,
+            ],
+            env={**os.environ, "PYTHONPATH": str(compiled_patch_extension.parent)},
+            check=True,
+        )
+        draws = [(output / f"{index}.stdout").read_text().split()[1] for index in range(3)]
+    assert draws[0] == draws[2]
+    assert draws[0] != draws[1]
+    # An empty seed list means no sweep: the caller stays the parent.
+    command = "import patch_nondeterminism, threading, time; thread = threading.Thread(target=time.sleep, args=(1,)); thread.start(); print(patch_nondeterminism.zygote(), thread.is_alive())"
+    no_sweep = subprocess.run(
+        ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_ZYGOTE_SEEDS=", sys.executable, "-c", command],
+        env={**os.environ, "PYTHONPATH": str(compiled_patch_extension.parent)},
+        check=True,
+        capture_output=True,
+    ).stdout
+    assert no_sweep == b"None True\n"
+
+
+temp_names_command = """
+import ctypes, os, patch_nondeterminism, tempfile
+def libc_name():
+    template = ctypes.create_string_buffer(b"/tmp/detXXXXXX")
+    ctypes.CDLL(None).mktemp(template)
+    return template.value.decode()
+names = [tempfile.mktemp(), libc_name(), libc_name()]
+read, write = os.pipe()
+if os.fork() == 0:
+    os.write(write, libc_name().encode())
+    os._exit(0)
+os.wait()
+names.append(os.read(read, 100).decode())
+print(" ".join(names))
+"""
+
+
+def test_temp_names(compiled_binary: Path, compiled_patch_extension: Path) -> None:
+    def names(namespace: str) -> list[str]:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_NAMESPACE={namespace}", sys.executable, "-c", temp_names_command],
+            env={"PYTHONPATH": str(compiled_patch_extension.parent)},
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout.split()
+    first = names("job1")
+    assert first == names("job1")
+    assert len(set(first[1:])) == 3
+    assert set(first).isdisjoint(names("job2"))
+
+
+virtual_timer_command = """
+import signal, time
+ticks = []
+signal.signal(signal.SIGALRM, lambda *_: ticks.append(i))
+signal.setitimer(signal.ITIMER_REAL, 0.25, 0.25)
+start = time.monotonic()
+for i in range(40):
+    time.sleep(0.1)
+signal.setitimer(signal.ITIMER_REAL, 0)
+signal.alarm(60)
+signal.pause()
+print(ticks, time.monotonic() - start)
+"""
+
+
+def test_virtual_timers(compiled_binary: Path) -> None:
+    def run() -> str:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_VIRTUAL_CLOCK=1", sys.executable, "-c", virtual_timer_command],
+            check=True,
+            capture_output=True,
+            text=True,
+            # 64 virtual seconds of sleeping and waiting must not take real time.
+            timeout=20,
+        ).stdout
+    output = run()
+    assert output == run()
+    ticks, elapsed = output.rsplit(" ", 1)
+    assert ticks.startswith("[2, 4, 7, 9, ")
+    assert abs(float(elapsed) - 64) < 0.01
+
+
+timer_thread_program = r"""
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STACK_SIZE (3 << 20)
+
+sem_t fired;
+
+void tick(union sigval value) {
+	pthread_attr_t attributes;
+	size_t stack_size = 0;
+	pthread_getattr_np(pthread_self(), &attributes);
+	pthread_attr_getstacksize(&attributes, &stack_size);
+	pthread_attr_destroy(&attributes);
+	printf("%d %d\n", value.sival_int, stack_size >= STACK_SIZE);
+	fflush(stdout);
+	sem_post(&fired);
+}
+
+timer_t start(pthread_attr_t* attributes, int value) {
+	struct sigevent event = {0};
+	event.sigev_notify = SIGEV_THREAD;
+	event.sigev_notify_function = tick;
+	event.sigev_notify_attributes = attributes;
+	event.sigev_value.sival_int = value;
+	timer_t timer;
+	timer_create(CLOCK_MONOTONIC, &event, &timer);
+	return timer;
+}
+
+int main() {
+	sem_init(&fired, 0, 0);
+	pthread_attr_t kept;
+	pthread_attr_t dropped;
+	pthread_attr_init(&kept);
+	pthread_attr_init(&dropped);
+	pthread_attr_setstacksize(&kept, STACK_SIZE);
+	pthread_attr_setstacksize(&dropped, STACK_SIZE);
+	timer_t timers[2] = {start(&kept, 1), start(&dropped, 2)};
+	// Callers may destroy the attributes as soon as timer_create returns.
+	pthread_attr_destroy(&dropped);
+	memset(&dropped, 0xff, sizeof(dropped));
+	struct itimerspec first = {{0, 0}, {1, 0}};
+	struct itimerspec second = {{0, 0}, {2, 0}};
+	timer_settime(timers[0], 0, &first, NULL);
+	timer_settime(timers[1], 0, &second, NULL);
+	sleep(3);
+	sem_wait(&fired);
+	sem_wait(&fired);
+	int detached;
+	pthread_attr_getdetachstate(&kept, &detached);
+	printf("%s\n", detached == PTHREAD_CREATE_JOINABLE ? "joinable" : "detached");
+	return 0;
+}
+"""
+
+
+def test_virtual_timer_threads(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        (directory / "program.c").write_text(timer_thread_program)
+        subprocess.run(["gcc", "-O2", "-o", directory / "program", directory / "program.c", "-lpthread", "-lrt"], check=True)
+        output = subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_VIRTUAL_CLOCK=1", directory / "program"],
+            check=True,
+            capture_output=True,
+            text=True,
+            timeout=20,
+        ).stdout
+    assert output.splitlines() == ["1 1", "2 1", "joinable"]
+
+
+epoll_command = """
+import ctypes, os, select
+poller = select.epoll()
+pipes = [os.pipe() for _ in range(5)]
+for i, (read, write) in enumerate(pipes):
+    poller.register(read, select.EPOLLIN)
+# Ready last-registered first; the kernel reports readiness in that order.
+for read, write in reversed(pipes):
+    os.write(write, b"x")
+reads = [read for read, write in pipes]
+print([reads.index(fd) for fd, _ in poller.poll()])
+# EPOLL_CTL_ADD without an event fails with EFAULT.
+libc = ctypes.CDLL(None, use_errno=True)
+assert libc.epoll_ctl(poller.fileno(), 1, os.pipe()[0], None) == -1 and ctypes.get_errno() == 14
+"""
+
+
+@pytest.mark.parametrize("order", ["registration", "settled"])
+def test_epoll_order(compiled_binary: Path, order: str) -> None:
+    def run(order: str) -> str:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_EPOLL_ORDER={order}", sys.executable, "-c", epoll_command],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout.strip()
+    assert run("native") == "[4, 3, 2, 1, 0]"
+    assert run(order) == "[0, 1, 2, 3, 4]"
+
+
+read_chunks_command = """
+import os, socket, sys, time
+if sys.argv[1] == "pipe":
+    read, write = os.pipe()
+    receive, send = lambda: os.read(read, 1000), lambda data: os.write(write, data)
+else:
+    left, right = socket.socketpair()
+    receive, send = lambda: left.recv(1000), right.send
+if os.fork() == 0:
+    for _ in range(25):
+        send(b"x" * 100)
+        time.sleep(0.002)
+    os._exit(0)
+if sys.argv[1] == "pipe":
+    os.close(write)
+else:
+    right.close()
+sizes = []
+while chunk := receive():
+    sizes.append(len(chunk))
+print(sizes)
+"""
+
+
+@pytest.mark.parametrize("kind", ["pipe", "socket"])
+def test_read_chunks(compiled_binary: Path, kind: str) -> None:
+    def run(chunks: str) -> str:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_READ_CHUNKS={chunks}", sys.executable, "-c", read_chunks_command, kind],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout.strip()
+    assert run("native") != "[1000, 1000, 500]"
+    assert run("full") == "[1000, 1000, 500]"
+    assert run("300") == "[300, 300, 300, 300, 300, 300, 300, 300, 100]"
+
+
+watch_command = """
+import ctypes, os, struct, sys, tempfile
+libc = ctypes.CDLL(None, use_errno=True)
+IN_MODIFY, IN_CREATE, IN_DELETE = 0x2, 0x100, 0x200
+directory = tempfile.mkdtemp()
+fd = libc.inotify_init1(0)
+libc.inotify_add_watch(fd, directory.encode(), IN_MODIFY | IN_CREATE | IN_DELETE)
+# "name" appends to the file, "-name" deletes it.
+for step in sys.argv[1].split():
+    path = os.path.join(directory, step.lstrip("-"))
+    if step.startswith("-"):
+        os.remove(path)
+    else:
+        with open(path, "a") as file:
+            file.write("x")
+events, buffer = [], os.read(fd, 4096)
+while buffer:
+    wd, mask, cookie, length = struct.unpack("iIII", buffer[:16])
+    events.append(buffer[16:16 + length].rstrip(b"\\0").decode() + ("+" if mask & IN_CREATE else "-" if mask & IN_DELETE else "~"))
+    buffer = buffer[16 + length:]
+print(" ".join(events))
+"""
+
+
+def test_watch_window(compiled_binary: Path) -> None:
+    def run(steps: str, *window: str) -> str:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", *window, sys.executable, "-c", watch_command, steps],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout.strip()
+    assert run("c b a c") == "c+ c~ b+ b~ a+ a~ c~"
+    assert run("c b a c", "DETERMINISTIC_WATCH_WINDOW=20") == "a+ a~ b+ b~ c+ c~"
+    # Only back-to-back repeats merge; the file exists at the end.
+    assert run("a -a a -a a", "DETERMINISTIC_WATCH_WINDOW=20") == "a+ a~ a- a+ a~ a- a+ a~"
+
+
+virtual_cpus_command = """
+import ctypes, threading
+libc = ctypes.CDLL(None)
+cpus = [libc.sched_getcpu()]
+for _ in range(5):
+    thread = threading.Thread(target=lambda: cpus.append(libc.sched_getcpu()))
+    thread.start()
+    thread.join()
+print(cpus)
+"""
+
+
+def test_virtual_cpus(compiled_binary: Path) -> None:
+    output = subprocess.run(
+        ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_VIRTUAL_CPUS=4", "DETERMINISTIC_DISABLE_RSEQ=1", sys.executable, "-c", virtual_cpus_command],
+        check=True,
+        capture_output=True,
+        text=True,
+    ).stdout.strip()
+    assert output == "[0, 1, 2, 3, 0, 1]"
+
+
+placement_command = """
+import os, threading
+placements = [sorted(os.sched_getaffinity(0))]
+for _ in range(4):
+    thread = threading.Thread(target=lambda: placements.append(sorted(os.sched_getaffinity(0))))
+    thread.start()
+    thread.join()
+print(placements)
+"""
+
+
+@pytest.mark.parametrize("policy", ["compact", "spread"])
+def test_thread_placement(compiled_binary: Path, policy: str) -> None:
+    def run() -> list[list[int]]:
+        return eval(subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_PLACEMENT={policy}", sys.executable, "-c", placement_command],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout)
+    placements = run()
+    assert placements == run()
+    assert all(len(cpus) == 1 for cpus in placements)
+    assert len({cpus[0] for cpus in placements}) == min(5, len(os.sched_getaffinity(0)))
+
+
+placement_children_command = """
+import os, subprocess, sys
+show = "import os; print(sorted(os.sched_getaffinity(0)), os.environ['DETERMINISTIC_PLACEMENT_CPUS'])"
+subprocess.run([sys.executable, "-c", show], check=True)
+sys.stdout.flush()
+if os.fork() == 0:
+    exec(show)
+    os._exit(0)
+os.wait()
+"""
+
+
+def test_thread_placement_children(compiled_binary: Path) -> None:
+    # Children must place themselves within the original mask, not the CPU their parent was pinned to.
+    output = subprocess.run(
+        ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_PLACEMENT=compact", sys.executable, "-c", placement_children_command],
+        check=True,
+        capture_output=True,
+        text=True,
+    ).stdout.splitlines()
+    allowed = sorted(os.sched_getaffinity(0))
+    children = [eval(line.split(" ")[0]) for line in output]
+    assert all(len(cpus) == 1 and cpus[0] in allowed for cpus in children)
+    if len(allowed) > 2:
+        assert children[0] != children[1]
+    def parse(cpulist: str) -> list[int]:
+        ranges = [part.partition("-") for part in cpulist.split(",")]
+        return [cpu for first, _, last in ranges for cpu in range(int(first), int(last or first) + 1)]
+    assert all(parse(line.split(" ")[1]) == allowed for line in output)
+
+
+placement_tree_command = """
+import os, threading
+def show():
+    os.write(1, f"{sorted(os.sched_getaffinity(0))}\\n".encode())
+show()
+for _ in range(2):
+    if os.fork() == 0:
+        show()
+        threads = [threading.Thread(target=show) for _ in range(2)]
+        [thread.start() for thread in threads]
+        [thread.join() for thread in threads]
+        os._exit(0)
+os.wait()
+os.wait()
+"""
+
+
+def test_thread_placement_tree(compiled_binary: Path) -> None:
+    # Forked children and their threads each take a CPU of their own, rather than one derived from the lineage.
+    allowed = sorted(os.sched_getaffinity(0))
+    def run(*env: str) -> list[list[int]]:
+        output = subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_PLACEMENT=compact", *env, sys.executable, "-c", placement_tree_command],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+        return [eval(line) for line in output.splitlines()]
+    placed = run()
+    assert len(placed) == 7 and all(len(cpus) == 1 and cpus[0] in allowed for cpus in placed)
+    if len(allowed) >= len(placed):
+        assert len({cpus[0] for cpus in placed}) == len(placed)
+    with tempfile.TemporaryDirectory() as _directory:
+        slots = Path(_directory) / "slots"
+        slots.write_bytes(bytes(8))
+        run(f"DETERMINISTIC_PLACEMENT_CPUS={','.join(map(str, allowed))}", f"DETERMINISTIC_PLACEMENT_SLOTS={slots}")
+        assert int.from_bytes(slots.read_bytes(), sys.byteorder) == 7
+
+
+def test_fuzz_and_replay(compiled_binary: Path) -> None:
+    # Fails only when children are reaped oldest-first.
+    command = "\n".join([
+        "import os, sys, time",
+        "for i in range(2):",
+        "    if os.fork() == 0:",
+        "        time.sleep((2 - i) * 0.05)",
+        "        os._exit(i)",
+        "sys.exit([os.waitstatus_to_exitcode(os.wait()[1]) for _ in range(2)] == [0, 1])",
+    ])
+    launcher = [sys.executable, "deterministic_launcher.py"]
+    with tempfile.TemporaryDirectory() as _output:
+        failures = Path(_output) / "failures.jsonl"
+        fuzz = subprocess.run(
+            [*launcher, "fuzz", "--preload", compiled_binary, "--seeds", "1,2", "--reap-orders", "native,fifo", "--failures", failures, "--", sys.executable, "-c", command],
+        )
+        assert fuzz.returncode == 1
+        records = [json.loads(line) for line in failures.read_text().splitlines()]
+        assert [record["config"]["reap_order"] for record in records] == ["fifo", "fifo"]
+        assert all(record["minimal"] == {"seed": 12345, "clock_step": 1000, "reap_order": "fifo"} for record in records)
+        replay = subprocess.run([*launcher, "replay", "--preload", compiled_binary, "--failures", failures, "--minimal"])
+        assert replay.returncode == 1
+
+
+def test_batch(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        jobs = directory / "jobs.txt"
+        jobs.write_text("\n".join([
+            f"{sys.executable} -c 'import random; print(random.random())'",
+            json.dumps({
+                "id": "writer",
+                "command": [sys.executable, "-c", f"import os; open({str(directory / 'out')!r}, 'wb').write(os.urandom(8))"],
+                "outputs": [str(directory / "out")],
+            }),
+            json.dumps({"id": "broken", "command": "exit 3", "outputs": [str(directory / "never")]}),
+        ]))
+        first = directory / "first.tsv"
+        second = directory / "second.tsv"
+        run = subprocess.run(["./det-batch", jobs, "--preload", compiled_binary, "--ledger", first])
+        assert run.returncode == 1
+        run = subprocess.run(["./det-batch", jobs, "--preload", compiled_binary, "--ledger", second, "--audit", first])
+        # 2 would mean the audit found a digest that changed between runs.
+        assert run.returncode == 1
+        rows = {line.split("\t")[0]: line.split("\t") for line in first.read_text().splitlines()[1:]}
+        assert rows.keys() == {"0", "writer", "broken"}
+        assert rows["broken"][2] == "3"
+        assert rows["broken"][4] == "missing"
+        assert rows["writer"][4] != "-"
+        assert rows["0"][1] != rows["broken"][1]
+
+
+def test_audit(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        report = Path(_directory) / "audit.txt"
+        subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_AUDIT={report}", sys.executable, "-c", "import os; os.getpid(); os.listdir('.')"],
+            check=True,
+        )
+        sources = {line.split()[0] for line in report.read_text().splitlines()[1:]}
+    assert {"getpid", "readdir64"} <= sources
+    assert "getrandom" not in sources
+
+
+scan_target = r"""
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <x86intrin.h>
+
+int main() {
+    unsigned char buffer[4];
+    getrandom(buffer, sizeof(buffer), 0);
+    printf("%d %llu %d\n", getpid(), (unsigned long long)__rdtsc(), buffer[0]);
+}
+"""
+
+
+def test_scan(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        (directory / "target.c").write_text(scan_target)
+        subprocess.run(["gcc", "-O2", "-Wall", "-Werror", "-o", directory / "scan", "deterministic_scan.c"], check=True)
+        (directory / "bin").mkdir()
+        subprocess.run(["gcc", "-O2", "-o", directory / "bin" / "target", directory / "target.c"], check=True)
+        output = subprocess.run(
+            [directory / "scan", "--shim", compiled_binary, directory / "bin"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+    header, *lines = output.splitlines()
+    rows = [dict(zip(header.split("\t"), line.split("\t"))) for line in lines]
+    assert len(rows) == 1
+    assert rows[0]["linkage"] == "dynamic"
+    assert rows[0]["prediction"] == "partial"
+    assert "getrandom" in rows[0]["covered"].split(",")
+    assert "getpid" in rows[0]["uncovered"].split(",")
+    assert "target" in rows[0]["rdtsc"].split(",")
+
+
+vm_child_program = r"""
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+
+extern char** environ;
+static int draw_in_child;
+
+static void draw(unsigned char* out) { getrandom(out, 8, 0); }
+
+static int clone_child(void* arg) {
+    unsigned char b[8];
+    if (draw_in_child) draw(b);
+    if (arg != NULL) _exit(0);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    draw_in_child = argc > 1;
+    unsigned char b[8];
+    pid_t pid = vfork();
+    if (pid == 0) {
+        if (draw_in_child) draw(b);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    draw(b); printf("%02x%02x ", b[0], b[1]);
+    char* stack = malloc(65536);
+    pid = clone(clone_child, stack + 65536, CLONE_VM | SIGCHLD, NULL);
+    waitpid(pid, NULL, 0);
+    draw(b); printf("%02x%02x ", b[0], b[1]);
+    // Exits without returning from fn, so only the reap releases it.
+    pid = clone(clone_child, stack + 65536, CLONE_VM | SIGCHLD, stack);
+    waitpid(pid, NULL, 0);
+    draw(b); printf("%02x%02x ", b[0], b[1]);
+    printf("%d ", clone(clone_child, NULL, CLONE_VM | SIGCHLD, NULL) == -1 && errno == EINVAL);
+    char* args[] = {"/bin/true", NULL};
+    posix_spawn(&pid, "/bin/true", NULL, NULL, args, environ);
+    waitpid(pid, NULL, 0);
+    draw(b); printf("%02x%02x\n", b[0], b[1]);
+}
+"""
+
+
+def test_vm_children_keep_parent_stream(compiled_binary: Path) -> None:
+    # The parent's draws must not depend on whether its CLONE_VM children draw.
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        (directory / "program.c").write_text(vm_child_program)
+        subprocess.run(["gcc", "-O2", "-o", directory / "program", directory / "program.c"], check=True)
+        prefix = ["env", f"LD_PRELOAD={compiled_binary}", directory / "program"]
+        quiet = subprocess.run(prefix, check=True, capture_output=True).stdout
+        drawing = subprocess.run([*prefix, "draw"], check=True, capture_output=True).stdout
+    assert quiet == drawing
+
+
+scrubbing_program = r"""
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+int main(void) {
+    char* empty[] = {NULL};
+    char* show[] = {"sh", "-c", "echo $LD_PRELOAD $DETERMINISTIC_SEED", NULL};
+    pid_t pid;
+    posix_spawnp(&pid, "sh", NULL, NULL, show, empty);
+    waitpid(pid, NULL, 0);
+    if (vfork() == 0) {
+        execve("/bin/sh", show, empty);
+        _exit(1);
+    }
+    wait(NULL);
+    clearenv();
+    execvp("sh", show);
+    return 1;
+}
+"""
+
+
+def test_scrubbed_environment_keeps_shim(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        (directory / "program.c").write_text(scrubbing_program)
+        subprocess.run(["gcc", "-O2", "-o", directory / "program", directory / "program.c"], check=True)
+        output = subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_SEED=5", directory / "program"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+        env_i = subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", "env", "-i", "LD_PRELOAD=/dev/null", "sh", "-c", "echo $LD_PRELOAD"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+    assert output.splitlines() == [f"{compiled_binary} 5"] * 3
+    assert env_i.strip() == f"/dev/null:{compiled_binary}"
+
+
+def test_library_policy(compiled_binary: Path) -> None:
+    def draws(action: str) -> list[str]:
+        with tempfile.TemporaryDirectory() as _directory:
+            policy = Path(_directory) / "policy"
+            policy.write_text(f"# Python calls getrandom from its executable or libpython.\n*python* {action}\n")
+            return [
+                subprocess.run(
+                    ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_POLICY={policy}", sys.executable, "-c", "import os; print(os.urandom(8).hex())"],
+                    check=True,
+                    capture_output=True,
+                    text=True,
+                ).stdout
+                for _ in range(2)
+            ]
+    deterministic = draws("deterministic")
+    stream = draws("stream")
+    real = draws("real")
+    assert deterministic[0] == deterministic[1]
+    assert stream[0] == stream[1]
+    assert stream[0] != deterministic[0]
+    assert real[0] != real[1]
+
+
+entropy_paths_command = """
+import os
+def draw(path):
+    try:
+        fd = os.open(path, os.O_RDONLY)
+    except OSError as error:
+        return "open " + error.strerror
+    try:
+        return os.read(fd, 8).hex()
+    except OSError as error:
+        return "read " + error.strerror
+    finally:
+        os.close(fd)
+print("|".join(draw(path) for path in ["/dev/urandom", "/dev/hwrng", "/opt/vendor/seed.bin", "/dev/random", "/dev/arandom"]))
+"""
+
+
+def test_entropy_paths(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        rules = Path(_directory) / "entropy_paths"
+        rules.write_text("\n".join([
+            "/dev/hwrng stream=hwrng limit=4",
+            "/opt/vendor/seed* stream=vendor",
+            "/dev/random read_error=EAGAIN",
+            "/dev/arandom open_error=ENOENT",
+        ]))
+        outputs = [
+            subprocess.run(
+                ["env", f"LD_PRELOAD={compiled_binary}", f"DETERMINISTIC_ENTROPY_PATHS={rules}", sys.executable, "-c", entropy_paths_command],
+                check=True,
+                capture_output=True,
+                text=True,
+            ).stdout
+            for _ in range(2)
+        ]
+    assert outputs[0] == outputs[1]
+    urandom, hwrng, vendor, random_error, arandom_error = outputs[0].strip().split("|")
+    assert len(urandom) == 16 and len(hwrng) == 8 and len(vendor) == 16
+    assert urandom[:8] != hwrng
+    assert random_error.startswith("read ")
+    assert arandom_error.startswith("open ")
+
+
+def test_open_null_path(compiled_binary: Path) -> None:
+    command = "import ctypes; libc = ctypes.CDLL(None, use_errno=True); print(libc.open(None, 0), ctypes.get_errno())"
+    output = subprocess.run(["env", f"LD_PRELOAD={compiled_binary}", sys.executable, "-c", command], check=True, capture_output=True, text=True).stdout
+    assert output.split() == ["-1", "14"]
+
+
+def test_rank_streams(compiled_binary: Path) -> None:
+    def draw(**env: str) -> str:
+        return subprocess.run(
+            ["env", f"LD_PRELOAD={compiled_binary}", *(f"{key}={value}" for key, value in env.items()), sys.executable, "-c", "import os; print(os.urandom(8).hex())"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+    ranks = [draw(OMPI_COMM_WORLD_RANK=str(rank), OMPI_COMM_WORLD_SIZE="2") for rank in range(2)]
+    assert ranks[0] != ranks[1]
+    assert ranks[0] != draw()
+    assert ranks[1] == draw(OMPI_COMM_WORLD_RANK="1", OMPI_COMM_WORLD_SIZE="2")
+    assert ranks[1] == draw(DETERMINISTIC_RANK_VAR="MY_RANK", MY_RANK="1", DETERMINISTIC_SIZE_VAR="MY_SIZE", MY_SIZE="2")
+    assert ranks[1] != draw(OMPI_COMM_WORLD_RANK="1", OMPI_COMM_WORLD_SIZE="3")
+
+
+lazy_io_command = """
+import os
+fd = os.open("/dev/urandom", os.O_RDONLY)
+first = bytearray(4)
+os.readv(fd, [first])
+print(os.read(fd, 8).hex(), first.hex())
+os.close(fd)
+"""
+
+
+def test_lazy_io_hooks(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        lazy = Path(_directory) / "lazy.so"
+        subprocess.run(
+            ["gcc", "-O2", "-Wall", "-Werror", "-fPIC", "-shared", "-DLAZY_IO_HOOKS=true", "-o", lazy, "deterministic_random_preload.c"],
+            check=True,
+        )
+        exported = subprocess.run(["nm", "-D", "--defined-only", lazy], check=True, capture_output=True, text=True).stdout.split()
+        assert "read" not in exported and "close" not in exported
+        outputs = [
+            subprocess.run(["env", f"LD_PRELOAD={preload}", sys.executable, "-c", lazy_io_command], check=True, capture_output=True).stdout
+            for preload in [compiled_binary, lazy]
+        ]
+        chunks = subprocess.run(
+            ["env", f"LD_PRELOAD={lazy}", "DETERMINISTIC_READ_CHUNKS=full", sys.executable, "-c", read_chunks_command, "pipe"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout.strip()
+    assert outputs[0] == outputs[1]
+    assert chunks == "[1000, 1000, 500]"
+
+
+def test_default_prefix_is_current() -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        generator = Path(_directory) / "generate_default_prefix"
+        subprocess.run(["gcc", "-O2", "-Wall", "-Werror", "-o", generator, "generate_default_prefix.c"], check=True)
+        generated = subprocess.run([generator], check=True, capture_output=True, text=True).stdout
+    assert generated == Path("default_stream_prefix.h").read_text()
+
+
+watchdog_command = """
+import os, sys
+for _ in range(40):
+    os.urandom(16)
+if len(sys.argv) > 1:
+    os.urandom(1)
+for _ in range(40):
+    os.urandom(4)
+"""
+
+
+def test_digest_watchdog(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        reference = Path(_directory) / "reference"
+        def run(mode: str, *args: str) -> subprocess.CompletedProcess[str]:
+            return subprocess.run(
+                ["env", f"LD_PRELOAD={compiled_binary}", "DETERMINISTIC_DIGEST_INTERVAL=16", f"DETERMINISTIC_DIGEST_{mode}={reference}", sys.executable, "-c", watchdog_command, *args],
+                capture_output=True,
+                text=True,
+            )
+        assert run("RECORD").returncode == 0
+        assert Path(f"{reference}.0").read_text().splitlines()[-1].endswith(" exit")
+        assert run("CHECK").returncode == 0
+        diverged = run("CHECK", "diverge")
+    assert diverged.returncode != 0
+    assert "diverged" in diverged.stderr
+    assert "events 33..48" in diverged.stderr
+
+
+def test_namespace_launcher(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        launcher = Path(_directory) / "deterministic_namespace"
+        subprocess.run(["gcc", "-O2", "-Wall", "-Werror", "-o", launcher, "deterministic_namespace.c"], check=True)
+        read = ["head", "-c", "4096", "/dev/urandom"]
+        runs = [subprocess.run([launcher, "--", *read], capture_output=True) for _ in range(2)]
+        if runs[0].returncode == 125:
+            pytest.skip(f"cannot create namespaces: {runs[0].stderr.decode()}")
+        shim = subprocess.run(["env", f"LD_PRELOAD={compiled_binary}", *read], check=True, capture_output=True)
+        # The command's only children are its own, and it keeps our uid.
+        waits = "import os, subprocess; child = subprocess.Popen(['true']); print(os.wait()[0] == child.pid, os.getuid())\ntry:\n    os.wait()\nexcept ChildProcessError:\n    print('none')"
+        children = subprocess.run([launcher, "--", sys.executable, "-c", waits], check=True, capture_output=True, text=True, timeout=30).stdout.split()
+        status = subprocess.run([launcher, "--", "sh", "-c", "exit 3"]).returncode
+    assert runs[0].returncode == 0
+    assert runs[0].stdout == runs[1].stdout == shim.stdout
+    assert children == ["True", str(os.getuid()), "none"]
+    assert status == 3
+
+
+def test_native_launcher(compiled_binary: Path) -> None:
+    with tempfile.TemporaryDirectory() as _directory:
+        directory = Path(_directory)
+        launcher = directory / "deterministic-run"
+        subprocess.run(["gcc", "-O2", "-Wall", "-Werror", "-o", launcher, "deterministic_run.c", "-ldl"], check=True)
+        config = directory / "deterministic-run.conf"
+        config.write_text(f"preload {compiled_binary}\nseed 7\nlimit nofile 512\n")
+        show = ["sh", "-c", "echo $LD_PRELOAD $DETERMINISTIC_SEED $(ulimit -n) $(cat /proc/self/personality)"]
+        run = lambda *args: subprocess.run([launcher, *args], check=True, capture_output=True, text=True).stdout
+        assert run(*show).split() == [str(compiled_binary), "7", "512", "00040000"]
+        assert Path(f"{config}.cache").exists()
+        assert run("--seed", "8", *show).split()[1] == "8"
+        config.write_text(f"preload {compiled_binary}\nseed 9\nnamespace job1\n")
+        assert run(*show).split()[1] == "9"
+        namespace = ["sh", "-c", "echo $DETERMINISTIC_NAMESPACE"]
+        assert run(*namespace).strip() == "job1"
+        assert run("--namespace", "job2", *namespace).strip() == "job2"
+        draw = [sys.executable, "-c", "import random; print(random.random())"]
+        assert run(*draw) == run(*draw)
+        config.write_text(f"preload? libmissing.so.1\npreload {compiled_binary}\n")
+        assert run(*show).split()[0] == str(compiled_binary)
+        config.write_text(f"preload libmissing.so.1\npreload {compiled_binary}\n")
+        assert subprocess.run([launcher, *show], capture_output=True).returncode == 125